@@ -3,12 +3,13 @@
  * License: BSD
  */
 
+#include <functional>
 #include <boost/algorithm/string/replace.hpp>
 #include "buildinhelpers.h"
 
 namespace cpptl {
 
-Value include(TemplateEngine &engine, const Value &context, const Value &args)
+Value include(TemplateEngine &engine, const Value &context, const HelperArgs &args)
 {
     if( args.size() > 0 )
     {
@@ -23,7 +24,7 @@ Value include(TemplateEngine &engine, const Value &context, const Value &args)
     }
 }
 
-Value rawHtml(const Value &, const Value &html)
+Value rawHtml(const Value &, const HelperArgs &html)
 {
     if( html.size() == 1 )
     {
@@ -49,4 +50,208 @@ Value rawHtml(const Value &, const Value &html)
     }
 }
 
+Value unionHelper(const Value &, const HelperArgs &args)
+{
+    return args[0].unite(args[1]);
+}
+
+Value intersectionHelper(const Value &, const HelperArgs &args)
+{
+    return args[0].intersection(args[1]);
+}
+
+Value differenceHelper(const Value &, const HelperArgs &args)
+{
+    return args[0].difference(args[1]);
+}
+
+Value uniqueHelper(const Value &, const HelperArgs &args)
+{
+    return args[0].unique();
+}
+
+// Kernels over packed arrays. Four independent accumulators let the
+// compiler keep them in vector registers and do not wait for the previous
+// addition; sums of doubles may differ from the sequential sum in the last
+// bits.
+template<typename T>
+static T sumItems(const T *items, size_t size)
+{
+    T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+
+    for(; i + 4 <= size; i += 4)
+    {
+        s0 += items[i];
+        s1 += items[i + 1];
+        s2 += items[i + 2];
+        s3 += items[i + 3];
+    }
+
+    for(; i < size; ++i)
+        s0 += items[i];
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+template<typename T, typename Compare>
+static T extremeItem(const T *items, size_t size, Compare better)
+{
+    T m0 = items[0], m1 = items[0], m2 = items[0], m3 = items[0];
+    size_t i = 0;
+
+    for(; i + 4 <= size; i += 4)
+    {
+        m0 = better(items[i], m0) ? items[i] : m0;
+        m1 = better(items[i + 1], m1) ? items[i + 1] : m1;
+        m2 = better(items[i + 2], m2) ? items[i + 2] : m2;
+        m3 = better(items[i + 3], m3) ? items[i + 3] : m3;
+    }
+
+    for(; i < size; ++i)
+        m0 = better(items[i], m0) ? items[i] : m0;
+
+    m0 = better(m1, m0) ? m1 : m0;
+    m2 = better(m3, m2) ? m3 : m2;
+    return better(m2, m0) ? m2 : m0;
+}
+
+struct Aggregate {
+    Aggregate() : items(0), count(0), integers(0), doubles(0), isDouble(false) {}
+
+    Value sum() const {
+        return isDouble ? Value(static_cast<double>(integers) + doubles) : Value(integers);
+    }
+
+    size_t items;       // all the items
+    size_t count;       // numbers seen
+    int64_t integers;
+    double doubles;
+    bool isDouble;      // there was a double
+    Value min;
+    Value max;
+};
+
+// the integers and doubles of an array of Values or a generator, other
+// items are skipped
+static Aggregate aggregate(const Value &array, bool extremes)
+{
+    Aggregate result;
+    Value::ValueIterator it(array);
+
+    while( it.hasNext() )
+    {
+        const Value &item = it.next();
+
+        ++result.items;
+
+        if( item.type() != Value::Int && item.type() != Value::Double )
+            continue;
+
+        ++result.count;
+
+        if( item.type() == Value::Double )
+        {
+            result.doubles += item.toDouble();
+            result.isDouble = true;
+        }
+        else
+        {
+            result.integers += item.toInt64();
+        }
+
+        if( extremes )
+        {
+            if( result.min.isNull() || item.toDouble() < result.min.toDouble() )
+                result.min = item;
+            if( result.max.isNull() || item.toDouble() > result.max.toDouble() )
+                result.max = item;
+        }
+    }
+
+    return result;
+}
+
+// The size of a packed array is known, generators (and lazy arrays) are
+// iterated: their size() is 0
+
+Value sumHelper(const Value &, const HelperArgs &args)
+{
+    const Value array = args[0].resolve();
+
+    if( const int64_t *integers = array.packedIntegers() )
+        return sumItems(integers, array.size());
+    else if( const double *doubles = array.packedDoubles() )
+        return sumItems(doubles, array.size());
+    else
+        return aggregate(array, false).sum();
+}
+
+Value avgHelper(const Value &, const HelperArgs &args)
+{
+    const Value array = args[0].resolve();
+    const size_t size = array.size();
+
+    if( const int64_t *integers = array.packedIntegers() )
+        return size ? Value(static_cast<double>(sumItems(integers, size)) / size) : Value();
+    else if( const double *doubles = array.packedDoubles() )
+        return size ? Value(sumItems(doubles, size) / size) : Value();
+
+    Aggregate result = aggregate(array, false);
+
+    if( result.count == 0 )
+        return Value();
+
+    return result.sum().toDouble() / result.count;
+}
+
+Value minHelper(const Value &, const HelperArgs &args)
+{
+    const Value array = args[0].resolve();
+    const size_t size = array.size();
+
+    if( const int64_t *integers = array.packedIntegers() )
+        return size ? Value(extremeItem(integers, size, std::less<int64_t>())) : Value();
+    else if( const double *doubles = array.packedDoubles() )
+        return size ? Value(extremeItem(doubles, size, std::less<double>())) : Value();
+    else
+        return aggregate(array, true).min;
+}
+
+Value maxHelper(const Value &, const HelperArgs &args)
+{
+    const Value array = args[0].resolve();
+    const size_t size = array.size();
+
+    if( const int64_t *integers = array.packedIntegers() )
+        return size ? Value(extremeItem(integers, size, std::greater<int64_t>())) : Value();
+    else if( const double *doubles = array.packedDoubles() )
+        return size ? Value(extremeItem(doubles, size, std::greater<double>())) : Value();
+    else
+        return aggregate(array, true).max;
+}
+
+Value countHelper(const Value &, const HelperArgs &args)
+{
+    const Value array = args[0].resolve();
+
+    if( array.type() == Value::Generator )
+        return static_cast<uint64_t>(aggregate(array, false).items);
+    else
+        return static_cast<uint64_t>(array.size());
+}
+
+Value jsonHelper(const Value &, const HelperArgs &args)
+{
+    std::string json;
+
+    args[0].writeJson(json);
+    return Value(json, Value::UnsafeStringTag());
+}
+
+void writeJsonHelper(std::string &out, const HelperArgs &args)
+{
+    args[0].writeJson(out);
+}
+
 } // namespace cpptl
@@ -10,8 +10,29 @@
 
 namespace cpptl {
 
-Value include(TemplateEngine &engine, const Value &context, const Value &fileName);
-Value rawHtml(const Value &context, const Value &html);
+Value include(TemplateEngine &engine, const Value &context, const HelperArgs &fileName);
+Value rawHtml(const Value &context, const HelperArgs &html);
+
+/* set operations on arrays: union(a, b), intersection(a, b),
+ * difference(a, b), unique(a) */
+Value unionHelper(const Value &context, const HelperArgs &args);
+Value intersectionHelper(const Value &context, const HelperArgs &args);
+Value differenceHelper(const Value &context, const HelperArgs &args);
+Value uniqueHelper(const Value &context, const HelperArgs &args);
+
+/* aggregates of the integers and doubles in an array: sum(a), avg(a), min(a),
+ * max(a); count(a) is the number of all items. avg, min and max of no numbers
+ * are null */
+Value sumHelper(const Value &context, const HelperArgs &args);
+Value avgHelper(const Value &context, const HelperArgs &args);
+Value minHelper(const Value &context, const HelperArgs &args);
+Value maxHelper(const Value &context, const HelperArgs &args);
+Value countHelper(const Value &context, const HelperArgs &args);
+
+/* json(value) is the value as JSON that may be put into a <script> element.
+ * Written by itself it goes straight to the output, see Value::writeJson() */
+Value jsonHelper(const Value &context, const HelperArgs &args);
+void writeJsonHelper(std::string &out, const HelperArgs &args);
 
 } // namespace cpptl
 
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include <boost/functional/hash.hpp>
+
+#include "fragmentcache.h"
+
+namespace cpptl {
+
+// the key goes first, so all the blocks of a key are next to each other
+static std::string fragmentKey(const std::string &key, const std::string &block)
+{
+    std::string result;
+
+    result.reserve(key.size() + block.size() + 1);
+    result.append(key);
+    result.push_back('\0');
+    result.append(block);
+
+    return result;
+}
+
+FragmentCache::FragmentCache(size_t maxBytes, Clock clock)
+    : maxShardBytes(maxBytes / ShardsCount), clock(clock)
+{
+}
+
+FragmentCache::Shard &FragmentCache::shard(const std::string &key)
+{
+    return shards[boost::hash<std::string>()(key) % ShardsCount];
+}
+
+bool FragmentCache::find(const std::string &key, const std::string &block, std::string &out)
+{
+    Shard &shard = this->shard(key);
+    boost::mutex::scoped_lock lock(shard.mutex);
+    Fragments::iterator it = shard.fragments.find(fragmentKey(key, block));
+
+    if( it != shard.fragments.end() && it->second.expires && it->second.expires <= clock(NULL) )
+    {
+        erase(shard, it);
+        it = shard.fragments.end();
+    }
+
+    if( it == shard.fragments.end() )
+    {
+        ++shard.misses;
+        return false;
+    }
+
+    ++shard.hits;
+    shard.recent.splice(shard.recent.begin(), shard.recent, it->second.position);
+    out += it->second.text;
+
+    return true;
+}
+
+void FragmentCache::insert(const std::string &key, const std::string &block,
+                           const std::string &fragment, unsigned int ttl)
+{
+    Shard &shard = this->shard(key);
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    if( fragment.size() > maxShardBytes )
+        return;
+
+    std::pair<Fragments::iterator, bool> inserted =
+            shard.fragments.insert(std::make_pair(fragmentKey(key, block), Fragment()));
+    Fragment &item = inserted.first->second;
+
+    if( inserted.second )
+    {
+        shard.recent.push_front(inserted.first);
+        item.position = shard.recent.begin();
+    }
+    else
+    {
+        shard.bytes -= item.text.size();
+        shard.recent.splice(shard.recent.begin(), shard.recent, item.position);
+    }
+
+    item.text = fragment;
+    item.expires = ttl ? clock(NULL) + ttl : 0;
+    shard.bytes += fragment.size();
+
+    shrink(shard);
+}
+
+void FragmentCache::invalidate(const std::string &key)
+{
+    Shard &shard = this->shard(key);
+    boost::mutex::scoped_lock lock(shard.mutex);
+    const std::string prefix = fragmentKey(key, std::string());
+    Fragments::iterator it = shard.fragments.lower_bound(prefix);
+
+    while( it != shard.fragments.end() && it->first.compare(0, prefix.size(), prefix) == 0 )
+        erase(shard, it++);
+}
+
+void FragmentCache::clear()
+{
+    for(size_t i = 0; i < ShardsCount; ++i)
+    {
+        boost::mutex::scoped_lock lock(shards[i].mutex);
+
+        shards[i].fragments.clear();
+        shards[i].recent.clear();
+        shards[i].bytes = 0;
+    }
+}
+
+void FragmentCache::setMaxBytes(size_t maxBytes)
+{
+    maxShardBytes = maxBytes / ShardsCount;
+
+    for(size_t i = 0; i < ShardsCount; ++i)
+    {
+        boost::mutex::scoped_lock lock(shards[i].mutex);
+        shrink(shards[i]);
+    }
+}
+
+FragmentCacheStats FragmentCache::stats() const
+{
+    FragmentCacheStats result;
+
+    for(size_t i = 0; i < ShardsCount; ++i)
+    {
+        boost::mutex::scoped_lock lock(shards[i].mutex);
+
+        result.hits += shards[i].hits;
+        result.misses += shards[i].misses;
+        result.bytes += shards[i].bytes;
+        result.fragments += shards[i].fragments.size();
+    }
+
+    return result;
+}
+
+void FragmentCache::resetStats()
+{
+    for(size_t i = 0; i < ShardsCount; ++i)
+    {
+        boost::mutex::scoped_lock lock(shards[i].mutex);
+
+        shards[i].hits = 0;
+        shards[i].misses = 0;
+    }
+}
+
+void FragmentCache::erase(Shard &shard, Fragments::iterator it)
+{
+    shard.bytes -= it->second.text.size();
+    shard.recent.erase(it->second.position);
+    shard.fragments.erase(it);
+}
+
+void FragmentCache::shrink(Shard &shard)
+{
+    while( shard.bytes > maxShardBytes )
+        erase(shard, shard.recent.back());
+}
+
+} // namespace cpptl
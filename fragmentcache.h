@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_FRAGMENTCACHE_H
+#define CPPTL_FRAGMENTCACHE_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <time.h>
+#include <boost/thread/mutex.hpp>
+
+#include "templateengine.h"
+
+namespace cpptl {
+
+// Rendered output of @cache blocks. Entries are spread over shards by the
+// user key, every shard has its own lock and an equal part of the byte
+// limit and drops the least recently used fragments when it is exceeded.
+class FragmentCache {
+public:
+    typedef time_t (*Clock)(time_t *);
+
+    // the clock tells when fragments expire, tests pass their own one
+    explicit FragmentCache(size_t maxBytes, Clock clock = time);
+
+    // appends the fragment to out if it is cached and not expired
+    bool find(const std::string &key, const std::string &block, std::string &out);
+    // ttl in seconds, 0 - until it is dropped or invalidated
+    void insert(const std::string &key, const std::string &block,
+                const std::string &fragment, unsigned int ttl);
+
+    // drops the fragments of all the blocks cached with the key
+    void invalidate(const std::string &key);
+    void clear();
+
+    void setMaxBytes(size_t maxBytes);
+    FragmentCacheStats stats() const;
+    void resetStats();
+
+private:
+    struct Fragment;
+    typedef std::map<std::string, Fragment> Fragments;
+
+    struct Fragment {
+        std::string text;
+        time_t expires;     // 0 - never
+        std::list<Fragments::iterator>::iterator position;
+    };
+
+    struct Shard {
+        Shard() : bytes(0), hits(0), misses(0) {}
+
+        mutable boost::mutex mutex;
+        Fragments fragments;    // by key and block, so a key is a range
+        std::list<Fragments::iterator> recent;  // most recently used first
+        size_t bytes;
+        size_t hits;
+        size_t misses;
+    };
+
+    enum { ShardsCount = 16 };
+
+    Shard &shard(const std::string &key);
+    void erase(Shard &shard, Fragments::iterator it);
+    void shrink(Shard &shard);
+
+    Shard shards[ShardsCount];
+    size_t maxShardBytes;
+    Clock clock;
+};
+
+} // namespace cpptl
+
+#endif // CPPTL_FRAGMENTCACHE_H
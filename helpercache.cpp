@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include <boost/functional/hash.hpp>
+
+#include "helpercache.h"
+
+namespace cpptl {
+
+static bool isCacheableValue(const Value &value)
+{
+    switch(value.type())
+    {
+    case Value::Null:
+    case Value::Bool:
+    case Value::Int:
+    case Value::Double:
+    case Value::String:
+    case Value::UnsafeString:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static size_t hashValue(const Value &value)
+{
+    size_t seed = value.type();
+
+    switch(value.type())
+    {
+    case Value::Bool:
+        boost::hash_combine(seed, value.toBool());
+        break;
+    case Value::Int:
+        boost::hash_combine(seed, value.toInt64());
+        break;
+    case Value::Double:
+        boost::hash_combine(seed, value.toDouble());
+        break;
+    case Value::String:
+    case Value::UnsafeString:
+        boost::hash_combine(seed, boost::hash_range(value.stringData(),
+                                                    value.stringData() + value.stringSize()));
+        break;
+    default:
+        break;
+    }
+
+    return seed;
+}
+
+// 1 and 1.0 are different arguments for a helper
+static bool sameValue(const Value &lhs, const Value &rhs)
+{
+    return lhs.type() == rhs.type() && lhs == rhs;
+}
+
+template<typename Iterator1, typename Iterator2>
+static bool sameArgs(Iterator1 lhs, Iterator1 lhsEnd, Iterator2 rhs, Iterator2 rhsEnd)
+{
+    if( lhsEnd - lhs != rhsEnd - rhs )
+        return false;
+
+    for(; lhs != lhsEnd; ++lhs, ++rhs)
+    {
+        if( sameValue(*lhs, *rhs) == false )
+            return false;
+    }
+
+    return true;
+}
+
+bool HelperCache::KeyEqual::operator()(const Key &lhs, const Key &rhs) const
+{
+    return lhs.helper == rhs.helper
+            && sameArgs(lhs.args.begin(), lhs.args.end(), rhs.args.begin(), rhs.args.end());
+}
+
+bool HelperCache::KeyEqual::operator()(const LookupKey &lhs, const Key &rhs) const
+{
+    return lhs.helper == rhs.helper
+            && sameArgs(lhs.args.begin(), lhs.args.end(), rhs.args.begin(), rhs.args.end());
+}
+
+bool HelperCache::KeyEqual::operator()(const Key &lhs, const LookupKey &rhs) const
+{
+    return (*this)(rhs, lhs);
+}
+
+HelperCache::HelperCache(size_t capacity)
+    : capacity(capacity)
+{
+}
+
+bool HelperCache::isCacheable(const HelperArgs &args)
+{
+    for(const Value *it = args.begin(); it != args.end(); ++it)
+    {
+        if( isCacheableValue(*it) == false )
+            return false;
+    }
+
+    return true;
+}
+
+size_t HelperCache::hashArgs(const HelperEntry *helper, const HelperArgs &args)
+{
+    size_t seed = boost::hash<const HelperEntry *>()(helper);
+
+    for(const Value *it = args.begin(); it != args.end(); ++it)
+        boost::hash_combine(seed, hashValue(*it));
+
+    return seed;
+}
+
+bool HelperCache::find(const HelperEntry *helper, const HelperArgs &args, Value &result)
+{
+    LookupKey key = {helper, args, hashArgs(helper, args)};
+    Items::iterator it = items.find(key, KeyHash(), KeyEqual());
+
+    if( it == items.end() )
+        return false;
+
+    if( capacity )
+        recent.splice(recent.begin(), recent, it->second.position);
+
+    result = it->second.result;
+    return true;
+}
+
+void HelperCache::insert(const HelperEntry *helper, const HelperArgs &args, const Value &result)
+{
+    Key key = {helper, std::vector<Value>(args.begin(), args.end()), hashArgs(helper, args)};
+    std::pair<Items::iterator, bool> inserted = items.insert(std::make_pair(key, Item()));
+    Item &item = inserted.first->second;
+
+    item.result = result;
+
+    if( capacity )
+    {
+        if( inserted.second )
+        {
+            recent.push_front(&inserted.first->first);
+            item.position = recent.begin();
+            shrink(capacity);
+        }
+        else
+        {
+            recent.splice(recent.begin(), recent, item.position);
+        }
+    }
+}
+
+void HelperCache::clear()
+{
+    items.clear();
+    recent.clear();
+}
+
+size_t HelperCache::size() const
+{
+    return items.size();
+}
+
+void HelperCache::setCapacity(size_t newCapacity)
+{
+    if( capacity == 0 && newCapacity )
+    {
+        // was unbounded, the order of use is unknown
+        clear();
+    }
+
+    capacity = newCapacity;
+
+    if( capacity )
+        shrink(capacity);
+    else
+        recent.clear();
+}
+
+void HelperCache::shrink(size_t size)
+{
+    while( items.size() > size )
+    {
+        Items::iterator it = items.find(*recent.back());
+
+        recent.pop_back();
+        items.erase(it);
+    }
+}
+
+} // namespace cpptl
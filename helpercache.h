@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_HELPERCACHE_H
+#define CPPTL_HELPERCACHE_H
+
+#include <list>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+#include "templateengine.h"
+
+namespace cpptl {
+
+struct HelperEntry;
+
+// Results of pure helpers by helper and arguments. Only calls with null,
+// bool, number and string arguments are cached. When the capacity is reached
+// the least recently used result is dropped, capacity 0 means unbounded.
+// The cache is not locked: a render has its own one, the engine one is
+// used under TemplateEngineImpl::helperCacheMutex.
+class HelperCache {
+public:
+    explicit HelperCache(size_t capacity = 0);
+
+    static bool isCacheable(const HelperArgs &args);
+
+    bool find(const HelperEntry *helper, const HelperArgs &args, Value &result);
+    void insert(const HelperEntry *helper, const HelperArgs &args, const Value &result);
+
+    void clear();
+    size_t size() const;
+    void setCapacity(size_t capacity);
+
+private:
+    struct Key {
+        const HelperEntry *helper;
+        std::vector<Value> args;
+        size_t hash;
+    };
+
+    // the arguments of the call, not copied for lookup
+    struct LookupKey {
+        const HelperEntry *helper;
+        const HelperArgs &args;
+        size_t hash;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const { return key.hash; }
+        size_t operator()(const LookupKey &key) const { return key.hash; }
+    };
+
+    struct KeyEqual {
+        bool operator()(const Key &lhs, const Key &rhs) const;
+        bool operator()(const LookupKey &lhs, const Key &rhs) const;
+        bool operator()(const Key &lhs, const LookupKey &rhs) const;
+    };
+
+    struct Item {
+        Value result;
+        std::list<const Key *>::iterator position;
+    };
+
+    typedef boost::unordered_map<Key, Item, KeyHash, KeyEqual> Items;
+
+    static size_t hashArgs(const HelperEntry *helper, const HelperArgs &args);
+    void shrink(size_t size);
+
+    Items items;
+    std::list<const Key *> recent;  // most recently used first, unused when unbounded
+    size_t capacity;
+};
+
+} // namespace cpptl
+
+#endif // CPPTL_HELPERCACHE_H
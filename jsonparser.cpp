@@ -0,0 +1,1262 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <boost/functional/hash.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "jsonparser.h"
+
+namespace cpptl {
+
+// strings at least that long become views of the buffer, shorter ones are
+// cheaper to copy
+static const size_t minViewSize = 64;
+// names kept for a document, the rest are not kept (keys of maps by id...)
+static const size_t maxNames = 4096;
+// members of a lazy object looked up by a key index, fewer are scanned
+static const size_t minIndexedMembers = 16;
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int hexValue(const char *p)
+{
+    int result = 0;
+
+    for(int i = 0; i < 4; ++i)
+    {
+        const char c = p[i];
+
+        result <<= 4;
+
+        if( c >= '0' && c <= '9' )
+            result |= c - '0';
+        else if( c >= 'a' && c <= 'f' )
+            result |= c - 'a' + 10;
+        else if( c >= 'A' && c <= 'F' )
+            result |= c - 'A' + 10;
+        else
+            return -1;
+    }
+
+    return result;
+}
+
+static void appendUtf8(std::string &out, uint32_t code)
+{
+    if( code < 0x80 )
+    {
+        out += static_cast<char>(code);
+    }
+    else if( code < 0x800 )
+    {
+        out += static_cast<char>(0xC0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+    else if( code < 0x10000 )
+    {
+        out += static_cast<char>(0xE0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+    else
+    {
+        out += static_cast<char>(0xF0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+}
+
+// the text between the quotes, every backslash is followed by a character
+static bool decodeString(const char *p, const char *end, std::string &out)
+{
+    out.clear();
+
+    while( p != end )
+    {
+        const char *plain = p;
+
+        while( p != end && *p != '\\' )
+            ++p;
+
+        out.append(plain, p);
+
+        if( p == end )
+            break;
+
+        ++p;
+
+        switch(*p++)
+        {
+        case '"': out += '"'; break;
+        case '\\': out += '\\'; break;
+        case '/': out += '/'; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            int code = end - p >= 4 ? hexValue(p) : -1;
+
+            if( code < 0 )
+                return false;
+
+            p += 4;
+
+            if( code >= 0xD800 && code < 0xDC00 )
+            {
+                // a surrogate pair
+                int low = end - p >= 6 && p[0] == '\\' && p[1] == 'u' ? hexValue(p + 2) : -1;
+
+                if( low < 0xDC00 || low >= 0xE000 )
+                    return false;
+
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            }
+            else if( code >= 0xDC00 && code < 0xE000 )
+            {
+                return false;
+            }
+
+            appendUtf8(out, code);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The end of the number at p, false if it is not a JSON number. integral is
+// false for fractions and exponents.
+static bool scanNumber(const char *p, const char *end, const char *&numberEnd, bool &integral)
+{
+    if( p != end && *p == '-' )
+        ++p;
+
+    if( p == end )
+        return false;
+    else if( *p == '0' )
+        ++p;
+    else if( isDigit(*p) )
+        while( p != end && isDigit(*p) ) ++p;
+    else
+        return false;
+
+    integral = true;
+
+    if( p != end && *p == '.' )
+    {
+        integral = false;
+
+        if( ++p == end || isDigit(*p) == false )
+            return false;
+
+        while( p != end && isDigit(*p) )
+            ++p;
+    }
+
+    if( p != end && (*p == 'e' || *p == 'E') )
+    {
+        integral = false;
+
+        if( ++p != end && (*p == '+' || *p == '-') )
+            ++p;
+
+        if( p == end || isDigit(*p) == false )
+            return false;
+
+        while( p != end && isDigit(*p) )
+            ++p;
+    }
+
+    numberEnd = p;
+    return true;
+}
+
+// false if it does not fit into int64_t
+static bool parseInteger(const char *p, const char *end, int64_t &result)
+{
+    const bool negative = *p == '-';
+    const uint64_t limit = negative ? static_cast<uint64_t>(INT64_MAX) + 1 : INT64_MAX;
+    uint64_t value = 0;
+
+    if( negative )
+        ++p;
+
+    for(; p != end; ++p)
+    {
+        const unsigned digit = *p - '0';
+
+        if( value > (limit - digit) / 10 )
+            return false;
+
+        value = value * 10 + digit;
+    }
+
+    result = negative ? static_cast<int64_t>(0 - value) : static_cast<int64_t>(value);
+    return true;
+}
+
+static double parseDouble(const char *p, const char *end)
+{
+    char buffer[64];
+    const size_t size = end - p;
+
+    if( size < sizeof(buffer) )
+    {
+        memcpy(buffer, p, size);
+        buffer[size] = '\0';
+        return strtod(buffer, NULL);
+    }
+
+    return strtod(std::string(p, end).c_str(), NULL);
+}
+
+JsonParser::JsonParser(JsonHandler &handler)
+    : handler(handler), expect(ExpectValue), scanned(0), scannedEscape(false), offset(0)
+{
+}
+
+bool JsonParser::feed(const char *data, size_t size)
+{
+    if( errorText.empty() == false )
+        return false;
+
+    if( pending.empty() )
+    {
+        const size_t consumed = parse(data, data + size, false);
+
+        pending.assign(data + consumed, data + size);
+        offset += consumed;
+    }
+    else
+    {
+        pending.append(data, size);
+
+        const size_t consumed = parse(pending.data(), pending.data() + pending.size(), false);
+
+        pending.erase(0, consumed);
+        offset += consumed;
+    }
+
+    return errorText.empty();
+}
+
+bool JsonParser::finish()
+{
+    if( errorText.empty() && pending.empty() == false )
+    {
+        const size_t consumed = parse(pending.data(), pending.data() + pending.size(), true);
+
+        pending.erase(0, consumed);
+        offset += consumed;
+    }
+
+    if( errorText.empty() && expect != ExpectNothing )
+        fail(offset, "unexpected end of the document");
+
+    return errorText.empty();
+}
+
+const std::string &JsonParser::error() const
+{
+    return errorText;
+}
+
+void JsonParser::fail(size_t position, const char *what)
+{
+    std::ostringstream ss;
+
+    ss << "JSON error at " << position << ": " << what;
+    errorText = ss.str();
+}
+
+void JsonParser::valueDone()
+{
+    expect = containers.empty() ? ExpectNothing : ExpectCommaOrEnd;
+}
+
+void JsonParser::closeContainer()
+{
+    if( containers.back() == '{' )
+        handler.endObject();
+    else
+        handler.endArray();
+
+    containers.pop_back();
+    valueDone();
+}
+
+bool JsonParser::readString(const char *begin, const char *&p, const char *end, bool last,
+                            const char *&data, size_t &size)
+{
+    const char *start = p + 1;
+    const char *q = start;
+    bool escaped = false;
+
+    // the rest of a cut string, the start was checked before
+    if( p == begin && scanned )
+    {
+        q = p + scanned;
+        escaped = scannedEscape;
+    }
+
+    for(; q != end; ++q)
+    {
+        const unsigned char c = *q;
+
+        if( c == '"' )
+        {
+            break;
+        }
+        else if( c == '\\' )
+        {
+            if( q + 1 == end )
+                break;
+
+            escaped = true;
+            ++q;
+        }
+        else if( c < 0x20 )
+        {
+            fail(offset + (q - begin), "control character in a string");
+            return false;
+        }
+    }
+
+    if( q == end || *q != '"' )
+    {
+        if( last )
+        {
+            fail(offset + (p - begin), "unterminated string");
+        }
+        else
+        {
+            scanned = q - p;
+            scannedEscape = escaped;
+        }
+
+        return false;
+    }
+
+    scanned = 0;
+    scannedEscape = false;
+
+    if( escaped )
+    {
+        if( decodeString(start, q, decoded) == false )
+        {
+            fail(offset + (p - begin), "bad escape in a string");
+            return false;
+        }
+
+        data = decoded.data();
+        size = decoded.size();
+    }
+    else
+    {
+        data = start;
+        size = q - start;
+    }
+
+    p = q + 1;
+    return true;
+}
+
+size_t JsonParser::parse(const char *begin, const char *end, bool last)
+{
+    const char *p = begin;
+
+    for(;;)
+    {
+        while( p != end && isSpace(*p) )
+            ++p;
+
+        if( p == end )
+            return p - begin;
+
+        const char c = *p;
+
+        switch(expect)
+        {
+        case ExpectNothing:
+            fail(offset + (p - begin), "data after the end of the document");
+            return p - begin;
+
+        case ExpectColon:
+            if( c != ':' )
+            {
+                fail(offset + (p - begin), "':' expected");
+                return p - begin;
+            }
+
+            ++p;
+            expect = ExpectValue;
+            continue;
+
+        case ExpectCommaOrEnd:
+            if( c == ',' )
+            {
+                ++p;
+                expect = containers.back() == '{' ? ExpectKey : ExpectValue;
+            }
+            else if( c == (containers.back() == '{' ? '}' : ']') )
+            {
+                ++p;
+                closeContainer();
+            }
+            else
+            {
+                fail(offset + (p - begin), "',' or the end of the container expected");
+                return p - begin;
+            }
+            continue;
+
+        case ExpectKeyOrEnd:
+            if( c == '}' )
+            {
+                ++p;
+                closeContainer();
+                continue;
+            }
+            // fall through
+        case ExpectKey: {
+            const char *data;
+            size_t size;
+
+            if( c != '"' )
+            {
+                fail(offset + (p - begin), "member name expected");
+                return p - begin;
+            }
+
+            if( readString(begin, p, end, last, data, size) == false )
+                return p - begin;
+
+            handler.key(data, size);
+            expect = ExpectColon;
+            continue;
+        }
+
+        case ExpectValueOrEnd:
+            if( c == ']' )
+            {
+                ++p;
+                closeContainer();
+                continue;
+            }
+            // fall through
+        case ExpectValue:
+            break;
+        }
+
+        switch(c)
+        {
+        case '{':
+            ++p;
+            containers.push_back('{');
+            expect = ExpectKeyOrEnd;
+            handler.startObject();
+            continue;
+        case '[':
+            ++p;
+            containers.push_back('[');
+            expect = ExpectValueOrEnd;
+            handler.startArray();
+            continue;
+        case '"': {
+            const char *data;
+            size_t size;
+
+            if( readString(begin, p, end, last, data, size) == false )
+                return p - begin;
+
+            handler.string(data, size);
+            valueDone();
+            continue;
+        }
+        case 't':
+        case 'f':
+        case 'n': {
+            const char *literal = c == 't' ? "true" : (c == 'f' ? "false" : "null");
+            const size_t size = strlen(literal);
+            const size_t available = end - p;
+
+            if( available < size && last == false && memcmp(p, literal, available) == 0 )
+                return p - begin;
+
+            if( available < size || memcmp(p, literal, size) != 0 )
+            {
+                fail(offset + (p - begin), "bad literal");
+                return p - begin;
+            }
+
+            p += size;
+
+            if( c == 'n' )
+                handler.null();
+            else
+                handler.boolean(c == 't');
+
+            valueDone();
+            continue;
+        }
+        default: {
+            const char *numberEnd;
+            bool integral;
+
+            if( scanNumber(p, end, numberEnd, integral) == false )
+            {
+                // may be a number cut by the end of the part
+                if( last == false && (c == '-' || isDigit(c)) && (end - p) < 64 )
+                {
+                    const char *q = p;
+
+                    while( q != end && (isDigit(*q) || strchr("+-.eE", *q)) )
+                        ++q;
+
+                    if( q == end )
+                        return p - begin;
+                }
+
+                fail(offset + (p - begin), "value expected");
+                return p - begin;
+            }
+
+            // the number may go on in the next part
+            if( numberEnd == end && last == false )
+                return p - begin;
+
+            int64_t integer;
+
+            if( integral && parseInteger(p, numberEnd, integer) )
+                handler.integer(integer);
+            else
+                handler.number(parseDouble(p, numberEnd));
+
+            p = numberEnd;
+            valueDone();
+            continue;
+        }
+        }
+    }
+}
+
+JsonValueBuilder::JsonValueBuilder()
+    : reserveHint(0), name(NULL), bufferBegin(NULL), bufferEnd(NULL)
+{
+}
+
+void JsonValueBuilder::setBuffer(const char *data, size_t size,
+                                 const boost::shared_ptr<const void> &anchor)
+{
+    bufferBegin = data;
+    bufferEnd = data + size;
+    this->anchor = anchor;
+}
+
+void JsonValueBuilder::setReserveHint(size_t items)
+{
+    reserveHint = items;
+}
+
+Value JsonValueBuilder::result() const
+{
+    return root;
+}
+
+void JsonValueBuilder::add(const Value &value)
+{
+    if( containers.empty() )
+        root = value;
+    else if( containers.back().type() == Value::Array )
+        containers.back().append(value);
+    else
+        containers.back()[*name] = value;
+}
+
+void JsonValueBuilder::null()
+{
+    add(Value());
+}
+
+void JsonValueBuilder::boolean(bool value)
+{
+    add(Value(value));
+}
+
+void JsonValueBuilder::integer(int64_t value)
+{
+    add(Value(value));
+}
+
+void JsonValueBuilder::number(double value)
+{
+    add(Value(value));
+}
+
+void JsonValueBuilder::string(const char *data, size_t size)
+{
+    if( size >= minViewSize && data >= bufferBegin && data + size <= bufferEnd )
+        add(Value(data, size, anchor));
+    else
+        add(Value(std::string(data, size)));
+}
+
+void JsonValueBuilder::startObject()
+{
+    Value object(Value::Object);
+
+    add(object);
+    containers.push_back(object);
+}
+
+namespace {
+
+struct NameRef {
+    const char *data;
+    size_t size;
+};
+
+struct NameHash {
+    size_t operator()(const NameRef &name) const {
+        return boost::hash_range(name.data, name.data + name.size);
+    }
+};
+
+struct NameEqual {
+    bool operator()(const NameRef &lhs, const std::string &rhs) const {
+        return lhs.size == rhs.size() && memcmp(lhs.data, rhs.data(), lhs.size) == 0;
+    }
+};
+
+} // namespace
+
+void JsonValueBuilder::key(const char *data, size_t size)
+{
+    const NameRef ref = {data, size};
+    boost::unordered_set<std::string>::const_iterator it = names.find(ref, NameHash(), NameEqual());
+
+    if( it != names.end() )
+    {
+        name = &*it;
+    }
+    else if( names.size() < maxNames )
+    {
+        name = &*names.insert(std::string(data, size)).first;
+    }
+    else
+    {
+        nameBuffer.assign(data, size);
+        name = &nameBuffer;
+    }
+}
+
+void JsonValueBuilder::endObject()
+{
+    containers.pop_back();
+}
+
+void JsonValueBuilder::startArray()
+{
+    const size_t depth = containers.size();
+    const size_t hint = depth < arraySizes.size() && arraySizes[depth] ? arraySizes[depth]
+                                                                       : reserveHint;
+    Value array(Value::Array);
+
+    if( hint )
+        array.reserve(hint);
+
+    add(array);
+    containers.push_back(array);
+}
+
+void JsonValueBuilder::endArray()
+{
+    const size_t depth = containers.size() - 1;
+
+    if( arraySizes.size() <= depth )
+        arraySizes.resize(depth + 1);
+
+    arraySizes[depth] = containers.back().size();
+    containers.pop_back();
+}
+
+static Value parseJson(JsonValueBuilder &builder, const char *data, size_t size,
+                       std::string *error)
+{
+    JsonParser parser(builder);
+
+    if( parser.feed(data, size) && parser.finish() )
+        return builder.result();
+
+    if( error )
+        *error = parser.error();
+
+    return Value();
+}
+
+Value parseJson(const char *data, size_t size, std::string *error)
+{
+    JsonValueBuilder builder;
+
+    return parseJson(builder, data, size, error);
+}
+
+Value parseJson(const std::string &json, std::string *error)
+{
+    return parseJson(json.data(), json.size(), error);
+}
+
+Value parseJson(const boost::shared_ptr<const std::string> &json, std::string *error)
+{
+    JsonValueBuilder builder;
+
+    builder.setBuffer(json->data(), json->size(), json);
+    return parseJson(builder, json->data(), json->size(), error);
+}
+
+// Where the values of a JSON text are. Items of a container are stored
+// together in items, for an object they are name and value pairs.
+struct JsonIndex {
+    struct Entry {
+        uint32_t begin;     // the quote of a string, the first character otherwise
+        uint32_t end;       // past the value
+        uint32_t items;     // the first item of a container in items
+        uint32_t count;     // items of an array, members of an object
+        char kind;          // '{', '[', '"', 't', 'f', 'n', '0' for integers, '.' for other numbers
+        bool escaped;       // a string with escapes
+    };
+
+    // member numbers by the decoded key, the first of equal keys
+    typedef boost::unordered_map<std::string, uint32_t> Keys;
+
+    boost::shared_ptr<const std::string> json;
+    std::vector<Entry> entries;
+    std::vector<uint32_t> items;
+
+    // of large objects by their entry, made on the first lookup, the renders
+    // share the index
+    mutable boost::mutex keysMutex;
+    mutable boost::unordered_map<size_t, Keys> keys;
+};
+
+// The first '"', '\\' or control character from p. Eight bytes are checked at
+// once: a byte is found if it is zero after xor with the character or below
+// 0x20 (see "Bit Twiddling Hacks", haszero and hasless).
+static const char *findStringStop(const char *p, const char *end)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+
+    while( end - p >= 8 )
+    {
+        uint64_t word;
+
+        memcpy(&word, p, sizeof(word));
+
+        const uint64_t quotes = word ^ (ones * '"');
+        const uint64_t slashes = word ^ (ones * '\\');
+        const uint64_t found = ((quotes - ones) & ~quotes)
+                | ((slashes - ones) & ~slashes)
+                | ((word - ones * 0x20) & ~word);
+
+        if( found & highs )
+            break;
+
+        p += 8;
+    }
+
+    while( p != end && *p != '"' && *p != '\\' && static_cast<unsigned char>(*p) >= 0x20 )
+        ++p;
+
+    return p;
+}
+
+namespace {
+
+class JsonIndexer {
+public:
+    explicit JsonIndexer(JsonIndex &index)
+        : index(index), begin(NULL), end(NULL), expect(ExpectValue), error(NULL) {}
+
+    bool run(std::string &error);
+
+private:
+    enum Expect {
+        ExpectValue,
+        ExpectValueOrEnd,
+        ExpectKey,
+        ExpectKeyOrEnd,
+        ExpectColon,
+        ExpectCommaOrEnd,
+        ExpectNothing
+    };
+
+    struct Container {
+        uint32_t entry;
+        size_t firstItem;   // in items
+    };
+
+    uint32_t add(char kind, const char *p);
+    bool string(const char *&p);
+    void close(const char *p);
+    void valueDone();
+    bool fail(const char *p, const char *what);
+
+    JsonIndex &index;
+    const char *begin;
+    const char *end;
+    Expect expect;
+    std::vector<Container> containers;
+    std::vector<uint32_t> items;    // of the open containers
+    std::string decoded;
+    std::string *error;
+};
+
+uint32_t JsonIndexer::add(char kind, const char *p)
+{
+    const JsonIndex::Entry entry = {static_cast<uint32_t>(p - begin), 0, 0, 0, kind, false};
+    const uint32_t result = index.entries.size();
+
+    index.entries.push_back(entry);
+
+    if( containers.empty() == false )
+        items.push_back(result);
+
+    return result;
+}
+
+bool JsonIndexer::string(const char *&p)
+{
+    const uint32_t entry = add('"', p);
+    const char *start = p + 1;
+    const char *q = start;
+    bool escaped = false;
+
+    for(;;)
+    {
+        q = findStringStop(q, end);
+
+        if( q == end )
+            return fail(p, "unterminated string");
+        else if( *q == '"' )
+            break;
+        else if( *q != '\\' )
+            return fail(q, "control character in a string");
+        else if( ++q == end )
+            return fail(p, "unterminated string");
+
+        escaped = true;
+        ++q;
+    }
+
+    if( escaped && decodeString(start, q, decoded) == false )
+        return fail(p, "bad escape in a string");
+
+    index.entries[entry].end = q + 1 - begin;
+    index.entries[entry].escaped = escaped;
+    p = q + 1;
+
+    return true;
+}
+
+void JsonIndexer::close(const char *p)
+{
+    const Container container = containers.back();
+    JsonIndex::Entry &entry = index.entries[container.entry];
+    const size_t count = items.size() - container.firstItem;
+
+    entry.end = p + 1 - begin;
+    entry.items = index.items.size();
+    entry.count = entry.kind == '{' ? count / 2 : count;
+
+    index.items.insert(index.items.end(), items.begin() + container.firstItem, items.end());
+    items.resize(container.firstItem);
+    containers.pop_back();
+
+    valueDone();
+}
+
+void JsonIndexer::valueDone()
+{
+    expect = containers.empty() ? ExpectNothing : ExpectCommaOrEnd;
+}
+
+bool JsonIndexer::fail(const char *p, const char *what)
+{
+    std::ostringstream ss;
+
+    ss << "JSON error at " << (p - begin) << ": " << what;
+    *error = ss.str();
+
+    return false;
+}
+
+bool JsonIndexer::run(std::string &error)
+{
+    const char *p = index.json->data();
+
+    this->error = &error;
+    begin = p;
+    end = p + index.json->size();
+    expect = ExpectValue;
+
+    if( index.json->size() >= std::numeric_limits<uint32_t>::max() )
+        return fail(p, "the document is too large");
+
+    // about a value per 8 bytes in a usual document
+    index.entries.reserve(index.json->size() / 8 + 1);
+
+    for(;;)
+    {
+        while( p != end && isSpace(*p) )
+            ++p;
+
+        if( p == end )
+            break;
+
+        const char c = *p;
+
+        switch(expect)
+        {
+        case ExpectNothing:
+            return fail(p, "data after the end of the document");
+
+        case ExpectColon:
+            if( c != ':' )
+                return fail(p, "':' expected");
+
+            ++p;
+            expect = ExpectValue;
+            continue;
+
+        case ExpectCommaOrEnd: {
+            const char kind = index.entries[containers.back().entry].kind;
+
+            if( c == ',' )
+            {
+                ++p;
+                expect = kind == '{' ? ExpectKey : ExpectValue;
+            }
+            else if( c == (kind == '{' ? '}' : ']') )
+            {
+                close(p++);
+            }
+            else
+            {
+                return fail(p, "',' or the end of the container expected");
+            }
+            continue;
+        }
+
+        case ExpectKeyOrEnd:
+            if( c == '}' )
+            {
+                close(p++);
+                continue;
+            }
+            // fall through
+        case ExpectKey:
+            if( c != '"' )
+                return fail(p, "member name expected");
+
+            if( string(p) == false )
+                return false;
+
+            expect = ExpectColon;
+            continue;
+
+        case ExpectValueOrEnd:
+            if( c == ']' )
+            {
+                close(p++);
+                continue;
+            }
+            // fall through
+        case ExpectValue:
+            break;
+        }
+
+        switch(c)
+        {
+        case '{':
+        case '[': {
+            const Container container = {add(c, p), items.size()};
+
+            containers.push_back(container);
+            expect = c == '{' ? ExpectKeyOrEnd : ExpectValueOrEnd;
+            ++p;
+            continue;
+        }
+        case '"':
+            if( string(p) == false )
+                return false;
+
+            valueDone();
+            continue;
+        case 't':
+        case 'f':
+        case 'n': {
+            const char *literal = c == 't' ? "true" : (c == 'f' ? "false" : "null");
+            const size_t size = strlen(literal);
+
+            if( static_cast<size_t>(end - p) < size || memcmp(p, literal, size) != 0 )
+                return fail(p, "bad literal");
+
+            index.entries[add(c, p)].end = p + size - begin;
+            p += size;
+            valueDone();
+            continue;
+        }
+        default: {
+            const char *numberEnd;
+            bool integral;
+
+            if( scanNumber(p, end, numberEnd, integral) == false )
+                return fail(p, "value expected");
+
+            index.entries[add(integral ? '0' : '.', p)].end = numberEnd - begin;
+            p = numberEnd;
+            valueDone();
+            continue;
+        }
+        }
+    }
+
+    if( expect != ExpectNothing )
+        return fail(p, "unexpected end of the document");
+
+    return true;
+}
+
+} // namespace
+
+static Value entryValue(const boost::shared_ptr<const JsonIndex> &index, size_t entry)
+{
+    const JsonIndex::Entry &e = index->entries[entry];
+    const char *p = index->json->data() + e.begin;
+    const char *end = index->json->data() + e.end;
+
+    switch(e.kind)
+    {
+    case '{':
+    case '[':
+        return Value::fromValue(JsonNode(index, entry));
+    case '"':
+        if( e.escaped )
+        {
+            std::string decoded;
+
+            decodeString(p + 1, end - 1, decoded);
+            return Value(decoded);
+        }
+        else if( static_cast<size_t>(end - p - 2) >= minViewSize )
+        {
+            return Value(p + 1, end - p - 2, index->json);
+        }
+        else
+        {
+            return Value(std::string(p + 1, end - 1));
+        }
+    case 't':
+        return Value(true);
+    case 'f':
+        return Value(false);
+    case 'n':
+        return Value();
+    case '0': {
+        int64_t integer;
+
+        if( parseInteger(p, end, integer) )
+            return Value(integer);
+    }
+        // fall through
+    default:
+        return Value(parseDouble(p, end));
+    }
+}
+
+static bool keyEquals(const JsonIndex &index, const JsonIndex::Entry &key, const std::string &name)
+{
+    const char *p = index.json->data() + key.begin + 1;
+    const size_t size = key.end - key.begin - 2;
+
+    if( key.escaped )
+    {
+        std::string decoded;
+
+        decodeString(p, p + size, decoded);
+        return decoded == name;
+    }
+
+    return size == name.size() && memcmp(p, name.data(), size) == 0;
+}
+
+static const JsonIndex::Keys &objectKeys(const JsonIndex &index, size_t entry)
+{
+    boost::mutex::scoped_lock lock(index.keysMutex);
+    boost::unordered_map<size_t, JsonIndex::Keys>::iterator it = index.keys.find(entry);
+
+    // the elements of an unordered_map stay in place when it grows
+    if( it != index.keys.end() )
+        return it->second;
+
+    const JsonIndex::Entry &object = index.entries[entry];
+    JsonIndex::Keys &keys = index.keys[entry];
+
+    keys.rehash(object.count);
+
+    for(uint32_t i = 0; i < object.count; ++i)
+    {
+        const JsonIndex::Entry &key = index.entries[index.items[object.items + 2 * i]];
+        const char *p = index.json->data() + key.begin + 1;
+        const size_t size = key.end - key.begin - 2;
+        std::string name;
+
+        if( key.escaped )
+            decodeString(p, p + size, name);
+        else
+            name.assign(p, size);
+
+        keys.insert(std::make_pair(name, i));
+    }
+
+    return keys;
+}
+
+// Small objects are scanned, larger ones looked up by their key index
+bool ValueTypeInfo<JsonNode>::member(const JsonNode &node, const std::string &name, Value *result)
+{
+    const JsonIndex &index = *node.index;
+    const JsonIndex::Entry &object = index.entries[node.entry];
+    size_t found = object.count;
+
+    if( object.kind != '{' )
+        return false;
+
+    if( object.count >= minIndexedMembers )
+    {
+        const JsonIndex::Keys &keys = objectKeys(index, node.entry);
+        JsonIndex::Keys::const_iterator it = keys.find(name);
+
+        if( it != keys.end() )
+            found = it->second;
+    }
+    else
+    {
+        for(size_t i = 0; i < object.count && found == object.count; ++i)
+        {
+            if( keyEquals(index, index.entries[index.items[object.items + 2 * i]], name) )
+                found = i;
+        }
+    }
+
+    if( found == object.count )
+        return false;
+
+    if( result )
+        *result = entryValue(node.index, index.items[object.items + 2 * found + 1]);
+
+    return true;
+}
+
+size_t ValueTypeInfo<JsonNode>::size(const JsonNode &node)
+{
+    return node.index->entries[node.entry].count;
+}
+
+Value ValueTypeInfo<JsonNode>::at(const JsonNode &node, size_t index)
+{
+    const JsonIndex::Entry &container = node.index->entries[node.entry];
+
+    if( index >= container.count )
+        return Value();
+    else if( container.kind == '{' )
+        return entryValue(node.index, node.index->items[container.items + 2 * index + 1]);
+    else
+        return entryValue(node.index, node.index->items[container.items + index]);
+}
+
+// The text of the node as it is. <, >, & and the line separators may be in
+// strings only, they are replaced by escapes as Value::writeJson() does.
+bool ValueTypeInfo<JsonNode>::writeJson(const JsonNode &node, std::string &out)
+{
+    const JsonIndex::Entry &entry = node.index->entries[node.entry];
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(node.index->json->data());
+    const unsigned char *end = p + entry.end;
+
+    for(p += entry.begin; p != end; )
+    {
+        const unsigned char *plain = p;
+
+        while( p != end && *p != '<' && *p != '>' && *p != '&' && *p != 0xE2 )
+            ++p;
+
+        out.append(reinterpret_cast<const char *>(plain), p - plain);
+
+        if( p == end )
+            break;
+
+        if( *p == '<' )
+            out += "\\u003c";
+        else if( *p == '>' )
+            out += "\\u003e";
+        else if( *p == '&' )
+            out += "\\u0026";
+        else if( end - p >= 3 && p[1] == 0x80 && (p[2] == 0xA8 || p[2] == 0xA9) )
+        {
+            out += p[2] == 0xA8 ? "\\u2028" : "\\u2029";
+            p += 2;
+        }
+        else
+        {
+            out += static_cast<char>(*p);
+        }
+
+        ++p;
+    }
+
+    return true;
+}
+
+Value parseJsonLazy(const boost::shared_ptr<const std::string> &json, std::string *error)
+{
+    boost::shared_ptr<JsonIndex> index = boost::make_shared<JsonIndex>();
+    std::string errorText;
+
+    index->json = json;
+
+    if( JsonIndexer(*index).run(errorText) == false )
+    {
+        if( error )
+            *error = errorText;
+
+        return Value();
+    }
+
+    return entryValue(index, 0);
+}
+
+} // namespace cpptl
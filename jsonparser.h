@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_JSONPARSER_H
+#define CPPTL_JSONPARSER_H
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "value.h"
+
+namespace cpptl {
+
+// Events of a JSON document in the order of the text. Strings and keys are
+// given decoded, the pointers are valid during the call only.
+class JsonHandler {
+public:
+    virtual ~JsonHandler() {}
+
+    virtual void null() = 0;
+    virtual void boolean(bool value) = 0;
+    virtual void integer(int64_t value) = 0;
+    virtual void number(double value) = 0;
+    virtual void string(const char *data, size_t size) = 0;
+
+    virtual void startObject() = 0;
+    virtual void key(const char *data, size_t size) = 0;
+    virtual void endObject() = 0;
+
+    virtual void startArray() = 0;
+    virtual void endArray() = 0;
+};
+
+// Streaming JSON parser: the text may be given in parts as it arrives, a
+// token cut by the end of a part is kept until the next one. Nesting is
+// handled without recursion, strings without escapes are passed to the
+// handler straight from the text.
+class JsonParser {
+public:
+    explicit JsonParser(JsonHandler &handler);
+
+    // false on a syntax error, see error()
+    bool feed(const char *data, size_t size);
+    // the end of the text, false if the document is not complete
+    bool finish();
+
+    const std::string &error() const;
+
+private:
+    enum Expect {
+        ExpectValue,
+        ExpectValueOrEnd,   // after [
+        ExpectKey,
+        ExpectKeyOrEnd,     // after {
+        ExpectColon,
+        ExpectCommaOrEnd,
+        ExpectNothing       // the document is complete
+    };
+
+    // parses what it can, returns the bytes consumed
+    size_t parse(const char *begin, const char *end, bool last);
+    // the string at p (at the quote), false if it is cut or bad
+    bool readString(const char *begin, const char *&p, const char *end, bool last,
+                    const char *&data, size_t &size);
+    void closeContainer();
+    void fail(size_t position, const char *what);
+    void valueDone();
+
+    JsonHandler &handler;
+    std::vector<char> containers;   // '{' and '[' from the root
+    Expect expect;
+    std::string pending;            // the start of a cut token
+    size_t scanned;                 // bytes of a cut string already checked
+    bool scannedEscape;             // there was an escape in them
+    std::string decoded;            // a string with escapes
+    size_t offset;                  // bytes consumed before the current part
+    std::string errorText;
+};
+
+// Builds a Value from the events. Arrays get the room for as many items as
+// the previous array at the same depth had (or the reserve hint), member
+// names are kept once for the document.
+class JsonValueBuilder : public JsonHandler {
+public:
+    JsonValueBuilder();
+
+    // Strings without escapes found in the buffer become string views of it
+    // kept alive by the anchor instead of copies (see Value).
+    void setBuffer(const char *data, size_t size, const boost::shared_ptr<const void> &anchor);
+    // items reserved for an array when no array at its depth was seen yet
+    void setReserveHint(size_t items);
+
+    Value result() const;
+
+    virtual void null();
+    virtual void boolean(bool value);
+    virtual void integer(int64_t value);
+    virtual void number(double value);
+    virtual void string(const char *data, size_t size);
+
+    virtual void startObject();
+    virtual void key(const char *data, size_t size);
+    virtual void endObject();
+
+    virtual void startArray();
+    virtual void endArray();
+
+private:
+    void add(const Value &value);
+
+    Value root;
+    std::vector<Value> containers;
+    std::vector<size_t> arraySizes;     // of the last array by depth
+    size_t reserveHint;
+
+    boost::unordered_set<std::string> names;
+    const std::string *name;            // of the next member
+    std::string nameBuffer;             // when there are too many names
+
+    const char *bufferBegin;
+    const char *bufferEnd;
+    boost::shared_ptr<const void> anchor;
+};
+
+struct JsonIndex;
+
+// A value of a JSON text indexed by parseJsonLazy(): an object or an array
+// that decodes its members and items only when they are looked up.
+struct JsonNode {
+    JsonNode() : entry(0) {}
+    JsonNode(const boost::shared_ptr<const JsonIndex> &index, size_t entry)
+        : index(index), entry(entry) {}
+
+    boost::shared_ptr<const JsonIndex> index;
+    size_t entry;
+};
+
+template<>
+struct ValueTypeInfo<JsonNode> : public ValueTypeInfoBase<JsonNode> {
+    static bool member(const JsonNode &node, const std::string &name, Value *result);
+    static size_t size(const JsonNode &node);
+    static Value at(const JsonNode &node, size_t index);
+    static bool writeJson(const JsonNode &node, std::string &out);
+};
+
+/* One-shot parsing of a whole document, null on error. The error is written
+ * to error if it is given. */
+Value parseJson(const char *data, size_t size, std::string *error = NULL);
+Value parseJson(const std::string &json, std::string *error = NULL);
+/* strings of the result may refer to the text, the json is kept alive by them */
+Value parseJson(const boost::shared_ptr<const std::string> &json, std::string *error = NULL);
+/* Checks the text and records where its values are in one pass, objects and
+ * arrays of the result are JsonNode values decoded as the template reads
+ * them. Scalars are decoded on every lookup, so it pays off when a few
+ * fields of a large document are used. */
+Value parseJsonLazy(const boost::shared_ptr<const std::string> &json, std::string *error = NULL);
+
+} // namespace cpptl
+
+#endif // CPPTL_JSONPARSER_H
@@ -0,0 +1,608 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <sstream>
+
+#include "msgpackcodec.h"
+#include "jsonparser.h"
+
+namespace cpptl {
+
+// text given to a stream at once
+static const size_t chunkSize = 16 * 1024;
+// the extension type of unsafe strings
+static const int unsafeStringType = 1;
+// strings at least that long become views of the buffer, see jsonparser.cpp
+static const size_t minViewSize = 64;
+// arrays and maps in each other, a bad message may not exhaust the stack
+static const int maxDepth = 512;
+
+static void putBigEndian(std::string &out, uint64_t value, int bytes)
+{
+    char buf[8];
+
+    for(int i = bytes - 1; i >= 0; --i)
+    {
+        buf[i] = static_cast<char>(value & 0xFF);
+        value >>= 8;
+    }
+
+    out.append(buf, bytes);
+}
+
+static void putByte(std::string &out, int byte)
+{
+    out += static_cast<char>(byte);
+}
+
+// the type byte and the value in bytes
+static void putTyped(std::string &out, int type, uint64_t value, int bytes)
+{
+    putByte(out, type);
+    putBigEndian(out, value, bytes);
+}
+
+static void putInteger(std::string &out, int64_t value)
+{
+    if( value >= 0 )
+    {
+        if( value < 0x80 )
+            putByte(out, static_cast<int>(value));
+        else if( value <= 0xFF )
+            putTyped(out, 0xCC, value, 1);
+        else if( value <= 0xFFFF )
+            putTyped(out, 0xCD, value, 2);
+        else if( value <= 0xFFFFFFFFLL )
+            putTyped(out, 0xCE, value, 4);
+        else
+            putTyped(out, 0xCF, value, 8);
+    }
+    else
+    {
+        if( value >= -32 )
+            putByte(out, static_cast<int>(value & 0xFF));
+        else if( value >= -0x80 )
+            putTyped(out, 0xD0, value, 1);
+        else if( value >= -0x8000 )
+            putTyped(out, 0xD1, value, 2);
+        else if( value >= -0x80000000LL )
+            putTyped(out, 0xD2, value, 4);
+        else
+            putTyped(out, 0xD3, value, 8);
+    }
+}
+
+static void putDouble(std::string &out, double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    putByte(out, 0xCB);
+    putBigEndian(out, bits, 8);
+}
+
+// fix is the first byte of the short form, sizes below fixLimit are in it;
+// the 8 bit form is used if first8 is given
+static void putHeader(std::string &out, size_t size, int fix, size_t fixLimit, int first8,
+                      int first16, int first32)
+{
+    if( size < fixLimit )
+        putByte(out, fix | static_cast<int>(size));
+    else if( size <= 0xFF && first8 )
+        putTyped(out, first8, size, 1);
+    else if( size <= 0xFFFF )
+        putTyped(out, first16, size, 2);
+    else
+        putTyped(out, first32, size, 4);
+}
+
+static void putString(std::string &out, const std::string &s)
+{
+    putHeader(out, s.size(), 0xA0, 32, 0xD9, 0xDA, 0xDB);
+    out += s;
+}
+
+static void flush(std::string &out, std::ostream *stream)
+{
+    if( stream && out.size() >= chunkSize )
+    {
+        stream->write(out.data(), out.size());
+        out.clear();
+    }
+}
+
+static void encode(const Value &value, std::string &out, std::ostream *stream)
+{
+    switch(value.type())
+    {
+    case Value::Bool:
+        putByte(out, value.toBool() ? 0xC3 : 0xC2);
+        break;
+    case Value::Int:
+        putInteger(out, value.toInt64());
+        break;
+    case Value::Double:
+        putDouble(out, value.toDouble());
+        break;
+    case Value::String:
+        // a rope is written piece by piece
+        putHeader(out, value.stringSize(), 0xA0, 32, 0xD9, 0xDA, 0xDB);
+        value.appendString(out);
+        flush(out, stream);
+        break;
+    case Value::UnsafeString:
+        putHeader(out, value.stringSize(), 0, 0, 0xC7, 0xC8, 0xC9);
+        putByte(out, unsafeStringType);
+        value.appendString(out);
+        flush(out, stream);
+        break;
+    case Value::Array: {
+        const size_t size = value.size();
+
+        putHeader(out, size, 0x90, 16, 0, 0xDC, 0xDD);
+
+        if( const int64_t *integers = value.packedIntegers() )
+        {
+            for(size_t i = 0; i < size; ++i)
+                putInteger(out, integers[i]);
+        }
+        else if( const double *doubles = value.packedDoubles() )
+        {
+            for(size_t i = 0; i < size; ++i)
+                putDouble(out, doubles[i]);
+        }
+        else
+        {
+            Value::ValueIterator it(value);
+
+            while( it.hasNext() )
+                encode(it.next(), out, stream);
+        }
+
+        flush(out, stream);
+        break;
+    }
+    case Value::Object: {
+        Value::ValueIterator it(value);
+
+        putHeader(out, value.size(), 0x80, 16, 0, 0xDE, 0xDF);
+
+        while( it.hasNext() )
+        {
+            putString(out, it.key());
+            encode(it.next(), out, stream);
+        }
+
+        flush(out, stream);
+        break;
+    }
+    case Value::UserType: {
+        std::string json;
+
+        value.writeJson(json);
+        encode(parseJson(json), out, stream);
+        break;
+    }
+    case Value::Lazy:
+        encode(value.resolve(), out, stream);
+        break;
+    case Value::Generator:
+        encode(value.materialize(), out, stream);
+        break;
+    default:
+        putByte(out, 0xC0);
+        break;
+    }
+}
+
+void encodeMsgPack(const Value &value, std::string &out)
+{
+    encode(value, out, NULL);
+}
+
+void encodeMsgPack(const Value &value, std::ostream &out)
+{
+    std::string buffer;
+
+    buffer.reserve(chunkSize * 2);
+    encode(value, buffer, &out);
+
+    if( buffer.empty() == false )
+        out.write(buffer.data(), buffer.size());
+}
+
+namespace {
+
+class BufferReader {
+public:
+    BufferReader(const char *data, size_t size) : begin(data), p(data), end(data + size) {}
+
+    bool read(void *to, size_t size) {
+        if( static_cast<size_t>(end - p) < size )
+            return false;
+
+        memcpy(to, p, size);
+        p += size;
+        return true;
+    }
+
+    // the bytes in place, NULL if there are not so many
+    const char *take(size_t size) {
+        if( static_cast<size_t>(end - p) < size )
+            return NULL;
+
+        p += size;
+        return p - size;
+    }
+
+    size_t position() const { return p - begin; }
+
+private:
+    const char *begin;
+    const char *p;
+    const char *end;
+};
+
+// reads as much as asked only, the rest is left in the stream
+class StreamReader {
+public:
+    explicit StreamReader(std::istream &in) : buffer(in.rdbuf()), count(0) {}
+
+    bool read(void *to, size_t size) {
+        const std::streamsize n = buffer ? buffer->sgetn(static_cast<char *>(to), size) : 0;
+
+        count += n;
+        return static_cast<size_t>(n) == size;
+    }
+
+    const char *take(size_t) { return NULL; }
+
+    size_t position() const { return count; }
+
+private:
+    std::streambuf *buffer;
+    size_t count;
+};
+
+template<typename Reader>
+class MsgPackDecoder {
+public:
+    MsgPackDecoder(Reader &reader, const boost::shared_ptr<const void> &anchor)
+        : reader(reader), anchor(anchor) {}
+
+    // null on error, see failed()
+    Value decode(int depth);
+    bool failed() const { return error.empty() == false; }
+
+    std::string error;
+
+private:
+    Value fail(const char *what);
+    bool readUnsigned(int bytes, uint64_t &value);
+    bool readBytes(size_t size, const char *&data, std::string &buffer);
+    Value readString(size_t size, bool unsafe);
+    Value readArray(size_t size, int depth);
+    Value readMap(size_t size, int depth);
+    Value readExtension(size_t size);
+
+    Reader &reader;
+    boost::shared_ptr<const void> anchor;
+};
+
+template<typename Reader>
+Value MsgPackDecoder<Reader>::fail(const char *what)
+{
+    std::ostringstream ss;
+
+    ss << "MessagePack error at " << reader.position() << ": " << what;
+    error = ss.str();
+
+    return Value();
+}
+
+template<typename Reader>
+bool MsgPackDecoder<Reader>::readUnsigned(int bytes, uint64_t &value)
+{
+    unsigned char buf[8];
+
+    if( reader.read(buf, bytes) == false )
+    {
+        fail("unexpected end of the data");
+        return false;
+    }
+
+    value = 0;
+
+    for(int i = 0; i < bytes; ++i)
+        value = (value << 8) | buf[i];
+
+    return true;
+}
+
+// in place if the reader can, in buffer otherwise
+template<typename Reader>
+bool MsgPackDecoder<Reader>::readBytes(size_t size, const char *&data, std::string &buffer)
+{
+    data = reader.take(size);
+
+    if( data )
+        return true;
+
+    // a stream, a bad size may not allocate more than the stream has
+    buffer.clear();
+
+    while( buffer.size() < size )
+    {
+        const size_t offset = buffer.size();
+
+        buffer.resize(offset + std::min<size_t>(size - offset, 64 * 1024));
+
+        if( reader.read(&buffer[offset], buffer.size() - offset) == false )
+        {
+            fail("unexpected end of the data");
+            return false;
+        }
+    }
+
+    data = buffer.data();
+    return true;
+}
+
+template<typename Reader>
+Value MsgPackDecoder<Reader>::readString(size_t size, bool unsafe)
+{
+    const char *data;
+    std::string buffer;
+
+    if( readBytes(size, data, buffer) == false )
+        return Value();
+
+    const bool inPlace = data != buffer.data();
+
+    if( anchor && inPlace && size >= minViewSize )
+    {
+        return unsafe ? Value(data, size, anchor, Value::UnsafeStringTag())
+                      : Value(data, size, anchor);
+    }
+
+    if( inPlace )
+        buffer.assign(data, size);
+
+    return unsafe ? Value(buffer, Value::UnsafeStringTag()) : Value(buffer);
+}
+
+template<typename Reader>
+Value MsgPackDecoder<Reader>::readArray(size_t size, int depth)
+{
+    if( depth >= maxDepth )
+        return fail("nesting is too deep");
+
+    Value result(Value::Array);
+
+    result.reserve(std::min<size_t>(size, 64 * 1024));
+
+    for(size_t i = 0; i < size; ++i)
+    {
+        result.append(decode(depth + 1));
+
+        if( failed() )
+            return Value();
+    }
+
+    return result;
+}
+
+template<typename Reader>
+Value MsgPackDecoder<Reader>::readMap(size_t size, int depth)
+{
+    if( depth >= maxDepth )
+        return fail("nesting is too deep");
+
+    Value result(Value::Object);
+    std::string buffer;
+
+    for(size_t i = 0; i < size; ++i)
+    {
+        unsigned char c;
+        uint64_t length = 0;
+        const char *data;
+
+        if( reader.read(&c, 1) == false )
+            return fail("unexpected end of the data");
+
+        if( c >= 0xA0 && c <= 0xBF )
+            length = c & 0x1F;
+        else if( c < 0xD9 || c > 0xDB )
+            return fail("member name expected");
+        else if( readUnsigned(1 << (c - 0xD9), length) == false )
+            return Value();
+
+        if( readBytes(length, data, buffer) == false )
+            return Value();
+
+        const std::string name(data, length);
+
+        result[name] = decode(depth + 1);
+
+        if( failed() )
+            return Value();
+    }
+
+    return result;
+}
+
+template<typename Reader>
+Value MsgPackDecoder<Reader>::readExtension(size_t size)
+{
+    unsigned char type;
+
+    if( reader.read(&type, 1) == false )
+        return fail("unexpected end of the data");
+
+    if( type != unsafeStringType )
+        return fail("unknown extension type");
+
+    return readString(size, true);
+}
+
+template<typename Reader>
+Value MsgPackDecoder<Reader>::decode(int depth)
+{
+    unsigned char c;
+    uint64_t n;
+
+    if( reader.read(&c, 1) == false )
+        return fail("unexpected end of the data");
+
+    if( c <= 0x7F )
+        return Value(static_cast<int64_t>(c));
+    else if( c >= 0xE0 )
+        return Value(static_cast<int64_t>(static_cast<int8_t>(c)));
+    else if( c <= 0x8F )
+        return readMap(c & 0x0F, depth);
+    else if( c <= 0x9F )
+        return readArray(c & 0x0F, depth);
+    else if( c <= 0xBF )
+        return readString(c & 0x1F, false);
+
+    switch(c)
+    {
+    case 0xC0:
+        return Value();
+    case 0xC2:
+    case 0xC3:
+        return Value(c == 0xC3);
+    case 0xC4:  // bin 8, 16, 32 are read as strings
+    case 0xC5:
+    case 0xC6:
+        return readUnsigned(1 << (c - 0xC4), n) ? readString(n, false) : Value();
+    case 0xC7:  // ext 8, 16, 32
+    case 0xC8:
+    case 0xC9:
+        return readUnsigned(1 << (c - 0xC7), n) ? readExtension(n) : Value();
+    case 0xCA: {
+        float f;
+        uint32_t bits;
+
+        if( readUnsigned(4, n) == false )
+            return Value();
+
+        bits = static_cast<uint32_t>(n);
+        memcpy(&f, &bits, sizeof(f));
+        return Value(static_cast<double>(f));
+    }
+    case 0xCB: {
+        double d;
+
+        if( readUnsigned(8, n) == false )
+            return Value();
+
+        memcpy(&d, &n, sizeof(d));
+        return Value(d);
+    }
+    case 0xCC:  // uint 8, 16, 32, 64
+    case 0xCD:
+    case 0xCE:
+    case 0xCF:
+        if( readUnsigned(1 << (c - 0xCC), n) == false )
+            return Value();
+
+        // larger than int64_t can hold
+        if( n > static_cast<uint64_t>(INT64_MAX) )
+            return Value(static_cast<double>(n));
+
+        return Value(static_cast<int64_t>(n));
+    case 0xD0:  // int 8, 16, 32, 64
+    case 0xD1:
+    case 0xD2:
+    case 0xD3: {
+        const int bytes = 1 << (c - 0xD0);
+
+        if( readUnsigned(bytes, n) == false )
+            return Value();
+
+        // sign extension
+        if( bytes < 8 && (n >> (bytes * 8 - 1)) )
+            n |= ~static_cast<uint64_t>(0) << (bytes * 8);
+
+        return Value(static_cast<int64_t>(n));
+    }
+    case 0xD4:  // fixext 1, 2, 4, 8, 16
+    case 0xD5:
+    case 0xD6:
+    case 0xD7:
+    case 0xD8:
+        return readExtension(1 << (c - 0xD4));
+    case 0xD9:  // str 8, 16, 32
+    case 0xDA:
+    case 0xDB:
+        return readUnsigned(1 << (c - 0xD9), n) ? readString(n, false) : Value();
+    case 0xDC:  // array 16, 32
+    case 0xDD:
+        return readUnsigned(2 << (c - 0xDC), n) ? readArray(n, depth) : Value();
+    case 0xDE:  // map 16, 32
+    case 0xDF:
+        return readUnsigned(2 << (c - 0xDE), n) ? readMap(n, depth) : Value();
+    default:
+        return fail("bad type");
+    }
+}
+
+} // namespace
+
+template<typename Reader>
+static Value decode(Reader &reader, const boost::shared_ptr<const void> &anchor,
+                    std::string *error)
+{
+    MsgPackDecoder<Reader> decoder(reader, anchor);
+    Value result = decoder.decode(0);
+
+    if( decoder.failed() && error )
+        *error = decoder.error;
+
+    return result;
+}
+
+Value decodeMsgPack(const char *data, size_t size, std::string *error)
+{
+    BufferReader reader(data, size);
+
+    return decode(reader, boost::shared_ptr<const void>(), error);
+}
+
+Value decodeMsgPack(const std::string &data, std::string *error)
+{
+    return decodeMsgPack(data.data(), data.size(), error);
+}
+
+Value decodeMsgPack(std::istream &in, std::string *error)
+{
+    StreamReader reader(in);
+    std::string errorText;
+    Value result = decode(reader, boost::shared_ptr<const void>(), &errorText);
+
+    if( errorText.empty() == false )
+    {
+        in.setstate(std::ios::failbit);
+
+        if( error )
+            *error = errorText;
+    }
+
+    return result;
+}
+
+Value decodeMsgPack(const boost::shared_ptr<const std::string> &data, std::string *error)
+{
+    BufferReader reader(data->data(), data->size());
+
+    return decode(reader, data, error);
+}
+
+} // namespace cpptl
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_MSGPACKCODEC_H
+#define CPPTL_MSGPACKCODEC_H
+
+#include <iosfwd>
+#include <string>
+#include <boost/shared_ptr.hpp>
+
+#include "value.h"
+
+namespace cpptl {
+
+/* Values in MessagePack (msgpack.org), to pass them between processes or
+ * keep them in a cache. An unsafe string is the extension type 1 holding its
+ * bytes, user types are written as their JSON (see Value::writeJson()) is
+ * read back. Integers take the smallest form that fits, doubles are always
+ * 64 bit. */
+void encodeMsgPack(const Value &value, std::string &out);
+// written in parts of a few KB
+void encodeMsgPack(const Value &value, std::ostream &out);
+
+/* Reads one value, null on error. The error is written to error if it is
+ * given. A stream is left right after the value, so several values may be
+ * sent one after another. */
+Value decodeMsgPack(const char *data, size_t size, std::string *error = NULL);
+Value decodeMsgPack(const std::string &data, std::string *error = NULL);
+Value decodeMsgPack(std::istream &in, std::string *error = NULL);
+/* strings of the result may refer to the buffer instead of copies of it,
+ * the buffer is kept alive by them */
+Value decodeMsgPack(const boost::shared_ptr<const std::string> &data, std::string *error = NULL);
+
+} // namespace cpptl
+
+#endif // CPPTL_MSGPACKCODEC_H
@@ -20,7 +20,7 @@
 }
 
 %token OPEN_BRACKET CLOSE_BRACKET OPEN_BRACE CLOSE_BRACE ANY_CHAR
-%token IF FOR UNLESS ELSE ELSE_IF
+%token IF FOR UNLESS ELSE ELSE_IF CACHE
 %token VAR_TOKEN IN_TOKEN COMMA QUOTE_OPEN QUOTE_CLOSE DOT COLON
 %token PLUS MINUS EQ NOT_EQ GREAT_OR_EQ GREAT LESS_OR_EQ LESS MULTIPLY DIVIDE
 %token START_BRACKET QUESTION
@@ -30,7 +30,7 @@
 
 %type <node> template html_or_code if variable code html expression
 %type <node> sub_expression text_variable text_variable_members
-%type <node> statement for unless arguments argument_list
+%type <node> statement for unless cache arguments argument_list
 %type <node> else_if else_ifs string text_string call_helper
 %type <node> object object_member object_members
 
@@ -53,6 +53,7 @@ html_or_code: code   { $$ = $1; }
 code: if        { $$ = $1; }
     | unless    { $$ = $1; }
     | for       { $$ = $1; }
+    | cache     { $$ = $1; }
     | variable  { $$ = $1; }
     ;
 
@@ -164,6 +165,9 @@ for: FOR OPEN_BRACKET WORD IN_TOKEN text_variable CLOSE_BRACKET statement
                             }
    ;
 
+cache: CACHE arguments statement { $$ = nodeAddCache($2, $3); }
+     ;
+
 sub_expression: INTEGER     { $$ = nodeAddIntegerExpression(yyval.integer); }
              | call_helper  { $$ = $1;  /* helper() */}
              | call_helper DOT text_variable_members
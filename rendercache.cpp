@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include "rendercache.h"
+
+namespace cpptl {
+
+bool RenderCache::KeyEqual::operator()(const Key &lhs, const Key &rhs) const
+{
+    return lhs.templ == rhs.templ && lhs.context.identical(rhs.context);
+}
+
+bool RenderCache::KeyEqual::operator()(const LookupKey &lhs, const Key &rhs) const
+{
+    return lhs.templ == rhs.templ && lhs.context.identical(rhs.context);
+}
+
+bool RenderCache::KeyEqual::operator()(const Key &lhs, const LookupKey &rhs) const
+{
+    return (*this)(rhs, lhs);
+}
+
+RenderCache::RenderCache(size_t capacity)
+    : capacity(capacity), hits(0), misses(0)
+{
+}
+
+bool RenderCache::find(size_t templ, const Value &context, size_t hash, std::string &out)
+{
+    boost::mutex::scoped_lock lock(mutex);
+    LookupKey key = {templ, context, hash};
+    Items::iterator it = items.find(key, KeyHash(), KeyEqual());
+
+    if( it == items.end() )
+    {
+        ++misses;
+        return false;
+    }
+
+    ++hits;
+    recent.splice(recent.begin(), recent, it->second.position);
+
+    // the next lookups with this context compare it by identity
+    if( context.isFrozen() )
+        it->first.context = context;
+
+    out = it->second.output;
+
+    return true;
+}
+
+void RenderCache::insert(size_t templ, const Value &context, size_t hash, const std::string &output)
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    if( capacity == 0 )
+        return;
+
+    // a frozen context can not change, the others are copied
+    Key key = {templ, context.isFrozen() ? context : context.clone(), hash};
+
+    key.context.freeze();
+
+    std::pair<Items::iterator, bool> inserted = items.insert(std::make_pair(key, Item()));
+    Item &item = inserted.first->second;
+
+    item.output = output;
+
+    if( inserted.second )
+    {
+        recent.push_front(&inserted.first->first);
+        item.position = recent.begin();
+        shrink(capacity);
+    }
+    else
+    {
+        recent.splice(recent.begin(), recent, item.position);
+    }
+}
+
+void RenderCache::clear()
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    items.clear();
+    recent.clear();
+}
+
+void RenderCache::setCapacity(size_t newCapacity)
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    capacity = newCapacity;
+    shrink(capacity);
+}
+
+RenderCacheStats RenderCache::stats() const
+{
+    boost::mutex::scoped_lock lock(mutex);
+    RenderCacheStats result;
+
+    result.hits = hits;
+    result.misses = misses;
+    result.size = items.size();
+
+    return result;
+}
+
+void RenderCache::resetStats()
+{
+    boost::mutex::scoped_lock lock(mutex);
+
+    hits = 0;
+    misses = 0;
+}
+
+void RenderCache::shrink(size_t size)
+{
+    while( items.size() > size )
+    {
+        Items::iterator it = items.find(*recent.back());
+
+        recent.pop_back();
+        items.erase(it);
+    }
+}
+
+} // namespace cpptl
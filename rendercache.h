@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_RENDERCACHE_H
+#define CPPTL_RENDERCACHE_H
+
+#include <list>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "templateengine.h"
+
+namespace cpptl {
+
+// Output of whole renders by compiled template and context, the contexts are
+// matched with Value::identical(). They are kept frozen, a context that is
+// not frozen yet is copied first, so changing it after the render does not
+// change the cached one. When the capacity is reached the least recently
+// used output is dropped, capacity 0 disables the cache.
+class RenderCache {
+public:
+    explicit RenderCache(size_t capacity = 0);
+
+    bool isEnabled() const { return capacity != 0; }
+
+    // template is an id of the compiled tree, a recompiled template gets a new one
+    bool find(size_t templ, const Value &context, size_t hash, std::string &out);
+    void insert(size_t templ, const Value &context, size_t hash, const std::string &output);
+
+    void clear();
+    void setCapacity(size_t capacity);
+    RenderCacheStats stats() const;
+    void resetStats();
+
+private:
+    struct Key {
+        size_t templ;
+        mutable Value context;  // can be replaced by an equal frozen one
+        size_t hash;
+    };
+
+    // the context of the render, not copied for lookup
+    struct LookupKey {
+        size_t templ;
+        const Value &context;
+        size_t hash;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const { return key.hash; }
+        size_t operator()(const LookupKey &key) const { return key.hash; }
+    };
+
+    struct KeyEqual {
+        bool operator()(const Key &lhs, const Key &rhs) const;
+        bool operator()(const LookupKey &lhs, const Key &rhs) const;
+        bool operator()(const Key &lhs, const LookupKey &rhs) const;
+    };
+
+    struct Item {
+        std::string output;
+        std::list<const Key *>::iterator position;
+    };
+
+    typedef boost::unordered_map<Key, Item, KeyHash, KeyEqual> Items;
+
+    void shrink(size_t size);
+
+    mutable boost::mutex mutex;
+    Items items;
+    std::list<const Key *> recent;  // most recently used first
+    size_t capacity;
+    size_t hits;
+    size_t misses;
+};
+
+} // namespace cpptl
+
+#endif // CPPTL_RENDERCACHE_H
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/static_assert.hpp>
+
+#include "snapshot.h"
+#include "jsonparser.h"
+
+namespace cpptl {
+
+/* The file is the header, the data of the values and the trailer with the
+ * root. A value is a slot: numbers are in it, strings, arrays and objects
+ * are at its offset and are written before their parents. An array is its
+ * item slots, an object is its sorted names followed by the value slots. */
+static const char magic[8] = {'C', 'P', 'T', 'L', 'S', 'N', 'A', 'P'};
+static const uint32_t version = 1;
+static const uint32_t byteOrder = 0x01020304;
+
+enum SlotType {
+    NullSlot,
+    BoolSlot,
+    IntSlot,
+    DoubleSlot,
+    StringSlot,
+    UnsafeStringSlot,
+    ArraySlot,
+    ObjectSlot
+};
+
+struct Slot {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t size;      // bytes of a string, items of an array or an object
+    uint64_t payload;   // the bool, the integer, the double bits or the offset
+};
+
+struct NameEntry {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+};
+
+struct Trailer {
+    Slot root;
+    char magic[8];
+};
+
+BOOST_STATIC_ASSERT(sizeof(Slot) == 16 && sizeof(NameEntry) == 16);
+BOOST_STATIC_ASSERT(sizeof(Header) == 16 && sizeof(Trailer) == 24);
+
+struct Snapshot {
+    const char *data;
+    size_t size;
+    boost::shared_ptr<const void> anchor;   // the mapping or the buffer
+};
+
+namespace {
+
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(std::ostream &out) : out(out), position(0) {}
+
+    void put(const void *data, size_t size);
+    Slot write(const Value &value);
+
+    // what is too large for the file, nothing is written after it
+    const std::string &error() const { return errorText; }
+
+private:
+    // slots and names are read in place, they are aligned
+    void align();
+    // sizes are uint32_t in the file
+    bool fits(uint64_t size, const char *what);
+    Slot slot(SlotType type, uint32_t size, uint64_t payload);
+
+    std::ostream &out;
+    uint64_t position;
+    std::string errorText;
+};
+
+void SnapshotWriter::put(const void *data, size_t size)
+{
+    out.write(static_cast<const char *>(data), size);
+    position += size;
+}
+
+void SnapshotWriter::align()
+{
+    static const char zeros[8] = {0};
+
+    if( position % 8 )
+        put(zeros, 8 - position % 8);
+}
+
+bool SnapshotWriter::fits(uint64_t size, const char *what)
+{
+    if( size <= std::numeric_limits<uint32_t>::max() )
+        return true;
+
+    if( errorText.empty() )
+    {
+        std::ostringstream text;
+
+        text << what << " of " << size << " is too large for a snapshot";
+        errorText = text.str();
+    }
+
+    return false;
+}
+
+Slot SnapshotWriter::slot(SlotType type, uint32_t size, uint64_t payload)
+{
+    Slot result;
+
+    memset(&result, 0, sizeof(result));
+    result.type = type;
+    result.size = size;
+    result.payload = payload;
+
+    return result;
+}
+
+Slot SnapshotWriter::write(const Value &value)
+{
+    if( errorText.empty() == false )
+        return slot(NullSlot, 0, 0);
+
+    switch(value.type())
+    {
+    case Value::Bool:
+        return slot(BoolSlot, 0, value.toBool());
+    case Value::Int:
+        return slot(IntSlot, 0, value.toInt64());
+    case Value::Double: {
+        const double d = value.toDouble();
+        uint64_t bits;
+
+        memcpy(&bits, &d, sizeof(bits));
+        return slot(DoubleSlot, 0, bits);
+    }
+    case Value::String:
+    case Value::UnsafeString: {
+        const uint64_t offset = position;
+
+        if( fits(value.stringSize(), "a string") == false )
+            return slot(NullSlot, 0, 0);
+
+        put(value.stringData(), value.stringSize());
+        return slot(value.type() == Value::String ? StringSlot : UnsafeStringSlot,
+                    value.stringSize(), offset);
+    }
+    case Value::Array: {
+        std::vector<Slot> items;
+        Value::ValueIterator it(value);
+
+        items.reserve(value.size());
+
+        while( it.hasNext() )
+            items.push_back(write(it.next()));
+
+        if( fits(items.size(), "an array") == false )
+            return slot(NullSlot, 0, 0);
+
+        align();
+
+        const uint64_t offset = position;
+
+        if( items.empty() == false )
+            put(&items[0], items.size() * sizeof(Slot));
+
+        return slot(ArraySlot, items.size(), offset);
+    }
+    case Value::Object: {
+        std::vector<NameEntry> names;
+        std::vector<Slot> values;
+        Value::ValueIterator it(value);
+
+        names.reserve(value.size());
+        values.reserve(value.size());
+
+        // std::map keeps the names in the order of memcmp
+        while( it.hasNext() )
+        {
+            if( fits(it.key().size(), "a member name") == false )
+                return slot(NullSlot, 0, 0);
+
+            NameEntry name = {position, static_cast<uint32_t>(it.key().size()), 0};
+
+            put(it.key().data(), it.key().size());
+            names.push_back(name);
+            values.push_back(write(it.next()));
+        }
+
+        if( fits(names.size(), "an object") == false )
+            return slot(NullSlot, 0, 0);
+
+        align();
+
+        const uint64_t offset = position;
+
+        if( names.empty() == false )
+        {
+            put(&names[0], names.size() * sizeof(NameEntry));
+            put(&values[0], values.size() * sizeof(Slot));
+        }
+
+        return slot(ObjectSlot, names.size(), offset);
+    }
+    case Value::UserType: {
+        std::string json;
+
+        value.writeJson(json);
+        return write(parseJson(json));
+    }
+    case Value::Lazy:
+        return write(value.resolve());
+    case Value::Generator:
+        return write(value.materialize());
+    default:
+        return slot(NullSlot, 0, 0);
+    }
+}
+
+} // namespace
+
+bool writeSnapshot(const Value &value, std::ostream &out, std::string *error)
+{
+    SnapshotWriter writer(out);
+    Header header;
+    Trailer trailer;
+
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.byteOrder = byteOrder;
+    writer.put(&header, sizeof(header));
+
+    trailer.root = writer.write(value);
+
+    // without the trailer the text is not a snapshot
+    if( writer.error().empty() == false )
+    {
+        if( error )
+            *error = writer.error();
+
+        return false;
+    }
+
+    memcpy(trailer.magic, magic, sizeof(magic));
+    writer.put(&trailer, sizeof(trailer));
+    return true;
+}
+
+bool writeSnapshot(const Value &value, const std::string &fileName, std::string *error)
+{
+    // a new file replaces the old one at once, processes that have the old
+    // one mapped keep it
+    const std::string tmpName = fileName + ".tmp";
+    std::ofstream out(tmpName.c_str(), std::ios::binary | std::ios::trunc);
+    std::string reason;
+    bool written = false;
+
+    if( out )
+    {
+        written = writeSnapshot(value, out, &reason);
+        out.close();
+    }
+
+    if( !written || !out || rename(tmpName.c_str(), fileName.c_str()) != 0 )
+    {
+        remove(tmpName.c_str());
+
+        if( error )
+            *error = "can't write the snapshot " + fileName + (reason.empty() ? "" : ": " + reason);
+
+        return false;
+    }
+
+    return true;
+}
+
+static bool readSlot(const Snapshot &snapshot, uint64_t offset, Slot &slot)
+{
+    if( offset > snapshot.size || snapshot.size - offset < sizeof(Slot) )
+        return false;
+
+    memcpy(&slot, snapshot.data + offset, sizeof(Slot));
+    return true;
+}
+
+/* An array or an object. Its slots are written before it, so they are
+ * checked to end before it: the slots of a damaged file can't point to
+ * themselves and loop. */
+static bool readContainer(const Snapshot &snapshot, uint64_t offset, Slot &slot)
+{
+    if( readSlot(snapshot, offset, slot) == false )
+        return false;
+
+    const uint64_t entries = slot.type == ObjectSlot ? slot.size * 2ULL
+                                                     : (slot.type == ArraySlot ? slot.size : 0);
+
+    return (slot.type == ArraySlot || slot.type == ObjectSlot)
+            && slot.payload <= offset
+            && (offset - slot.payload) / sizeof(Slot) >= entries;
+}
+
+static bool readName(const Snapshot &snapshot, const Slot &object, size_t index,
+                     const char *&data, size_t &size)
+{
+    NameEntry name;
+
+    memcpy(&name, snapshot.data + object.payload + index * sizeof(NameEntry), sizeof(name));
+
+    if( name.offset > snapshot.size || snapshot.size - name.offset < name.size )
+        return false;
+
+    data = snapshot.data + name.offset;
+    size = name.size;
+    return true;
+}
+
+static Value slotValue(const boost::shared_ptr<const Snapshot> &snapshot, uint64_t offset)
+{
+    Slot slot;
+
+    if( readSlot(*snapshot, offset, slot) == false )
+        return Value();
+
+    switch(slot.type)
+    {
+    case BoolSlot:
+        return Value(slot.payload != 0);
+    case IntSlot:
+        return Value(static_cast<int64_t>(slot.payload));
+    case DoubleSlot: {
+        double d;
+
+        memcpy(&d, &slot.payload, sizeof(d));
+        return Value(d);
+    }
+    case StringSlot:
+    case UnsafeStringSlot:
+        if( slot.payload > snapshot->size || snapshot->size - slot.payload < slot.size )
+            return Value();
+        else if( slot.type == StringSlot )
+            return Value(snapshot->data + slot.payload, slot.size, snapshot);
+        else
+            return Value(snapshot->data + slot.payload, slot.size, snapshot, Value::UnsafeStringTag());
+    case ArraySlot:
+    case ObjectSlot:
+        if( readContainer(*snapshot, offset, slot) == false )
+            return Value();
+
+        return Value::fromValue(SnapshotNode(snapshot, offset));
+    default:
+        return Value();
+    }
+}
+
+bool ValueTypeInfo<SnapshotNode>::member(const SnapshotNode &node, const std::string &name,
+                                         Value *result)
+{
+    const Snapshot &snapshot = *node.snapshot;
+    Slot object;
+
+    if( readContainer(snapshot, node.slot, object) == false || object.type != ObjectSlot )
+        return false;
+
+    size_t first = 0;
+    size_t last = object.size;
+
+    while( first < last )
+    {
+        const size_t middle = first + (last - first) / 2;
+        const char *data;
+        size_t size;
+
+        if( readName(snapshot, object, middle, data, size) == false )
+            return false;
+
+        int compare = memcmp(data, name.data(), std::min(size, name.size()));
+
+        if( compare == 0 )
+            compare = size < name.size() ? -1 : (size > name.size() ? 1 : 0);
+
+        if( compare < 0 )
+        {
+            first = middle + 1;
+        }
+        else if( compare > 0 )
+        {
+            last = middle;
+        }
+        else
+        {
+            if( result )
+                *result = slotValue(node.snapshot, object.payload + (object.size + middle) * sizeof(Slot));
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t ValueTypeInfo<SnapshotNode>::size(const SnapshotNode &node)
+{
+    Slot slot;
+
+    return readContainer(*node.snapshot, node.slot, slot) ? slot.size : 0;
+}
+
+Value ValueTypeInfo<SnapshotNode>::at(const SnapshotNode &node, size_t index)
+{
+    Slot slot;
+
+    if( readContainer(*node.snapshot, node.slot, slot) == false || index >= slot.size )
+        return Value();
+
+    // the values of an object follow its names
+    if( slot.type == ObjectSlot )
+        index += slot.size;
+
+    return slotValue(node.snapshot, slot.payload + index * sizeof(Slot));
+}
+
+bool ValueTypeInfo<SnapshotNode>::writeJson(const SnapshotNode &node, std::string &out)
+{
+    const Snapshot &snapshot = *node.snapshot;
+    Slot slot;
+
+    if( readContainer(snapshot, node.slot, slot) == false )
+        return false;
+
+    out += slot.type == ObjectSlot ? '{' : '[';
+
+    for(size_t i = 0; i < slot.size; ++i)
+    {
+        const char *data;
+        size_t size;
+
+        if( i )
+            out += ',';
+
+        if( slot.type == ObjectSlot )
+        {
+            if( readName(snapshot, slot, i, data, size) == false )
+                return false;
+
+            Value(data, size, node.snapshot).writeJson(out);
+            out += ':';
+        }
+
+        at(node, i).writeJson(out);
+    }
+
+    out += slot.type == ObjectSlot ? '}' : ']';
+    return true;
+}
+
+Value openSnapshot(const std::string &fileName, std::string *error)
+{
+    using namespace boost::interprocess;
+
+    try
+    {
+        file_mapping file(fileName.c_str(), read_only);
+        boost::shared_ptr<mapped_region> region = boost::make_shared<mapped_region>(file, read_only);
+
+        return openSnapshot(static_cast<const char *>(region->get_address()), region->get_size(),
+                            region, error);
+    }
+    catch(const interprocess_exception &e)
+    {
+        if( error )
+            *error = "can't map the snapshot " + fileName + ": " + e.what();
+
+        return Value();
+    }
+}
+
+Value openSnapshot(const char *data, size_t size, const boost::shared_ptr<const void> &anchor,
+                   std::string *error)
+{
+    Header header;
+    Trailer trailer;
+
+    if( size < sizeof(Header) + sizeof(Trailer) )
+    {
+        if( error )
+            *error = "not a snapshot";
+
+        return Value();
+    }
+
+    memcpy(&header, data, sizeof(header));
+    memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+
+    if( memcmp(header.magic, magic, sizeof(magic)) != 0
+            || memcmp(trailer.magic, magic, sizeof(magic)) != 0 )
+    {
+        if( error )
+            *error = "not a snapshot";
+
+        return Value();
+    }
+    else if( header.version != version || header.byteOrder != byteOrder )
+    {
+        if( error )
+            *error = "a snapshot of another version or byte order";
+
+        return Value();
+    }
+
+    boost::shared_ptr<Snapshot> snapshot = boost::make_shared<Snapshot>();
+
+    snapshot->data = data;
+    snapshot->size = size;
+    snapshot->anchor = anchor;
+
+    return slotValue(snapshot, size - sizeof(Trailer));
+}
+
+} // namespace cpptl
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_SNAPSHOT_H
+#define CPPTL_SNAPSHOT_H
+
+#include <iosfwd>
+#include <string>
+#include <boost/shared_ptr.hpp>
+
+#include "value.h"
+
+namespace cpptl {
+
+struct Snapshot;
+
+// An object or an array of a snapshot, read from the snapshot bytes when it
+// is looked up, see openSnapshot()
+struct SnapshotNode {
+    SnapshotNode() : slot(0) {}
+    SnapshotNode(const boost::shared_ptr<const Snapshot> &snapshot, uint64_t slot)
+        : snapshot(snapshot), slot(slot) {}
+
+    boost::shared_ptr<const Snapshot> snapshot;
+    uint64_t slot;  // the offset of the node in the snapshot
+};
+
+template<>
+struct ValueTypeInfo<SnapshotNode> : public ValueTypeInfoBase<SnapshotNode> {
+    static bool member(const SnapshotNode &node, const std::string &name, Value *result);
+    static size_t size(const SnapshotNode &node);
+    static Value at(const SnapshotNode &node, size_t index);
+    static bool writeJson(const SnapshotNode &node, std::string &out);
+};
+
+/* A Value tree as a file without pointers: offsets only, so it is used in
+ * place wherever it is mapped. Members of an object are sorted by name and
+ * found by a binary search, items of an array are found by the index. The
+ * numbers are in the byte order of the host that writes the file. Sizes are
+ * 32 bit: a longer string or a larger array or object is an error, written
+ * to error if it is given. */
+bool writeSnapshot(const Value &value, std::ostream &out, std::string *error = NULL);
+bool writeSnapshot(const Value &value, const std::string &fileName, std::string *error = NULL);
+
+/* The file mapped read only: processes opening the same file share its
+ * pages. Objects and arrays of the result are SnapshotNode values, strings
+ * refer to the mapped bytes; the mapping is kept while any of them lives.
+ * Null on error, the error is written to error if it is given. */
+Value openSnapshot(const std::string &fileName, std::string *error = NULL);
+// a snapshot in memory, kept alive by the anchor
+Value openSnapshot(const char *data, size_t size, const boost::shared_ptr<const void> &anchor,
+                   std::string *error = NULL);
+
+} // namespace cpptl
+
+#endif // CPPTL_SNAPSHOT_H
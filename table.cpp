@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include <cassert>
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "table.h"
+
+namespace cpptl {
+
+struct TableColumn {
+    std::string name;
+    Value::Type type;
+
+    std::vector<int64_t> integers;  // Bool and Int
+    std::vector<double> doubles;
+    std::string text;               // String and UnsafeString: the bytes of all the cells
+    std::vector<size_t> ends;       // and the end of every cell in text
+    std::vector<Value> values;      // the other types
+
+    bool isText() const {
+        return type == Value::String || type == Value::UnsafeString;
+    }
+};
+
+struct TableData {
+    TableData() : rows(0) {}
+
+    std::vector<TableColumn> columns;
+    boost::unordered_map<std::string, size_t> index;
+    size_t rows;
+};
+
+Table::Table()
+    : data(boost::make_shared<TableData>())
+{
+}
+
+TableData &Table::writable()
+{
+    if( data.unique() == false )
+        data = boost::make_shared<TableData>(*data);
+
+    return *data;
+}
+
+size_t Table::addColumn(const std::string &name, Value::Type type)
+{
+    assert( data->rows == 0 && data->index.count(name) == 0 );
+
+    TableData &table = writable();
+    TableColumn column;
+
+    column.name = name;
+    column.type = type;
+
+    table.index[name] = table.columns.size();
+    table.columns.push_back(column);
+
+    return table.columns.size() - 1;
+}
+
+int Table::column(const std::string &name) const
+{
+    boost::unordered_map<std::string, size_t>::const_iterator it = data->index.find(name);
+
+    return it == data->index.end() ? -1 : static_cast<int>(it->second);
+}
+
+const std::string &Table::columnName(size_t column) const
+{
+    return data->columns.at(column).name;
+}
+
+Value::Type Table::columnType(size_t column) const
+{
+    return data->columns.at(column).type;
+}
+
+size_t Table::columnCount() const
+{
+    return data->columns.size();
+}
+
+size_t Table::rowCount() const
+{
+    return data->rows;
+}
+
+void Table::reserve(size_t rows)
+{
+    TableData &table = writable();
+
+    for(size_t i = 0; i < table.columns.size(); ++i)
+    {
+        TableColumn &column = table.columns[i];
+
+        if( column.type == Value::Bool || column.type == Value::Int )
+            column.integers.reserve(rows);
+        else if( column.type == Value::Double )
+            column.doubles.reserve(rows);
+        else if( column.isText() )
+            column.ends.reserve(rows);
+        else
+            column.values.reserve(rows);
+    }
+}
+
+void Table::appendRow()
+{
+    TableData &table = writable();
+
+    for(size_t i = 0; i < table.columns.size(); ++i)
+    {
+        TableColumn &column = table.columns[i];
+
+        if( column.type == Value::Bool || column.type == Value::Int )
+            column.integers.push_back(0);
+        else if( column.type == Value::Double )
+            column.doubles.push_back(0);
+        else if( column.isText() )
+            column.ends.push_back(column.text.size());
+        else
+            column.values.push_back(Value());
+    }
+
+    ++table.rows;
+}
+
+void Table::appendRow(const Value &row)
+{
+    appendRow();
+
+    for(size_t i = 0; i < data->columns.size(); ++i)
+    {
+        if( row.type() == Value::Array )
+            set(i, row.at(i));
+        else
+            set(i, row.member(data->columns[i].name));
+    }
+}
+
+void Table::set(size_t index, const Value &value)
+{
+    assert( data->rows != 0 );
+
+    TableData &table = writable();
+    TableColumn &column = table.columns.at(index);
+
+    switch(column.type)
+    {
+    case Value::Bool:
+        column.integers.back() = value.toBool();
+        break;
+    case Value::Int:
+        column.integers.back() = value.toInt64();
+        break;
+    case Value::Double:
+        column.doubles.back() = value.toDouble();
+        break;
+    case Value::String:
+    case Value::UnsafeString:
+        // the cell is the last one in text
+        column.text.resize(table.rows > 1 ? column.ends[table.rows - 2] : 0);
+
+        if( value.type() == Value::String || value.type() == Value::UnsafeString )
+            value.appendString(column.text);
+        else if( value.isNull() == false )
+            column.text += value.toString();
+
+        column.ends.back() = column.text.size();
+        break;
+    default:
+        column.values.back() = value;
+        break;
+    }
+}
+
+// string cells are views of the column text, the table is kept by them
+static Value cellValue(const boost::shared_ptr<const TableData> &data, size_t row, size_t index)
+{
+    const TableData &table = *data;
+    const TableColumn &column = table.columns[index];
+
+    switch(column.type)
+    {
+    case Value::Bool:
+        return Value(column.integers[row] != 0);
+    case Value::Int:
+        return Value(column.integers[row]);
+    case Value::Double:
+        return Value(column.doubles[row]);
+    case Value::String:
+    case Value::UnsafeString: {
+        const size_t begin = row ? column.ends[row - 1] : 0;
+        const char *text = column.text.data() + begin;
+
+        if( column.type == Value::String )
+            return Value(text, column.ends[row] - begin, data);
+        else
+            return Value(text, column.ends[row] - begin, data, Value::UnsafeStringTag());
+    }
+    default:
+        return column.values[row];
+    }
+}
+
+Value Table::cell(size_t row, size_t column) const
+{
+    if( row >= data->rows || column >= data->columns.size() )
+        return Value();
+
+    return cellValue(data, row, column);
+}
+
+size_t ValueTypeInfo<Table>::size(const Table &table)
+{
+    return table.data->rows;
+}
+
+Value ValueTypeInfo<Table>::at(const Table &table, size_t index)
+{
+    if( index >= table.data->rows )
+        return Value();
+
+    return Value::fromValue(TableRow(table.data, index));
+}
+
+bool ValueTypeInfo<TableRow>::member(const TableRow &row, const std::string &name, Value *result)
+{
+    boost::unordered_map<std::string, size_t>::const_iterator it = row.table->index.find(name);
+
+    if( it == row.table->index.end() )
+        return false;
+
+    if( result )
+        *result = cellValue(row.table, row.row, it->second);
+
+    return true;
+}
+
+size_t ValueTypeInfo<TableRow>::size(const TableRow &row)
+{
+    return row.table->columns.size();
+}
+
+Value ValueTypeInfo<TableRow>::at(const TableRow &row, size_t index)
+{
+    if( index >= row.table->columns.size() )
+        return Value();
+
+    return cellValue(row.table, row.row, index);
+}
+
+bool ValueTypeInfo<TableRow>::writeJson(const TableRow &row, std::string &out)
+{
+    out += '{';
+
+    for(size_t i = 0; i < row.table->columns.size(); ++i)
+    {
+        if( i )
+            out += ',';
+
+        Value(row.table->columns[i].name).writeJson(out);
+        out += ':';
+        cellValue(row.table, row.row, i).writeJson(out);
+    }
+
+    out += '}';
+    return true;
+}
+
+bool ValueTypeInfo<TableRow>::seek(TableRow &row, size_t index)
+{
+    row.row = index;
+    return true;
+}
+
+// A template writes the cells of a row straight from the columns, there
+// are no Values in between
+bool ValueTypeInfo<TableRow>::writeMember(const TableRow &row, const std::string &name,
+                                          std::string &out, Value::StringWriter write)
+{
+    boost::unordered_map<std::string, size_t>::const_iterator it = row.table->index.find(name);
+
+    if( it == row.table->index.end() )
+        return false;
+
+    const TableColumn &column = row.table->columns[it->second];
+
+    switch(column.type)
+    {
+    case Value::Bool:
+        out += column.integers[row.row] ? "true" : "false";
+        return true;
+    case Value::Int: {
+        char buf[32];
+        const int size = snprintf(buf, sizeof(buf), "%lld",
+                                  static_cast<long long>(column.integers[row.row]));
+        out.append(buf, size);
+        return true;
+    }
+    case Value::Double: {
+        char buf[32];
+        const int size = snprintf(buf, sizeof(buf), "%g", column.doubles[row.row]); // as std::ostream does
+        out.append(buf, size);
+        return true;
+    }
+    case Value::String:
+    case Value::UnsafeString: {
+        const size_t begin = row.row ? column.ends[row.row - 1] : 0;
+        const char *text = column.text.data() + begin;
+        const size_t size = column.ends[row.row] - begin;
+
+        if( column.type == Value::String && write )
+            write(out, text, size);
+        else
+            out.append(text, size);
+
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+} // namespace cpptl
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_TABLE_H
+#define CPPTL_TABLE_H
+
+#include <string>
+#include <boost/shared_ptr.hpp>
+
+#include "value.h"
+
+namespace cpptl {
+
+struct TableData;
+
+/* Rows of the same columns kept as one vector per column instead of an
+ * object per row: a cell costs its number or its string bytes, not a Value
+ * and a map node. Value::fromValue() of a table is an array of rows, the
+ * rows share the column names of the table and find a column by its name
+ * once per lookup. Copies of a table and the values made of it share its
+ * columns, a change of a shared table copies them first: a value (and a
+ * render reading it) keeps the rows it was made with. */
+class Table {
+public:
+    Table();
+
+    /* A column of Value::Bool, Int, Double, String or UnsafeString cells,
+     * a column of any other type keeps Values. Columns are added before the
+     * rows, the index of the new column is returned. */
+    size_t addColumn(const std::string &name, Value::Type type);
+    // the index of the column, -1 if there is none
+    int column(const std::string &name) const;
+    const std::string &columnName(size_t column) const;
+    Value::Type columnType(size_t column) const;
+    size_t columnCount() const;
+    size_t rowCount() const;
+    void reserve(size_t rows);
+
+    // a row of empty cells, set() fills it
+    void appendRow();
+    // a row from an object by the column names or an array in the column order
+    void appendRow(const Value &row);
+    // a cell of the last row, converted to the type of the column
+    void set(size_t column, const Value &value);
+
+    Value cell(size_t row, size_t column) const;
+
+private:
+    friend struct ValueTypeInfo<Table>;
+
+    // the data to change, not shared with anyone
+    TableData &writable();
+
+    boost::shared_ptr<TableData> data;
+};
+
+// A row of a table, the item of its array, see Table
+struct TableRow {
+    TableRow() : row(0) {}
+    TableRow(const boost::shared_ptr<const TableData> &table, size_t row)
+        : table(table), row(row) {}
+
+    boost::shared_ptr<const TableData> table;
+    size_t row;
+};
+
+template<>
+struct ValueTypeInfo<Table> : public ValueTypeInfoBase<Table> {
+    static size_t size(const Table &table);
+    static Value at(const Table &table, size_t index);
+};
+
+template<>
+struct ValueTypeInfo<TableRow> : public ValueTypeInfoBase<TableRow> {
+    static bool member(const TableRow &row, const std::string &name, Value *result);
+    static size_t size(const TableRow &row);
+    static Value at(const TableRow &row, size_t index);
+    static bool writeJson(const TableRow &row, std::string &out);
+    static bool seek(TableRow &row, size_t index);
+    static bool writeMember(const TableRow &row, const std::string &name, std::string &out,
+                            Value::StringWriter write);
+};
+
+} // namespace cpptl
+
+#endif // CPPTL_TABLE_H
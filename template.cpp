@@ -4,9 +4,14 @@
  */
 
 #include <list>
+#include <set>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "template.h"
 #include "templateengine.h"
+#include "templateengineimpl.h"
 #include "templateasttree.h"
 #include "templatecontext.h"
 
@@ -16,15 +21,48 @@ extern "C" {
 
 namespace cpptl {
 
+// A compiled template, never changed: a render keeps the tree it started
+// with while a changed global makes the next renders compile a new one
+struct CompiledTree {
+    CompiledTree() : node(NULL), frameSize(0), cacheBlocks(0), id(0) {}
+    ~CompiledTree() {
+        if( node )
+            freeNodes(node);
+    }
+
+    // true if the output depends on the context only
+    bool isPure() const;
+
+    Node *node;
+    size_t frameSize;
+    std::set<std::string> names;    // root names the tree depends on
+    std::set<const HelperEntry *> helpers;
+    size_t cacheBlocks;             // @cache blocks expire on their own
+    size_t id;                      // of the compiled tree in the render cache
+
+private:
+    CompiledTree(const CompiledTree &);
+    CompiledTree &operator = (const CompiledTree &);
+};
+
+typedef boost::shared_ptr<const CompiledTree> CompiledTreePtr;
+
 class TemplateImpl {
 public:
     TemplateImpl(TemplateEngine &engine, const std::string &templ);
-    ~TemplateImpl();
 
-    std::string render(const TemplateContext &context) const;
+    CompiledTreePtr compile() const;
+    std::string render(const Value &context, const Template &caller) const;
+    std::string renderTree(const CompiledTree &tree, const Value &context,
+                           const Template &caller) const;
     TemplateEngine &engine;
     const std::string templ;
-    mutable Node *node;
+
+    // renders of the template run at the same time, the tree is swapped
+    // under the lock
+    mutable boost::mutex mutex;
+    mutable CompiledTreePtr tree;
+    mutable unsigned int revision;  // globals revision the tree is up to date with
 };
 
 Template::Template(TemplateEngine &engine, const std::string &templ)
@@ -38,8 +76,7 @@ Template::~Template()
 
 std::string Template::render(const Value &context) const
 {
-    TemplateContext ctx = {pimpl->templ, context, *this};
-    return pimpl->render(ctx);
+    return pimpl->render(context, *this);
 }
 
 std::string Template::render(const std::map<std::string, Value> &context) const
@@ -51,8 +88,17 @@ std::string Template::render(const std::map<std::string, Value> &context) const
     for(; it != end; ++it)
         values[it->first] = it->second;
 
-    TemplateContext ctx = {pimpl->templ, values, *this};
-    return pimpl->render(ctx);
+    return pimpl->render(values, *this);
+}
+
+std::string Template::dump() const
+{
+    CompiledTreePtr tree = pimpl->compile();
+
+    if( tree->node )
+        return dumpTreeNodes(tree->node);
+    else
+        return std::string("template syntax error");
 }
 
 const TemplateEngine &Template::engine() const
@@ -61,25 +107,145 @@ const TemplateEngine &Template::engine() const
 }
 
 TemplateImpl::TemplateImpl(TemplateEngine &engine, const std::string &templ)
-    : engine(engine), templ(templ), node(NULL)
+    : engine(engine), templ(templ), revision(0)
+{
+}
+
+CompiledTreePtr TemplateImpl::compile() const
+{
+    TemplateEngineImpl &engineImpl = *engine.pimpl;
+    boost::mutex::scoped_lock lock(mutex);
+    // the globals are read by the compilation
+    boost::mutex::scoped_lock globalsLock(engineImpl.globalsMutex);
+
+    if( tree && revision != engineImpl.globalsRevision )
+    {
+        // renders still going keep the old tree
+        if( engineImpl.globalsChanged(tree->names, revision) )
+            tree.reset();
+        else
+            revision = engineImpl.globalsRevision;
+    }
+
+    if( !tree )
+    {
+        boost::shared_ptr<CompiledTree> compiled = boost::make_shared<CompiledTree>();
+
+        compiled->node = getAstTree(templ.c_str());
+        compiled->id = ++engineImpl.templateIds;
+        revision = engineImpl.globalsRevision;
+
+        if( compiled->node )
+        {
+            compiled->frameSize = compileTreeNodes(compiled->node, templ, engineImpl,
+                                                   compiled->names, compiled->helpers,
+                                                   compiled->cacheBlocks);
+            compiled->node = optimizeTreeNodes(compiled->node);
+        }
+
+        tree = compiled;
+    }
+
+    return tree;
+}
+
+bool CompiledTree::isPure() const
 {
+    std::set<const HelperEntry *>::const_iterator it = helpers.begin();
+    std::set<const HelperEntry *>::const_iterator end = helpers.end();
+
+    // helpers can be registered again after the compilation
+    for(; it != end; ++it)
+    {
+        if( (*it)->pure == false )
+            return false;
+    }
+
+    return true;
 }
 
-TemplateImpl::~TemplateImpl()
+/* Lazy values, generators and user types are compared by identity and may
+ * give other items the next time (a referenced struct changed in place, new
+ * rows of a generator), contexts holding them are not cached. */
+static bool isCacheable(const Value &value)
 {
-    if( node )
-        freeNodes(node);
+    switch(value.type())
+    {
+    case Value::Lazy:
+    case Value::Generator:
+    case Value::UserType:
+        return false;
+    case Value::Array:
+        if( value.packedIntegers() || value.packedDoubles() )
+            return true;
+        // fall through
+    case Value::Object: {
+        Value::ValueIterator it(value);
+
+        while( it.hasNext() )
+        {
+            if( isCacheable(it.next()) == false )
+                return false;
+        }
+
+        return true;
+    }
+    default:
+        return true;
+    }
 }
 
-std::string TemplateImpl::render(const TemplateContext &context) const
+std::string TemplateImpl::render(const Value &context, const Template &caller) const
 {
-    if( !node )
-        node = getAstTree(templ.c_str());
+    const CompiledTreePtr compiled = compile();
+    const CompiledTree &tree = *compiled;
+    RenderCache &renders = engine.pimpl->renders;
+
+    // @cache blocks expire and are invalidated apart from the whole render
+    if( tree.node && renders.isEnabled() && tree.cacheBlocks == 0 && tree.isPure()
+            && isCacheable(context) )
+    {
+        const size_t hash = context.hash();
+        std::string result;
+
+        if( renders.find(tree.id, context, hash, result) == false )
+        {
+            result = renderTree(tree, context, caller);
+            renders.insert(tree.id, context, hash, result);
+        }
+
+        return result;
+    }
+
+    return renderTree(tree, context, caller);
+}
 
-    if( node )
-        return traverserTreeNodes(node, context);
-     else
+std::string TemplateImpl::renderTree(const CompiledTree &tree, const Value &context,
+                                     const Template &caller) const
+{
+    if( tree.node )
+    {
+        // loop frames are small, keep them on the stack in the common case
+        LoopSlot stackFrame[16];
+        std::vector<LoopSlot> heapFrame;
+        LoopSlot *frame = stackFrame;
+
+        if( tree.frameSize > sizeof(stackFrame) / sizeof(stackFrame[0]) )
+        {
+            heapFrame.resize(tree.frameSize);
+            frame = &heapFrame[0];
+        }
+
+        HelperCache helperCache;
+        std::vector<PendingOutput> pending;
+        TemplateContext ctx = {templ, context, caller, frame, 0, *engine.pimpl, helperCache,
+                               NULL, pending};
+        return traverserTreeNodes(tree.node, ctx);
+    }
+    else
+    {
         return std::string("template syntax error");
+    }
 }
 
 } // namespace cpptl
@@ -25,6 +25,9 @@ public:
     std::string render(const std::map<std::string, Value> &context) const;
     const TemplateEngine &engine() const;
 
+    /* for debug: the compiled and optimized tree */
+    std::string dump() const;
+
 private:
     boost::shared_ptr<TemplateImpl> pimpl;
 };
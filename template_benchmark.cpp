@@ -0,0 +1,1255 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#include <stdio.h>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "value.h"
+#include "template.h"
+#include "templateengine.h"
+#include "jsonparser.h"
+#include "msgpackcodec.h"
+#include "snapshot.h"
+#include "table.h"
+
+using namespace cpptl;
+
+struct BenchOrder {
+    int64_t id;
+    std::string customer;
+    double total;
+};
+
+VALUE_DECLARE_STRUCT(BenchOrder)
+    VALUE_STRUCT_FIELD(id)
+    VALUE_STRUCT_FIELD(customer)
+    VALUE_STRUCT_FIELD(total)
+VALUE_DECLARE_STRUCT_END()
+
+template<typename Func>
+static void benchmark(const char *name, int iterations, Func func)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+
+    for(int i = 0; i < iterations; ++i)
+        bytes += func();
+
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+    printf("%-40s %10.3f ms/iter %12zu bytes\n", name, ms / iterations, bytes / iterations);
+}
+
+static void benchmarkNestedLoops()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value rows{ Value::ArrayTag() };
+    Value cols{ Value::ArrayTag() };
+    Value cells{ Value::ArrayTag() };
+
+    for(int i = 0; i < 100; ++i)
+    {
+        Value row{ Value::ObjectTag() };
+        row["name"] = "row" + std::to_string(i);
+        rows.append(row);
+    }
+
+    for(int i = 0; i < 20; ++i)
+        cols.append(i);
+
+    for(int i = 0; i < 5; ++i)
+        cells.append(i);
+
+    values["rows"] = rows;
+    values["cols"] = cols;
+    values["cells"] = cells;
+    values["title"] = "title";
+
+    Template templ = engine.templ(R"(
+        @for(row in rows) {
+            <tr>
+            @for(col in cols) {
+                @for(cell in cells) {
+                    <td>@{title} @{row.name} @col @cell</td>
+                }
+            }
+            </tr>
+        }
+    )");
+
+    benchmark("nested loops 100x20x5", 20, [&]() {
+        return templ.render(values).size();
+    });
+}
+
+static void benchmarkTableRows()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value rows{ Value::ArrayTag() };
+
+    for(int i = 0; i < 50000; ++i)
+    {
+        Value row{ Value::ObjectTag() };
+        row["id"] = i;
+        row["name"] = "item" + std::to_string(i);
+        rows.append(row);
+    }
+
+    values["rows"] = rows;
+
+    Template templ = engine.templ(R"(
+        <table>
+        @for(row in rows) {
+            <tr class="@{loop.first ? "first" : "row"}"><td>@{loop.index}</td><td>@{row.id}</td><td>@{row.name}</td></tr>
+        }
+        </table>
+    )");
+
+    benchmark("table 50k rows", 10, [&]() {
+        return templ.render(values).size();
+    });
+}
+
+static void benchmarkExpressions()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value items{ Value::ArrayTag() };
+
+    for(int i = 0; i < 50000; ++i)
+    {
+        Value item{ Value::ObjectTag() };
+        item["qty"] = i % 7;
+        item["price"] = 0.25 * (i % 100);
+        items.append(item);
+    }
+
+    values["items"] = items;
+    values["discount"] = 3;
+
+    Template arithmetic = engine.templ(R"(
+        @for(item in items) {
+            <td>@{item.price * item.qty}</td><td>@{item.qty - discount}</td><td>@{loop.index + 1}</td>
+        }
+    )");
+
+    benchmark("arithmetic 50k rows", 10, [&]() {
+        return arithmetic.render(values).size();
+    });
+
+    Template comparisons = engine.templ(R"(
+        @for(item in items) {
+            @{item.qty > 0} @{item.qty == discount} @{loop.size != loop.index} @{loop.first ? "first" : "row"}
+        }
+    )");
+
+    benchmark("comparisons 50k rows", 10, [&]() {
+        return comparisons.render(values).size();
+    });
+}
+
+static void benchmarkHelpers()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value items{ Value::ArrayTag() };
+
+    for(int i = 0; i < 50000; ++i)
+        items.append(i);
+
+    values["items"] = items;
+
+    engine.registerHelper("first", [](const Value &, const Value &args) {
+        return args[0];
+    });
+    engine.registerArgsHelper("firstArg", [](const Value &, const HelperArgs &args) {
+        return args[0];
+    });
+
+    Template arrayHelper = engine.templ(R"(
+        @for(item in items) {@first(item, 2, "x") }
+    )");
+
+    benchmark("helper calls 50k rows", 10, [&]() {
+        return arrayHelper.render(values).size();
+    });
+
+    Template argsHelper = engine.templ(R"(
+        @for(item in items) {@firstArg(item, 2, "x") }
+    )");
+
+    benchmark("args helper calls 50k rows", 10, [&]() {
+        return argsHelper.render(values).size();
+    });
+}
+
+static Value formatPrice(const Value &, const HelperArgs &args)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.2f EUR", args[0].toDouble() / 100);
+    return std::string(buf);
+}
+
+static void benchmarkPureHelpers()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value items{ Value::ArrayTag() };
+
+    for(int i = 0; i < 50000; ++i)
+        items.append(i % 100 * 25);
+
+    values["items"] = items;
+
+    engine.registerArgsHelper("formatPrice", formatPrice);
+    engine.registerArgsHelper("pureFormatPrice", formatPrice, true);
+
+    Template impure = engine.templ(R"(
+        @for(item in items) {<td>@formatPrice(item)</td>}
+    )");
+
+    benchmark("formatPrice 50k rows", 10, [&]() {
+        return impure.render(values).size();
+    });
+
+    Template pure = engine.templ(R"(
+        @for(item in items) {<td>@pureFormatPrice(item)</td>}
+    )");
+
+    benchmark("pure formatPrice 50k rows", 10, [&]() {
+        return pure.render(values).size();
+    });
+
+    engine.setHelperCacheSize(1000);
+
+    benchmark("pure formatPrice 50k rows, engine cache", 10, [&]() {
+        return pure.render(values).size();
+    });
+}
+
+// in-process store, every access takes the lock
+struct PriceStore {
+    std::mutex mutex;
+    std::map<int64_t, Value> prices;
+
+    Value price(int64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<int64_t, Value>::const_iterator it = prices.find(id);
+        return it != prices.end() ? it->second : Value();
+    }
+
+    void batchPrice(const std::vector<HelperArgs> &ids, std::vector<Value> &result) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result.reserve(ids.size());
+
+        for(size_t i = 0; i < ids.size(); ++i) {
+            std::map<int64_t, Value>::const_iterator it = prices.find(ids[i][0].toInt64());
+            result.push_back(it != prices.end() ? it->second : Value());
+        }
+    }
+};
+
+static void benchmarkBatchHelpers()
+{
+    TemplateEngine engine;
+    PriceStore store;
+
+    Value values{ Value::ObjectTag() };
+    Value items{ Value::ArrayTag() };
+
+    for(int i = 0; i < 50000; ++i)
+    {
+        items.append(i);
+        store.prices[i] = i * 3;
+    }
+
+    values["items"] = items;
+
+    engine.registerArgsHelper("price", [&store](const Value &, const HelperArgs &args) {
+        return store.price(args[0].toInt64());
+    });
+    engine.registerBatchHelper("batchPrice", [&store](const Value &, const std::vector<HelperArgs> &calls,
+                                                      std::vector<Value> &results) {
+        store.batchPrice(calls, results);
+    });
+
+    Template single = engine.templ(R"(
+        @for(item in items) {<td>@price(item)</td>}
+    )");
+
+    benchmark("store lookup 50k rows", 10, [&]() {
+        return single.render(values).size();
+    });
+
+    Template batch = engine.templ(R"(
+        @for(item in items) {<td>@batchPrice(item)</td>}
+    )");
+
+    benchmark("batch store lookup 50k rows", 10, [&]() {
+        return batch.render(values).size();
+    });
+}
+
+// a lookup in a local service taking 2 ms
+static Value slowLookup(const HelperArgs &args)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    return "value of " + args[0].toString();
+}
+
+static void benchmarkAsyncHelpers()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value keys{ Value::ArrayTag() };
+
+    for(int i = 0; i < 20; ++i)
+        keys.append("key" + std::to_string(i));
+
+    values["keys"] = keys;
+
+    engine.registerArgsHelper("lookup", [](const Value &, const HelperArgs &args) {
+        return slowLookup(args);
+    });
+    engine.registerAsyncHelper("asyncLookup", [](const Value &, const HelperArgs &args) {
+        boost::shared_ptr< boost::promise<Value> > promise(new boost::promise<Value>);
+        boost::shared_future<Value> result(promise->get_future());
+        Value key = args[0];
+
+        std::thread([promise, key]() {
+            promise->set_value(slowLookup(HelperArgs(&key, 1)));
+        }).detach();
+
+        return result;
+    });
+
+    Template sync = engine.templ(R"(
+        @for(key in keys) {<li>@lookup(key)</li>}
+    )");
+
+    benchmark("20 slow lookups", 5, [&]() {
+        return sync.render(values).size();
+    });
+
+    Template async = engine.templ(R"(
+        @for(key in keys) {<li>@asyncLookup(key)</li>}
+    )");
+
+    benchmark("20 slow async lookups", 5, [&]() {
+        return async.render(values).size();
+    });
+}
+
+static void benchmarkFragmentCache()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value categories{ Value::ArrayTag() };
+
+    for(int i = 0; i < 5000; ++i)
+    {
+        Value category{ Value::ObjectTag() };
+        category["id"] = i;
+        category["name"] = "category" + std::to_string(i);
+        categories.append(category);
+    }
+
+    values["categories"] = categories;
+    values["user"] = "bob";
+
+    Template sidebar = engine.templ(R"(
+        <ul>@for(category in categories) {<li><a href="/c/@{category.id}">@{category.name}</a></li>}</ul>
+    )");
+
+    benchmark("sidebar 5k links", 20, [&]() {
+        return sidebar.render(values).size();
+    });
+
+    Template cached = engine.templ(R"(
+        @cache(user, 60) {<ul>@for(category in categories) {<li><a href="/c/@{category.id}">@{category.name}</a></li>}</ul>}
+    )");
+
+    benchmark("cached sidebar 5k links", 20, [&]() {
+        return cached.render(values).size();
+    });
+}
+
+static void benchmarkRenderCache()
+{
+    TemplateEngine engine;
+
+    Value values{ Value::ObjectTag() };
+    Value products{ Value::ArrayTag() };
+
+    for(int i = 0; i < 2000; ++i)
+    {
+        Value product{ Value::ObjectTag() };
+        product["id"] = i;
+        product["name"] = "product" + std::to_string(i);
+        product["price"] = i * 1.5;
+        products.append(product);
+    }
+
+    values["products"] = products;
+
+    Template templ = engine.templ(R"(
+        @for(product in products) {<tr><td>@{product.id}</td><td>@{product.name}</td><td>@{product.price * 2}</td></tr>}
+    )");
+
+    benchmark("page 2k products", 20, [&]() {
+        return templ.render(values).size();
+    });
+
+    engine.setRenderCacheSize(100);
+
+    benchmark("page 2k products, render cache", 20, [&]() {
+        return templ.render(values).size();
+    });
+
+    values.freeze();
+
+    benchmark("page 2k products, frozen context", 20, [&]() {
+        return templ.render(values).size();
+    });
+}
+
+static Value makeIds(int count, int step)
+{
+    Value ids{ Value::ArrayTag() };
+
+    for(int i = 0; i < count; ++i)
+        ids.append(i * step);
+
+    return ids;
+}
+
+static void benchmarkArraySets()
+{
+    const int sizes[] = { 1000, 100000, 1000000 };
+
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        const int size = sizes[i];
+        const int iterations = size < 1000000 ? 10 : 2;
+        // every second id of lhs is in rhs
+        Value lhs = makeIds(size, 1);
+        Value rhs = makeIds(size / 2, 2);
+        char name[64];
+
+        snprintf(name, sizeof(name), "array difference %d", size);
+        benchmark(name, iterations, [&]() {
+            return (lhs - rhs).size();
+        });
+
+        snprintf(name, sizeof(name), "array union %d", size);
+        benchmark(name, iterations, [&]() {
+            return lhs.unite(rhs).size();
+        });
+
+        snprintf(name, sizeof(name), "array intersection %d", size);
+        benchmark(name, iterations, [&]() {
+            return lhs.intersection(rhs).size();
+        });
+
+        snprintf(name, sizeof(name), "array unique %d", size);
+        benchmark(name, iterations, [&]() {
+            return (lhs + rhs).unique().size();
+        });
+    }
+}
+
+// bytes in use on the heap, 0 if it is not known
+static size_t heapBytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static void benchmarkNumericArrays()
+{
+    const int count = 100000;
+
+    // built from items of different types, so the array is not packed
+    size_t before = heapBytes();
+    Value mixed{ Value::ArrayTag() };
+
+    mixed.append("");
+    for(int i = 0; i < count; ++i)
+        mixed.append(i);
+
+    size_t mixedBytes = heapBytes() - before;
+
+    before = heapBytes();
+    Value packed{ Value::ArrayTag() };
+
+    for(int i = 0; i < count; ++i)
+        packed.append(i);
+
+    size_t packedBytes = heapBytes() - before;
+
+    printf("%-40s %10zu bytes %12zu bytes packed\n", "100k integers", mixedBytes, packedBytes);
+
+    auto sum = [](const Value &array) {
+        int64_t result = 0;
+        Value::ValueIterator it(array);
+
+        while( it.hasNext() )
+            result += it.next().toInt64();
+
+        return static_cast<size_t>(result & 0xFF);
+    };
+
+    benchmark("iterate 100k integers", 20, [&]() {
+        return sum(mixed);
+    });
+
+    benchmark("iterate 100k packed integers", 20, [&]() {
+        return sum(packed);
+    });
+
+    TemplateEngine engine;
+    Value values{ Value::ObjectTag() };
+    Template templ = engine.templ("@for(n in numbers) {@{n * 2},}");
+
+    values["numbers"] = mixed;
+    benchmark("render 100k integers", 10, [&]() {
+        return templ.render(values).size();
+    });
+
+    values["numbers"] = packed;
+    benchmark("render 100k packed integers", 10, [&]() {
+        return templ.render(values).size();
+    });
+}
+
+static void benchmarkAggregates()
+{
+    const int sizes[] = { 1000, 100000, 10000000 };
+    TemplateEngine engine;
+
+    // what a user had to write before the built-in helpers
+    engine.registerArgsHelper("userSum", [](const Value &, const HelperArgs &args) {
+        double result = 0;
+        Value::ValueIterator it(args[0]);
+
+        while( it.hasNext() )
+            result += it.next().toDouble();
+
+        return Value(result);
+    });
+
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        const int size = sizes[i];
+        const int iterations = size < 10000000 ? 20 : 2;
+        Value values{ Value::ObjectTag() };
+        Value integers{ Value::ArrayTag() };
+        Value doubles{ Value::ArrayTag() };
+        char name[64];
+
+        for(int n = 0; n < size; ++n)
+        {
+            integers.append(n % 1000);
+            doubles.append(n * 0.5);
+        }
+
+        values["integers"] = integers;
+        values["doubles"] = doubles;
+
+        struct {
+            const char *name;
+            Template templ;
+        } cases[] = {
+            { "userSum(integers)", engine.templ("@userSum(integers)") },
+            { "sum(integers)", engine.templ("@sum(integers)") },
+            { "max(integers)", engine.templ("@max(integers)") },
+            { "userSum(doubles)", engine.templ("@userSum(doubles)") },
+            { "sum(doubles)", engine.templ("@sum(doubles)") },
+            { "avg(doubles)", engine.templ("@avg(doubles)") },
+            { "min(doubles)", engine.templ("@min(doubles)") },
+        };
+
+        for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+        {
+            Template &templ = cases[c].templ;
+
+            snprintf(name, sizeof(name), "%s %d", cases[c].name, size);
+            benchmark(name, iterations, [&]() {
+                return templ.render(values).size();
+            });
+        }
+    }
+}
+
+// a page showing one of many sections, the context offers all of them
+static Value makeSection(int section)
+{
+    Value rows{ Value::ArrayTag() };
+
+    for(int i = 0; i < 500; ++i)
+    {
+        Value row{ Value::ObjectTag() };
+
+        row["id"] = section * 1000 + i;
+        row["title"] = "Row title";
+        rows.append(row);
+    }
+
+    return rows;
+}
+
+static void benchmarkLazyContext()
+{
+    const int sections = 20;
+    TemplateEngine engine;
+    Template templ = engine.templ("@for(row in section3) {@{row.id}:@{row.title};}");
+
+    benchmark("eager context, 1 of 20 sections", 20, [&]() {
+        Value values{ Value::ObjectTag() };
+        char name[32];
+
+        for(int i = 0; i < sections; ++i)
+        {
+            snprintf(name, sizeof(name), "section%d", i);
+            values[name] = makeSection(i);
+        }
+
+        return templ.render(values).size();
+    });
+
+    benchmark("lazy context, 1 of 20 sections", 20, [&]() {
+        Value values{ Value::ObjectTag() };
+        char name[32];
+
+        for(int i = 0; i < sections; ++i)
+        {
+            snprintf(name, sizeof(name), "section%d", i);
+            values[name] = Value::lazy(std::bind(makeSection, i));
+        }
+
+        return templ.render(values).size();
+    });
+}
+
+static void benchmarkStructContext()
+{
+    const int count = 50000;
+    TemplateEngine engine;
+    Template templ = engine.templ("@for(order in orders) {@{order.id} @{order.customer} @{order.total};}");
+    std::vector<BenchOrder> orders(count);
+
+    for(int i = 0; i < count; ++i)
+    {
+        orders[i].id = i;
+        orders[i].customer = "Customer name";
+        orders[i].total = i * 0.25;
+    }
+
+    benchmark("50k orders copied to objects", 10, [&]() {
+        Value values{ Value::ObjectTag() };
+        Value list{ Value::ArrayTag() };
+
+        for(size_t i = 0; i < orders.size(); ++i)
+        {
+            Value order{ Value::ObjectTag() };
+
+            order["id"] = orders[i].id;
+            order["customer"] = orders[i].customer;
+            order["total"] = orders[i].total;
+            list.append(order);
+        }
+
+        values["orders"] = list;
+        return templ.render(values).size();
+    });
+
+    benchmark("50k orders by reference", 10, [&]() {
+        Value values{ Value::ObjectTag() };
+
+        values["orders"] = Value::reference(orders);
+        return templ.render(values).size();
+    });
+}
+
+static void benchmarkStringViews()
+{
+    // a storage buffer with a 1 MB article in it
+    boost::shared_ptr<std::string> buffer(new std::string(1024 * 1024, 'a'));
+    TemplateEngine engine;
+    Template templ = engine.templ("<article>@body</article>");
+
+    for(size_t i = 0; i < buffer->size(); i += 100)
+        (*buffer)[i] = '<';
+
+    benchmark("1 MB string copied", 50, [&]() {
+        Value values{ Value::ObjectTag() };
+
+        values["body"] = *buffer;
+        return templ.render(values).size();
+    });
+
+    benchmark("1 MB string view", 50, [&]() {
+        Value values{ Value::ObjectTag() };
+
+        values["body"] = Value(buffer->data(), buffer->size(), buffer);
+        return templ.render(values).size();
+    });
+
+    // already safe html, written as is
+    benchmark("1 MB unsafe string copied", 50, [&]() {
+        Value values{ Value::ObjectTag() };
+
+        values["body"] = Value(*buffer, Value::UnsafeStringTag());
+        return templ.render(values).size();
+    });
+
+    benchmark("1 MB unsafe string view", 50, [&]() {
+        Value values{ Value::ObjectTag() };
+
+        values["body"] = Value(buffer->data(), buffer->size(), buffer, Value::UnsafeStringTag());
+        return templ.render(values).size();
+    });
+
+    Value copy(*buffer);
+    Value view(buffer->data(), buffer->size(), buffer);
+
+    benchmark("compare 1 MB strings", 50, [&]() {
+        return static_cast<size_t>(copy == view);
+    });
+}
+
+static void benchmarkStringConcatenation()
+{
+    TemplateEngine engine;
+    Value values{ Value::ObjectTag() };
+
+    values["piece"] = std::string(100, 'x');
+
+    // a helper building its output from many strings
+    engine.registerArgsHelper("repeat", [](const Value &, const HelperArgs &args) {
+        Value result("");
+
+        for(int i = 0; i < args[1].toInt(); ++i)
+            result = result + args[0];
+
+        return result;
+    });
+
+    Template small = engine.templ("@repeat(piece, 100)");
+    Template large = engine.templ("@repeat(piece, 10000)");
+
+    benchmark("concatenate 100 strings", 100, [&]() {
+        return small.render(values).size();
+    });
+
+    benchmark("concatenate 10k strings", 10, [&]() {
+        return large.render(values).size();
+    });
+}
+
+// a product listing as upstream services send it, about size bytes
+static std::string makeJson(size_t size)
+{
+    std::string json = "{\"total\": 0, \"products\": [";
+    char item[512];
+
+    for(int i = 0; json.size() < size; ++i)
+    {
+        snprintf(item, sizeof(item),
+                 "%s{\"id\": %d, \"name\": \"Product %d\", \"price\": %d.%02d, \"available\": %s,"
+                 " \"tags\": [\"new\", \"sale\"], \"description\": \"A \\\"quoted\\\" text,"
+                 " long enough to be a real description of the product\"}",
+                 i ? ", " : "", i, i, i % 1000, i % 100, i % 3 ? "true" : "false");
+        json += item;
+    }
+
+    json += "]}";
+    return json;
+}
+
+// the parser alone, the events are only counted
+struct JsonCounter : public JsonHandler {
+    JsonCounter() : events(0) {}
+
+    virtual void null() { ++events; }
+    virtual void boolean(bool) { ++events; }
+    virtual void integer(int64_t) { ++events; }
+    virtual void number(double) { ++events; }
+    virtual void string(const char *, size_t) { ++events; }
+    virtual void startObject() { ++events; }
+    virtual void key(const char *, size_t) { ++events; }
+    virtual void endObject() { ++events; }
+    virtual void startArray() { ++events; }
+    virtual void endArray() { ++events; }
+
+    size_t events;
+};
+
+static void benchmarkJsonParser()
+{
+    const size_t sizes[] = { 1024, 64 * 1024, 1024 * 1024, 50 * 1024 * 1024 };
+
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        boost::shared_ptr<const std::string> json(new std::string(makeJson(sizes[i])));
+        const int iterations = std::max<int>(1, 200 * 1024 * 1024 / (json->size() * 4));
+        char name[64];
+
+        {
+            auto start = std::chrono::steady_clock::now();
+            size_t events = 0;
+
+            for(int n = 0; n < iterations; ++n)
+            {
+                JsonCounter counter;
+                JsonParser parser(counter);
+
+                parser.feed(json->data(), json->size());
+                parser.finish();
+                events += counter.events;
+            }
+
+            auto end = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(end - start).count();
+
+            snprintf(name, sizeof(name), "json events %zu KB", json->size() / 1024);
+            printf("%-40s %10.1f MB/s %12zu events\n", name,
+                   json->size() * iterations / seconds / (1024 * 1024), events / iterations);
+        }
+
+        struct {
+            const char *name;
+            std::function<Value ()> parse;
+        } cases[] = {
+            { "parse json", [&]() { return parseJson(*json); } },
+            { "parse json, string views", [&]() { return parseJson(json); } },
+            { "parse json in 4 KB parts", [&]() {
+                JsonValueBuilder builder;
+                JsonParser parser(builder);
+
+                for(size_t offset = 0; offset < json->size(); offset += 4096)
+                    parser.feed(json->data() + offset, std::min<size_t>(4096, json->size() - offset));
+
+                parser.finish();
+                return builder.result();
+            } },
+        };
+
+        for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+        {
+            auto start = std::chrono::steady_clock::now();
+            size_t items = 0;
+
+            for(int n = 0; n < iterations; ++n)
+                items += cases[c].parse()["products"].size();
+
+            auto end = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(end - start).count();
+
+            snprintf(name, sizeof(name), "%s %zu KB", cases[c].name, json->size() / 1024);
+            printf("%-40s %10.1f MB/s %12zu items\n", name,
+                   json->size() * iterations / seconds / (1024 * 1024), items / iterations);
+        }
+    }
+}
+
+static void benchmarkLazyJson()
+{
+    // a 2 MB document of which the template uses five fields
+    boost::shared_ptr<const std::string> json(new std::string(
+            "{\"user\": {\"id\": 7, \"name\": \"Alice\", \"email\": \"alice@example.com\"},"
+            " \"catalog\": " + makeJson(2 * 1024 * 1024) + "}"));
+    TemplateEngine engine;
+    Template templ = engine.templ(
+            "<p>@{user.id} @{user.name} &lt;@{user.email}&gt;</p>"
+            "<p>@{catalog.total} of @{catalog.products.length}</p>");
+
+    benchmark("2 MB json parsed, 5 fields", 20, [&]() {
+        return templ.render(parseJson(json)).size();
+    });
+
+    benchmark("2 MB json indexed, 5 fields", 20, [&]() {
+        return templ.render(parseJsonLazy(json)).size();
+    });
+
+    Value parsed = parseJson(json);
+    Value indexed = parseJsonLazy(json);
+
+    benchmark("2 MB json parsed, render only", 1000, [&]() {
+        return templ.render(parsed).size();
+    });
+
+    benchmark("2 MB json indexed, render only", 1000, [&]() {
+        return templ.render(indexed).size();
+    });
+}
+
+// what pages did before writeJson(): strings built by toString() at every level
+static std::string naiveJson(const Value &value)
+{
+    switch(value.type())
+    {
+    case Value::Null:
+        return "null";
+    case Value::String: {
+        std::string result = "\"";
+        const std::string s = value.toString();
+
+        for(size_t i = 0; i < s.size(); ++i)
+        {
+            if( s[i] == '"' || s[i] == '\\' )
+                result += '\\';
+
+            if( s[i] == '<' )
+                result += "\\u003c";
+            else if( s[i] == '>' )
+                result += "\\u003e";
+            else
+                result += s[i];
+        }
+
+        return result + "\"";
+    }
+    case Value::Array: {
+        std::string result = "[";
+        Value::ValueIterator it(value);
+
+        while( it.hasNext() )
+        {
+            result += naiveJson(it.next());
+
+            if( it.hasNext() )
+                result += ",";
+        }
+
+        return result + "]";
+    }
+    case Value::Object: {
+        // the page knows the names of its fields
+        static const char *names[] = { "comment", "id", "name", "orders", "paid", "total" };
+        std::string result = "{";
+
+        for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        {
+            if( value.hasMember(names[i]) == false )
+                continue;
+
+            if( result.size() > 1 )
+                result += ",";
+
+            result += "\"" + std::string(names[i]) + "\":" + naiveJson(value.member(names[i]));
+        }
+
+        return result + "}";
+    }
+    case Value::Bool:
+        return value.toBool() ? "true" : "false";
+    default:
+        return value.toString();
+    }
+}
+
+// users with 10 orders each
+static Value makeUsers(int count)
+{
+    Value users{ Value::ArrayTag() };
+
+    for(int i = 0; i < count; ++i)
+    {
+        Value user{ Value::ObjectTag() };
+        Value orders{ Value::ArrayTag() };
+
+        for(int j = 0; j < 10; ++j)
+        {
+            Value order{ Value::ObjectTag() };
+
+            order["id"] = i * 10 + j;
+            order["total"] = (i + j) * 1.25;
+            order["paid"] = j % 2 == 0;
+            order["comment"] = "Leave at the <door>, please";
+            orders.append(order);
+        }
+
+        user["id"] = i;
+        user["name"] = "User " + std::to_string(i);
+        user["orders"] = orders;
+        users.append(user);
+    }
+
+    return users;
+}
+
+static void benchmarkJsonWriter()
+{
+    TemplateEngine engine;
+    Value values{ Value::ObjectTag() };
+    Value users = makeUsers(2000);
+
+    values["users"] = users;
+    engine.registerArgsHelper("naiveJson", [](const Value &, const HelperArgs &args) {
+        return Value(naiveJson(args[0]), Value::UnsafeStringTag());
+    });
+
+    Template naive = engine.templ("<script>var state = @naiveJson(users);</script>");
+    Template streamed = engine.templ("<script>var state = @json(users);</script>");
+
+    benchmark("json of 2000 users, toString", 20, [&]() {
+        return naiveJson(users).size();
+    });
+
+    benchmark("json of 2000 users, writeJson", 20, [&]() {
+        std::string json;
+
+        users.writeJson(json);
+        return json.size();
+    });
+
+    benchmark("@naiveJson(users)", 20, [&]() {
+        return naive.render(values).size();
+    });
+
+    benchmark("@json(users)", 20, [&]() {
+        return streamed.render(values).size();
+    });
+}
+
+static void benchmarkMsgPack()
+{
+    Value users = makeUsers(2000);
+    std::string json;
+    std::string data;
+
+    users.writeJson(json);
+    encodeMsgPack(users, data);
+
+    boost::shared_ptr<const std::string> buffer(new std::string(data));
+    const int iterations = 50;
+
+    struct {
+        const char *name;
+        size_t size;
+        std::function<size_t ()> run;
+    } cases[] = {
+        { "json encode", json.size(), [&]() {
+            std::string out;
+            users.writeJson(out);
+            return out.size();
+        } },
+        { "json decode", json.size(), [&]() { return parseJson(json).size(); } },
+        { "msgpack encode", data.size(), [&]() {
+            std::string out;
+            encodeMsgPack(users, out);
+            return out.size();
+        } },
+        { "msgpack decode", data.size(), [&]() { return decodeMsgPack(data).size(); } },
+        { "msgpack decode, string views", data.size(), [&]() {
+            return decodeMsgPack(buffer).size();
+        } },
+    };
+
+    for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        for(int n = 0; n < iterations; ++n)
+            cases[c].run();
+
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+
+        printf("%-40s %10.1f MB/s %10.3f ms/iter %10zu bytes\n", cases[c].name,
+               cases[c].size * iterations / seconds / (1024 * 1024),
+               seconds * 1000 / iterations, cases[c].size);
+    }
+}
+
+// a worker starting with a large shared catalog: decoded into its own tree
+// or mapped from a snapshot file
+static void benchmarkSnapshot()
+{
+    Value catalog{ Value::ObjectTag() };
+    const std::string fileName = "/tmp/cpptl-benchmark.snapshot";
+    std::string data;
+
+    catalog["title"] = "Orders";
+    catalog["users"] = makeUsers(20000);
+    encodeMsgPack(catalog, data);
+    writeSnapshot(catalog, fileName);
+
+    TemplateEngine engine;
+    Template templ = engine.templ(
+            "<h1>@{title}</h1><p>@{users.length} users</p>"
+            "@for(user in users){<p>@{user.id} @{user.name}</p>}");
+
+    benchmark("catalog msgpack decode", 10, [&]() {
+        return decodeMsgPack(data).size();
+    });
+
+    benchmark("catalog snapshot open", 10, [&]() {
+        return openSnapshot(fileName).size();
+    });
+
+    Value decoded = decodeMsgPack(data);
+    Value mapped = openSnapshot(fileName);
+
+    benchmark("catalog decoded, render 20000 users", 20, [&]() {
+        return templ.render(decoded).size();
+    });
+
+    benchmark("catalog mapped, render 20000 users", 20, [&]() {
+        return templ.render(mapped).size();
+    });
+
+    remove(fileName.c_str());
+}
+
+// a report of 100k rows and 20 columns: an object per row or a table
+static void benchmarkColumnarTable()
+{
+    const int rows = 100000;
+    const int columns = 20;
+    std::vector<std::string> names;
+    std::string templText = "<table>@for(row in rows){<tr>";
+
+    for(int c = 0; c < columns; ++c)
+    {
+        names.push_back("c" + std::to_string(c));
+        templText += "<td>@{row." + names.back() + "}</td>";
+    }
+
+    templText += "</tr>}</table>";
+
+    // ints, doubles and strings in turn
+    auto cell = [](int r, int c) {
+        switch(c % 3)
+        {
+        case 0:
+            return Value(r * 20 + c);
+        case 1:
+            return Value(r * 0.5 + c);
+        default:
+            return Value("cell " + std::to_string(r));
+        }
+    };
+
+    auto makeObjects = [&]() {
+        Value list{ Value::ArrayTag() };
+
+        for(int r = 0; r < rows; ++r)
+        {
+            Value row{ Value::ObjectTag() };
+
+            for(int c = 0; c < columns; ++c)
+                row[names[c]] = cell(r, c);
+
+            list.append(row);
+        }
+
+        return list;
+    };
+
+    auto makeTable = [&]() {
+        Table table;
+
+        for(int c = 0; c < columns; ++c)
+            table.addColumn(names[c], c % 3 == 0 ? Value::Int : (c % 3 == 1 ? Value::Double : Value::String));
+
+        table.reserve(rows);
+
+        for(int r = 0; r < rows; ++r)
+        {
+            table.appendRow();
+
+            for(int c = 0; c < columns; ++c)
+                table.set(c, cell(r, c));
+        }
+
+        return Value::fromValue(table);
+    };
+
+    size_t before = heapBytes();
+    Value objects{ Value::ObjectTag() };
+
+    objects["rows"] = makeObjects();
+    size_t objectBytes = heapBytes() - before;
+
+    before = heapBytes();
+    Value columnar{ Value::ObjectTag() };
+
+    columnar["rows"] = makeTable();
+    size_t tableBytes = heapBytes() - before;
+
+    printf("%-40s %10zu bytes %12zu bytes table\n", "100k x 20 cells", objectBytes, tableBytes);
+
+    // built and freed for every page
+    benchmark("build 100k x 20, object per row", 5, [&]() {
+        return makeObjects().size();
+    });
+
+    benchmark("build 100k x 20, table", 5, [&]() {
+        return makeTable().size();
+    });
+
+    TemplateEngine engine;
+    Template templ = engine.templ(templText);
+
+    benchmark("render 100k x 20, object per row", 5, [&]() {
+        return templ.render(objects).size();
+    });
+
+    benchmark("render 100k x 20, table", 5, [&]() {
+        return templ.render(columnar).size();
+    });
+}
+
+int main()
+{
+    benchmarkNestedLoops();
+    benchmarkTableRows();
+    benchmarkExpressions();
+    benchmarkHelpers();
+    benchmarkPureHelpers();
+    benchmarkBatchHelpers();
+    benchmarkAsyncHelpers();
+    benchmarkFragmentCache();
+    benchmarkRenderCache();
+    benchmarkArraySets();
+    benchmarkNumericArrays();
+    benchmarkAggregates();
+    benchmarkLazyContext();
+    benchmarkStructContext();
+    benchmarkStringViews();
+    benchmarkStringConcatenation();
+    benchmarkJsonParser();
+    benchmarkLazyJson();
+    benchmarkJsonWriter();
+    benchmarkMsgPack();
+    benchmarkSnapshot();
+    benchmarkColumnarTable();
+
+    return 0;
+}
@@ -10,13 +10,40 @@
 #include <stdio.h>
 #include <string>
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 #include "value.h"
 #include "template.h"
 #include "templateengine.h"
+#include "table.h"
+#include "fragmentcache.h"
 
 using namespace cpptl;
 
+struct OrderLine {
+    std::string product;
+    int quantity;
+};
+
+struct Order {
+    int64_t id;
+    double total;
+    bool paid;
+    std::vector<OrderLine> lines;
+};
+
+VALUE_DECLARE_STRUCT(OrderLine)
+    VALUE_STRUCT_FIELD(product)
+    VALUE_STRUCT_FIELD(quantity)
+VALUE_DECLARE_STRUCT_END()
+
+VALUE_DECLARE_STRUCT(Order)
+    VALUE_STRUCT_FIELD(id)
+    VALUE_STRUCT_FIELD(total)
+    VALUE_STRUCT_FIELD(paid)
+    VALUE_STRUCT_FIELD(lines)
+VALUE_DECLARE_STRUCT_END()
+
 BOOST_AUTO_TEST_SUITE( templater )
 
 BOOST_AUTO_TEST_CASE( templater_only_html )
@@ -54,6 +81,17 @@ BOOST_AUTO_TEST_CASE( templater_variables )
     BOOST_CHECK( engine.templ(templ3).render(
         {{"name", "Alex"}, {"email", "alex@nekipelov.net"}}) ==
         "<p>Alex - alex@nekipelov.net</p>");
+
+    // numbers are formatted as the streams do, containers have no text
+    context["count"] = -42;
+    context["price"] = 0.1;
+    context["large"] = 1e21;
+    context["paid"] = true;
+    context["list"] = Value(Value::ArrayTag());
+    context["nothing"] = Value();
+
+    BOOST_CHECK( engine.templ("@count @price @large @paid [@list][@nothing]").render(context) ==
+                 "-42 0.1 1e+21 true [][]" );
 }
 
 BOOST_AUTO_TEST_CASE( templater_sub_variables )
@@ -129,6 +167,99 @@ BOOST_AUTO_TEST_CASE( templater_for_list )
     }
 }
 
+BOOST_AUTO_TEST_CASE( templater_for_nested )
+{
+    TemplateEngine engine;
+
+    const std::string templ = R"(
+            @for(row in rows) {
+                @for(col in cols) {
+                    <td>@{title}: @{row.name}/@col @{label(col)}</td>
+                }
+            }
+            @{row})";
+    const std::string expected = R"(
+                    <td>T: a/1 [1 a]</td>
+                    <td>T: a/2 [2 a]</td>
+                    <td>T: b/1 [1 b]</td>
+                    <td>T: b/2 [2 b]</td>
+            )";
+
+    auto label = [](const Value &context, const Value &args) {
+        BOOST_CHECK( args.size() == 1 );
+        return "[" + args[0].toString() + " "
+                + context["parentContext"]["row"]["name"].toString() + "]";
+    };
+    engine.registerHelper("label", label);
+
+    Value values{ Value::ObjectTag() };
+    Value rows{ Value::ArrayTag() };
+    Value cols{ Value::ArrayTag() };
+    Value row1{ Value::ObjectTag() };
+    Value row2{ Value::ObjectTag() };
+
+    row1["name"] = "a";
+    row2["name"] = "b";
+
+    rows.append(row1);
+    rows.append(row2);
+    cols.append(1);
+    cols.append(2);
+
+    values["rows"] = rows;
+    values["cols"] = cols;
+    values["title"] = "T";
+
+    BOOST_CHECK( engine.templ(templ).render(values) == expected );
+}
+
+BOOST_AUTO_TEST_CASE( templater_for_loop_meta )
+{
+    TemplateEngine engine;
+
+    const std::string templ = R"(
+            @for(item in list) {
+                @if( loop.first ) {
+                    <ul data-size="@{loop.size}">
+                }
+                    <li>@{loop.index}: @item</li>
+                @if( loop.last ) {
+                    </ul>
+                }
+            })";
+    const std::string expected = R"(
+                    <ul data-size="3">
+                    <li>0: Adam</li>
+                    <li>1: Bert</li>
+                    <li>2: John</li>
+                    </ul>
+)";
+
+    Value values{ Value::ObjectTag() };
+    Value items{ Value::ArrayTag() };
+
+    items.append( "Adam" );
+    items.append( "Bert" );
+    items.append( "John" );
+
+    values["list"] = items;
+
+    BOOST_CHECK( engine.templ(templ).render(values) == expected );
+
+    // other members of loop come from the context
+    Value loop{ Value::ObjectTag() };
+
+    loop["name"] = "L";
+    loop["index"] = 9;
+    loop["length"] = 5;
+    values["loop"] = loop;
+
+    BOOST_CHECK_EQUAL( engine.templ("@for(item in list) {@{loop.name}@{loop.index}@{loop.length}@if(loop.name) {!}}").render(values),
+                       "L05!L15!L25!" );
+    BOOST_CHECK_EQUAL( engine.templ("@{loop.name}@{loop.index}").render(values), "L9" );
+    BOOST_CHECK_EQUAL( engine.templ("@for(loop in list) {@loop}").render(values), "AdamBertJohn" );
+}
+
 BOOST_AUTO_TEST_CASE( templater_helpers )
 {
     TemplateEngine engine;
@@ -229,6 +360,704 @@ BOOST_AUTO_TEST_CASE( templater_helpers )
     }
 }
 
+BOOST_AUTO_TEST_CASE( templater_args_helpers )
+{
+    TemplateEngine engine;
+
+    Template templ = engine.templ("<p>@sum(1, 2, 3)</p>");
+
+    // helpers may be registered after the template was compiled
+    auto sum = [](const Value & /*context*/, const HelperArgs &args) {
+        int64_t result = 0;
+
+        for(const Value *it = args.begin(); it != args.end(); ++it)
+            result += it->toInt64();
+
+        BOOST_CHECK( args[args.size()].isNull() );
+        return Value(result);
+    };
+    engine.registerArgsHelper("sum", sum);
+
+    BOOST_CHECK( engine.hasHelper("sum") );
+    BOOST_CHECK( templ.render() == "<p>6</p>" );
+
+    Value args{Value::ArrayTag()};
+    args.append(7);
+    args.append(8);
+    BOOST_CHECK( engine.callHelper("sum", Value(), args).toInt() == 15 );
+
+    // registering again rebinds the compiled call sites
+    auto count = [](const Value & /*context*/, const Value &args) {
+        BOOST_CHECK( args.type() == Value::Array );
+        return Value( static_cast<int>(args.size()) );
+    };
+    engine.registerHelper("sum", count);
+
+    BOOST_CHECK( templ.render() == "<p>3</p>" );
+}
+
+BOOST_AUTO_TEST_CASE( templater_pure_helpers )
+{
+    TemplateEngine engine;
+    int calls = 0;
+
+    auto price = [&calls](const Value & /*context*/, const HelperArgs &args) {
+        ++calls;
+        return Value("$" + args[0].toString());
+    };
+    engine.registerArgsHelper("price", price, true);
+
+    Value values{Value::ObjectTag()};
+    Value items{Value::ArrayTag()};
+
+    for(int i = 0; i < 6; ++i)
+        items.append(i % 2 ? 10 : 20);
+
+    values["items"] = items;
+
+    Template templ = engine.templ("@for(item in items) {@price(item);}");
+    const std::string expected = "$20;$10;$20;$10;$20;$10;";
+
+    BOOST_CHECK( templ.render(values) == expected );
+    BOOST_CHECK( calls == 2 );
+    BOOST_CHECK( engine.helperCacheStats().hits == 4 );
+    BOOST_CHECK( engine.helperCacheStats().misses == 2 );
+
+    // without the engine cache every render calls the helper again
+    BOOST_CHECK( templ.render(values) == expected );
+    BOOST_CHECK( calls == 4 );
+
+    engine.setHelperCacheSize(2);
+    engine.resetHelperCacheStats();
+
+    BOOST_CHECK( templ.render(values) == expected );
+    BOOST_CHECK( templ.render(values) == expected );
+    BOOST_CHECK( calls == 6 );
+    BOOST_CHECK( engine.helperCacheStats().misses == 2 );
+    BOOST_CHECK( engine.helperCacheStats().size == 2 );
+
+    // the bound is kept
+    BOOST_CHECK( engine.templ("@price(1)@price(2)@price(3)").render() == "$1$2$3" );
+    BOOST_CHECK( engine.helperCacheStats().size == 2 );
+
+    // arrays and objects are not cached
+    calls = 0;
+    BOOST_CHECK( engine.templ("@price({a: 1}) @price({a: 1})").render() == "$ $" );
+    BOOST_CHECK( calls == 2 );
+}
+
+BOOST_AUTO_TEST_CASE( templater_helper_cache_threads )
+{
+    TemplateEngine engine;
+
+    engine.registerArgsHelper("twice", [](const Value &, const HelperArgs &args) {
+        return Value(args[0].toInt() * 2);
+    }, true);
+    engine.setHelperCacheSize(8);
+
+    // the engine cache is shared by the renders of all the threads
+    Template templ = engine.templ("@twice(n)");
+    boost::thread_group threads;
+    boost::mutex mutex;
+    int failures = 0;
+
+    for(int t = 0; t < 4; ++t)
+    {
+        threads.create_thread([&templ, &mutex, &failures, t]() {
+            for(int i = 0; i < 2000; ++i)
+            {
+                Value values{Value::ObjectTag()};
+                const int n = (i * 7 + t) % 32;
+
+                values["n"] = n;
+
+                if( templ.render(values) != std::to_string(n * 2) )
+                {
+                    boost::mutex::scoped_lock lock(mutex);
+                    ++failures;
+                }
+            }
+        });
+    }
+
+    threads.join_all();
+    BOOST_CHECK( failures == 0 );
+    BOOST_CHECK( engine.helperCacheStats().hits + engine.helperCacheStats().misses == 8000 );
+    BOOST_CHECK( engine.helperCacheStats().size <= 8 );
+}
+
+BOOST_AUTO_TEST_CASE( templater_batch_helpers )
+{
+    TemplateEngine engine;
+    int batches = 0;
+
+    auto stock = [&batches](const Value & /*context*/, const std::vector<HelperArgs> &calls,
+                            std::vector<Value> &results) {
+        ++batches;
+
+        for(size_t i = 0; i < calls.size(); ++i)
+            results.push_back( calls[i][0].toInt() * 10 + calls[i][1].toInt() );
+    };
+    engine.registerBatchHelper("stock", stock);
+
+    Value values{Value::ObjectTag()};
+    Value items{Value::ArrayTag()};
+    Value sizes{Value::ArrayTag()};
+
+    items.append(1);
+    items.append(2);
+    items.append(3);
+    sizes.append(7);
+    sizes.append(8);
+
+    values["items"] = items;
+    values["sizes"] = sizes;
+
+    {
+        Template templ = engine.templ("@for(item in items) {@stock(item, 0)-@if(loop.last) {@stock(item, 5)};}");
+
+        BOOST_CHECK( templ.render(values) == "10-;20-;30-35;" );
+        BOOST_CHECK( batches == 2 );
+    }
+
+    {
+        // inner call sites are batched per run of the inner loop
+        batches = 0;
+        Template templ = engine.templ("@for(item in items) {@for(size in sizes) {@stock(item, size),}|}");
+
+        BOOST_CHECK( templ.render(values) == "17,18,|27,28,|37,38,|" );
+        BOOST_CHECK( batches == 3 );
+    }
+
+    {
+        // only the items taking the branch make the call and evaluate its arguments
+        int seen = 0;
+        size_t rows = 0;
+
+        engine.registerArgsHelper("seen", [&seen](const Value &, const HelperArgs &args) {
+            ++seen;
+            return args[0];
+        });
+        engine.registerBatchHelper("rows", [&rows](const Value &, const std::vector<HelperArgs> &calls,
+                                                   std::vector<Value> &results) {
+            rows += calls.size();
+
+            for(size_t i = 0; i < calls.size(); ++i)
+                results.push_back( calls[i][0].toInt() * 10 );
+        });
+
+        Template templ = engine.templ("@for(item in items) {@if(loop.first) {-} else if(loop.last) {@rows(seen(item))} else {+}}");
+
+        BOOST_CHECK( templ.render(values) == "-+30" );
+        BOOST_CHECK( seen == 1 && rows == 1 );
+
+        // nested branches
+        seen = 0;
+        rows = 0;
+        templ = engine.templ("@for(item in items) {@if(loop.last) {.} else {@unless(loop.first) {@rows(seen(item))}}}");
+
+        BOOST_CHECK( templ.render(values) == "20." );
+        BOOST_CHECK( seen == 1 && rows == 1 );
+    }
+
+    BOOST_CHECK( engine.templ("@stock(4, 2)").render() == "42" );
+}
+
+BOOST_AUTO_TEST_CASE( templater_async_helpers )
+{
+    TemplateEngine engine;
+    std::vector< boost::shared_ptr< boost::promise<Value> > > calls;
+    boost::mutex mutex;
+
+    auto lookup = [&calls, &mutex](const Value & /*context*/, const HelperArgs &args) {
+        boost::shared_ptr< boost::promise<Value> > promise(new boost::promise<Value>);
+        boost::shared_future<Value> result(promise->get_future());
+
+        boost::mutex::scoped_lock lock(mutex);
+        calls.push_back(promise);
+
+        if( args[0].toString() == "now" )
+            promise->set_value("ready");
+
+        return result;
+    };
+    engine.registerAsyncHelper("lookup", lookup);
+
+    // resolves the calls in reverse order once all of them are issued
+    boost::thread resolver([&calls, &mutex]() {
+        for(int i = 0; i < 200; ++i)
+        {
+            boost::mutex::scoped_lock lock(mutex);
+
+            if( calls.size() == 3 )
+                break;
+
+            lock.unlock();
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+
+        if( calls.size() > 1 )
+            calls[1]->set_value("b");
+        calls[0]->set_value("a");
+    });
+
+    Value values{Value::ObjectTag()};
+    Value items{Value::ArrayTag()};
+    items.append("x");
+    items.append("y");
+    values["items"] = items;
+
+    Template templ = engine.templ("<p>@for(item in items) {[@lookup(item)]}@{lookup(\"now\")}</p>");
+
+    BOOST_CHECK( templ.render(values) == "<p>[a][b]ready</p>" );
+    BOOST_CHECK( calls.size() == 3 );
+
+    resolver.join();
+
+    // a result needed by an expression is waited for at once
+    calls.clear();
+    BOOST_CHECK( engine.templ("@rawHtml(lookup(\"now\"))").render() == "ready" );
+
+    // the context of a call keeps its loop variables after the loop goes on
+    std::vector< std::pair< Value, boost::shared_ptr< boost::promise<Value> > > > scoped;
+
+    engine.registerAsyncHelper("current", [&scoped, &mutex](const Value &context, const HelperArgs &) {
+        boost::shared_ptr< boost::promise<Value> > promise(new boost::promise<Value>);
+
+        boost::mutex::scoped_lock lock(mutex);
+        scoped.push_back(std::make_pair(context, promise));
+        return boost::shared_future<Value>(promise->get_future());
+    });
+
+    boost::thread later([&scoped, &mutex]() {
+        for(int i = 0; i < 200; ++i)
+        {
+            boost::mutex::scoped_lock lock(mutex);
+
+            if( scoped.size() == 2 )
+                break;
+
+            lock.unlock();
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+
+        for(size_t i = 0; i < scoped.size(); ++i)
+            scoped[i].second->set_value(scoped[i].first.member("item"));
+    });
+
+    BOOST_CHECK( engine.templ("@for(item in items) {[@current()]}").render(values) == "[x][y]" );
+    later.join();
+}
+
+BOOST_AUTO_TEST_CASE( templater_fragment_cache )
+{
+    TemplateEngine engine;
+    int calls = 0;
+
+    auto menu = [&calls](const Value & /*context*/, const HelperArgs &args) {
+        ++calls;
+        return Value("menu:" + args[0].toString());
+    };
+    engine.registerArgsHelper("menu", menu);
+
+    Value values{Value::ObjectTag()};
+    values["user"] = "bob";
+
+    Template templ = engine.templ("[@cache(user) {@menu(user)}]");
+
+    BOOST_CHECK( templ.render(values) == "[menu:bob]" );
+    BOOST_CHECK( templ.render(values) == "[menu:bob]" );
+    BOOST_CHECK( calls == 1 );
+    BOOST_CHECK( engine.fragmentCacheStats().hits == 1 );
+    BOOST_CHECK( engine.fragmentCacheStats().misses == 1 );
+    BOOST_CHECK( engine.fragmentCacheStats().fragments == 1 );
+    BOOST_CHECK( engine.fragmentCacheStats().bytes == std::string("menu:bob").size() );
+
+    // every key has its own fragment
+    values["user"] = "alice";
+    BOOST_CHECK( templ.render(values) == "[menu:alice]" );
+    BOOST_CHECK( calls == 2 );
+    BOOST_CHECK( engine.fragmentCacheStats().fragments == 2 );
+
+    // the same key in another block or template is another fragment
+    BOOST_CHECK( engine.templ("@cache(user) {<@menu(user)>}").render(values) == "<menu:alice>" );
+    BOOST_CHECK( calls == 3 );
+
+    engine.invalidateFragments("alice");
+    BOOST_CHECK( engine.fragmentCacheStats().fragments == 1 );
+    BOOST_CHECK( templ.render(values) == "[menu:alice]" );
+    BOOST_CHECK( calls == 4 );
+
+    // keys are the raw strings, not html escaped
+    values["user"] = "a&b <\"c\">";
+    BOOST_CHECK( templ.render(values) == "[menu:a&amp;b &lt;&quot;c&quot;&gt;]" );
+    engine.invalidateFragments("a&b <\"c\">");
+    BOOST_CHECK( templ.render(values) == "[menu:a&amp;b &lt;&quot;c&quot;&gt;]" );
+    BOOST_CHECK( calls == 6 );
+    values["user"] = "alice";
+
+    // fragments over the limit are not kept
+    engine.clearFragmentCache();
+    engine.setFragmentCacheSize(16);
+    BOOST_CHECK( templ.render(values) == "[menu:alice]" );
+    BOOST_CHECK( engine.fragmentCacheStats().fragments == 0 );
+}
+
+static time_t fragmentClock = 1000;
+
+static time_t testClock(time_t *)
+{
+    return fragmentClock;
+}
+
+BOOST_AUTO_TEST_CASE( templater_fragment_ttl )
+{
+    FragmentCache fragments(1024, testClock);
+    std::string out;
+
+    fragments.insert("k", "block", "text", 2);
+    fragments.insert("k", "forever", "text", 0);
+    fragmentClock += 1;
+    BOOST_CHECK( fragments.find("k", "block", out) && out == "text" );
+
+    // expired fragments are rendered again
+    fragmentClock += 1;
+    BOOST_CHECK( fragments.find("k", "block", out) == false );
+    BOOST_CHECK( fragments.find("k", "forever", out) && out == "texttext" );
+    BOOST_CHECK( fragments.stats().fragments == 1 );
+}
+
+BOOST_AUTO_TEST_CASE( templater_set_helpers )
+{
+    TemplateEngine engine;
+    Value values{Value::ObjectTag()};
+    Value seen{Value::ArrayTag()};
+    Value all{Value::ArrayTag()};
+
+    for(int i = 0; i < 6; ++i)
+        all.append(i % 4);
+
+    seen.append(1);
+    seen.append(3);
+
+    values["all"] = all;
+    values["seen"] = seen;
+
+    BOOST_CHECK( engine.templ("@for(id in all) {@id;}").render(values) == "0;1;2;3;0;1;" );
+
+    values["result"] = all - seen;
+    BOOST_CHECK( engine.templ("@for(id in result) {@id;}").render(values) == "0;2;0;" );
+
+    BOOST_CHECK( engine.templ("@{difference(all, seen).length}").render(values) == "3" );
+    BOOST_CHECK( engine.templ("@{unique(all).size}").render(values) == "4" );
+    BOOST_CHECK( engine.templ("@{intersection(all, seen).size}").render(values) == "2" );
+    BOOST_CHECK( engine.templ("@{union(seen, all).size}").render(values) == "4" );
+}
+
+BOOST_AUTO_TEST_CASE( templater_aggregate_helpers )
+{
+    TemplateEngine engine;
+    Value values{Value::ObjectTag()};
+    Value integers{Value::ArrayTag()};
+    Value doubles{Value::ArrayTag()};
+    Value mixed{Value::ArrayTag()};
+
+    for(int i = 1; i <= 10; ++i)
+    {
+        integers.append(i % 2 ? i : -i);
+        doubles.append(i / 4.0);
+    }
+
+    mixed.append(3);
+    mixed.append("text");
+    mixed.append(1.5);
+    mixed.append(true);
+
+    values["integers"] = integers;
+    values["doubles"] = doubles;
+    values["mixed"] = mixed;
+    values["empty"] = Value(Value::ArrayTag());
+
+    BOOST_CHECK( engine.templ("@sum(integers) @min(integers) @max(integers) @count(integers)").render(values) == "-5 -10 9 10" );
+    BOOST_CHECK( engine.templ("@avg(integers)").render(values) == "-0.5" );
+    BOOST_CHECK( engine.templ("@sum(doubles) @min(doubles) @max(doubles) @avg(doubles)").render(values) == "13.75 0.25 2.5 1.375" );
+    BOOST_CHECK( engine.templ("@sum(mixed) @min(mixed) @max(mixed) @avg(mixed) @count(mixed)").render(values) == "4.5 1.5 3 2.25 4" );
+    BOOST_CHECK( engine.templ("@sum(empty) @count(empty)").render(values) == "0 0" );
+    BOOST_CHECK( engine.templ("@{avg(empty)}@{max(empty)}").render(values) == "" );
+
+    // generators have no size, their items are counted
+    values["generated"] = Value::generator([]() {
+        int next = 0;
+
+        return Value::Generate([next](Value &item) mutable {
+            if( next == 4 )
+                return false;
+
+            // 0 1.5 2 4.5
+            item = next % 2 ? Value(next * 1.5) : Value(next);
+            ++next;
+            return true;
+        });
+    });
+    values["nothing"] = Value::generator([]() {
+        return Value::Generate([](Value &) { return false; });
+    });
+
+    BOOST_CHECK( engine.templ("@sum(generated) @min(generated) @max(generated) @avg(generated) @count(generated)").render(values) == "8 0 4.5 2 4" );
+    BOOST_CHECK( engine.templ("@sum(nothing) @count(nothing)@{avg(nothing)}@{min(nothing)}").render(values) == "0 0" );
+}
+
+BOOST_AUTO_TEST_CASE( templater_lazy_values )
+{
+    TemplateEngine engine;
+    Value values{Value::ObjectTag()};
+    int computed = 0;
+    int started = 0;
+
+    values["admin"] = false;
+    values["user"] = Value::lazy([&computed]() {
+        Value user{Value::ObjectTag()};
+
+        ++computed;
+        user["name"] = "Alex";
+        return user;
+    });
+    values["report"] = Value::lazy([&computed]() {
+        ++computed;
+        return Value("secret");
+    });
+    values["numbers"] = Value::generator([&started]() {
+        int next = 0;
+
+        ++started;
+        return Value::Generate([next](Value &item) mutable {
+            if( next == 4 )
+                return false;
+
+            item = next++ * 10;
+            return true;
+        });
+    });
+
+    Template templ = engine.templ("@{user.name} @if(admin) {@report}@{user.name}");
+
+    BOOST_CHECK( templ.render(values) == "AlexAlex" );
+    BOOST_CHECK( templ.render(values) == "AlexAlex" );
+    BOOST_CHECK_EQUAL( computed, 1 );
+
+    BOOST_CHECK( engine.templ("@for(n in numbers) {@n@if(loop.last) {.}@unless(loop.last) {,}}").render(values) == "0,10,20,30." );
+    BOOST_CHECK( engine.templ("@for(n in numbers) {@n;}").render(values) == "0;10;20;30;" );
+    BOOST_CHECK_EQUAL( started, 2 );
+    BOOST_CHECK_EQUAL( values["numbers"].materialize().size(), 4 );
+
+    // reached through a loop item or a global
+    Value items{Value::ArrayTag()};
+    Value item{Value::ObjectTag()};
+
+    item["lazyMember"] = Value::lazy([]() { return Value("<b>"); });
+    items.append(item);
+    items.append(Value::lazy([]() {
+        Value item{Value::ObjectTag()};
+        item["lazyMember"] = 2;
+        return item;
+    }));
+    items.append(Value::lazy([]() { return Value("<i>"); }));
+    values["items"] = items;
+
+    BOOST_CHECK_EQUAL( engine.templ("@for(x in items) {@{x.lazyMember};}").render(values), "&lt;b&gt;;2;;" );
+    BOOST_CHECK_EQUAL( engine.templ("@for(x in items) {@x;}").render(values), ";;&lt;i&gt;;" );
+
+    engine.setGlobal("site", Value::lazy([]() {
+        Value site{Value::ObjectTag()};
+        site["name"] = "Shop";
+        return site;
+    }));
+    BOOST_CHECK_EQUAL( engine.templ("@{site.name}").render(values), "Shop" );
+}
+
+BOOST_AUTO_TEST_CASE( templater_struct_reference )
+{
+    TemplateEngine engine;
+    Value values{Value::ObjectTag()};
+    std::vector<Order> orders(2);
+
+    orders[0].id = 1;
+    orders[0].total = 9.5;
+    orders[0].paid = true;
+    orders[1].id = 2;
+    orders[1].total = 20;
+    orders[1].paid = false;
+    orders[1].lines.push_back(OrderLine{"pen", 2});
+    orders[1].lines.push_back(OrderLine{"book", 1});
+
+    values["order"] = Value::reference(orders[1]);
+    values["lines"] = Value::reference(orders[1].lines);
+    values["orders"] = Value::reference(orders);
+
+    Template templ = engine.templ("@{order.id}: @for(line in lines) {@{line.product} x@{line.quantity};}");
+
+    BOOST_CHECK( templ.render(values) == "2: pen x2;book x1;" );
+
+    // the struct is not copied, changes are seen by the next render
+    orders[1].lines[0].quantity = 3;
+    BOOST_CHECK( templ.render(values) == "2: pen x3;book x1;" );
+
+    BOOST_CHECK( engine.templ("@for(o in orders) {@{o.id}=@{o.total}@if(o.paid) {+}@{o.lines.size},}").render(values) == "1=9.5+0,2=202," );
+    BOOST_CHECK( engine.templ("@{orders.size} @{order.missing}").render(values) == "2 " );
+
+    values["copy"] = Value::fromValue(orders[0]);
+    orders[0].id = 5;
+    BOOST_CHECK( engine.templ("@{copy.id}").render(values) == "1" );
+    BOOST_CHECK( values["copy"].toValue<Order>().total == 9.5 );
+
+    // items and fields of a copy refer into it and keep it alive
+    Value line;
+
+    {
+        const Value copy = Value::fromValue(orders[1]);
+        const Value lines = copy.member("lines");
+
+        line = lines.at(1);
+    }
+
+    orders[1].lines[1].product = "pencil";
+    BOOST_CHECK( line.member("product") == "book" );
+    BOOST_CHECK( engine.templ("@{line.product} x@{line.quantity}").render({{"line", line}}) == "book x1" );
+}
+
+BOOST_AUTO_TEST_CASE( templater_string_concatenation )
+{
+    TemplateEngine engine;
+    Value values{Value::ObjectTag()};
+    const std::string long1(300, 'a');
+    const std::string long2(300, 'b');
+
+    values["a"] = long1;
+    values["b"] = "<b>";
+    values["c"] = Value(long2, Value::UnsafeStringTag());
+
+    // a rope is written piece by piece, escaped as one string
+    values["joined"] = values["a"] + values["b"] + values["c"];
+    BOOST_CHECK( engine.templ("@joined").render(values) == long1 + "&lt;b&gt;" + long2 );
+    BOOST_CHECK( engine.templ("@{joined + c}").render(values) == long1 + "&lt;b&gt;" + long2 + long2 );
+}
+
+BOOST_AUTO_TEST_CASE( templater_render_cache )
+{
+    TemplateEngine engine;
+    int calls = 0;
+
+    auto price = [&calls](const Value & /*context*/, const HelperArgs &args) {
+        ++calls;
+        return Value("$" + args[0].toString());
+    };
+    engine.registerArgsHelper("price", price, true);
+    engine.setRenderCacheSize(2);
+
+    Template templ = engine.templ("@for(item in items) {@{item.name} @price(item.price);}");
+
+    auto makeValues = [](int first) {
+        Value values{Value::ObjectTag()};
+        Value items{Value::ArrayTag()};
+
+        for(int i = first; i < first + 2; ++i)
+        {
+            Value item{Value::ObjectTag()};
+            item["name"] = "item" + std::to_string(i);
+            item["price"] = i * 10;
+            items.append(item);
+        }
+
+        values["items"] = items;
+        return values;
+    };
+
+    Value values = makeValues(1);
+
+    BOOST_CHECK( templ.render(values) == "item1 $10;item2 $20;" );
+    BOOST_CHECK( calls == 2 );
+
+    // an equal context built again is a hit
+    BOOST_CHECK( templ.render(makeValues(1)) == "item1 $10;item2 $20;" );
+    BOOST_CHECK( calls == 2 );
+    BOOST_CHECK( engine.renderCacheStats().hits == 1 );
+    BOOST_CHECK( engine.renderCacheStats().misses == 1 );
+
+    // the cached context is a copy, changing the original is a new context
+    values["items"][0]["price"] = 15;
+    BOOST_CHECK( templ.render(values) == "item1 $15;item2 $20;" );
+    BOOST_CHECK( calls == 4 );
+
+    // 15 and 15.0 do not render the same, the cached 15 is not used for 15.0
+    Template half = engine.templ("@{price / 2}");
+    Value number{Value::ObjectTag()};
+    number["price"] = 15;
+    BOOST_CHECK( half.render(number) == "7" );
+    number["price"] = 15.0;
+    BOOST_CHECK( half.render(number) == "7.5" );
+
+    values["items"][0]["price"] = 15.0;
+    templ.render(values);
+    BOOST_CHECK( calls == 6 );
+
+    // a string and an unsafe string do not
+    Template text = engine.templ("@text");
+    Value html{Value::ObjectTag()};
+    html["text"] = "<b>";
+    BOOST_CHECK( text.render(html) == "&lt;b&gt;" );
+    html["text"] = Value("<b>", Value::UnsafeStringTag());
+    BOOST_CHECK( text.render(html) == "<b>" );
+
+    BOOST_CHECK( engine.renderCacheStats().size == 2 );
+
+    // generators may give new rows with the same holder, they are not cached
+    int rows = 1;
+    Value generated{Value::ObjectTag()};
+    generated["rows"] = Value::generator([&rows]() {
+        int next = 0;
+
+        return Value::Generate([next, &rows](Value &item) mutable {
+            if( next == rows )
+                return false;
+
+            item = next++;
+            return true;
+        });
+    });
+
+    Template list = engine.templ("@for(row in rows) {@row;}");
+    BOOST_CHECK( list.render(generated) == "0;" );
+    rows = 2;
+    BOOST_CHECK( list.render(generated) == "0;1;" );
+
+    // nor templates with @cache blocks, they expire on their own
+    const size_t misses = engine.renderCacheStats().misses;
+    Template fragment = engine.templ("@cache(\"block\", 60) {@text}");
+    BOOST_CHECK( fragment.render(html) == "<b>" );
+    BOOST_CHECK( fragment.render(html) == "<b>" );
+    BOOST_CHECK( engine.renderCacheStats().misses == misses );
+
+    // templates calling impure helpers are always rendered
+    int now = 0;
+    engine.registerArgsHelper("now", [&now](const Value &, const HelperArgs &) { return Value(++now); });
+    Template clock = engine.templ("@now()");
+    BOOST_CHECK( clock.render() == "1" );
+    BOOST_CHECK( clock.render() == "2" );
+
+    // registering a helper drops the renders
+    engine.registerArgsHelper("price", [](const Value &, const HelperArgs &args) {
+        return Value("USD " + args[0].toString());
+    }, true);
+    BOOST_CHECK( templ.render(values) == "item1 USD 15;item2 USD 20;" );
+
+    engine.setRenderCacheSize(0);
+    BOOST_CHECK( engine.renderCacheStats().size == 0 );
+}
+
 BOOST_AUTO_TEST_CASE( templater_conditions_if )
 {
     TemplateEngine engine;
@@ -404,7 +1233,8 @@ BOOST_AUTO_TEST_CASE( templater_objects_args )
         BOOST_CHECK( args.size() == 1 );
         BOOST_CHECK( args[0].type() == Value::Object );
 
-        Value obj = args[0];
+        // constant arguments are frozen, read through the const operator[]
+        const Value obj = args[0];
 
         BOOST_CHECK( obj.size() == 3 );
 
@@ -425,6 +1255,21 @@ BOOST_AUTO_TEST_CASE( templater_objects_args )
         std::string templ = "<p>@returnObject( {string: \"hello\", empty: {}, integer: 10} )</p>";
         BOOST_CHECK( engine.templ(templ).render(values) == "<p>Foo</p>" );
     }
+
+    // a constant object is shared by the renders, changes of a helper are lost
+    auto count = [](const Value &, const HelperArgs &args) {
+        const Value result = args[0]["count"];
+        Value obj = args[0];
+
+        obj["count"] = result.toInt() + 1;
+        return result;
+    };
+
+    engine.registerArgsHelper("count", count);
+
+    Template templ = engine.templ("@count({count: 1})");
+    BOOST_CHECK( templ.render(values) == "1" );
+    BOOST_CHECK( templ.render(values) == "1" );
 }
 
 BOOST_AUTO_TEST_CASE( templater_expressions )
@@ -439,6 +1284,35 @@ BOOST_AUTO_TEST_CASE( templater_expressions )
         std::string templ = "<p>@{string + \"world!\"}</p>";
         BOOST_CHECK( engine.templ(templ).render(values) == "<p>Hello, world!</p>" );
     }
+
+    {
+        Value items{Value::ArrayTag()};
+        Value item{Value::ObjectTag()};
+        item["qty"] = 3;
+        item["price"] = 2.5;
+        items.append(item);
+        item = Value(Value::ObjectTag());
+        item["qty"] = 0;
+        item["price"] = 4;
+        items.append(item);
+
+        values["items"] = items;
+        values["big"] = static_cast<int64_t>(3000000000LL);
+
+        std::string templ = "@for(item in items) {@{item.price * item.qty} @{item.qty > 0} @{item.qty / 0};}";
+        BOOST_CHECK( engine.templ(templ).render(values) == "7.5 true ;0 false ;" );
+
+        BOOST_CHECK( engine.templ("@{big * 2} @{big > 2} @{big != 2}").render(values)
+                     == "6000000000 true true" );
+
+        // 2^53 + 1 has no double, as Value == the nearest one is not equal to it
+        values["odd"] = static_cast<int64_t>(9007199254740993LL);
+        values["even"] = 9007199254740992.0;
+
+        BOOST_CHECK( values["odd"] != values["even"] );
+        BOOST_CHECK( engine.templ("@{odd == even} @{even == odd} @{odd != even} @{even == even}").render(values)
+                     == "false false true true" );
+    }
 }
 
 BOOST_AUTO_TEST_CASE( templater_inline_if )
@@ -462,6 +1336,104 @@ BOOST_AUTO_TEST_CASE( templater_inline_if )
     }
 }
 
+BOOST_AUTO_TEST_CASE( templater_optimize )
+{
+    TemplateEngine engine;
+
+    auto size = [](const Value &, const Value &args) {
+        return Value( static_cast<int>(args[0].size()) );
+    };
+    engine.registerHelper("size", size);
+
+    {
+        Template templ = engine.templ("<p>a@@b\n@{2 * 3}@if( 1 ) {one} else {two}@{0 ? \"x\" : \"y\"}</p>");
+
+        BOOST_CHECK( templ.render() == "<p>a@b\n6oney</p>" );
+        BOOST_CHECK( templ.dump() == "html text \"<p>a@b\n6oney</p>\"\n" );
+    }
+
+    {
+        Template templ = engine.templ("<p>@size({a: 1, b: \"c\"})</p>");
+        const std::string dump = templ.dump();
+
+        BOOST_CHECK( templ.render() == "<p>2</p>" );
+        BOOST_CHECK( dump.find("constant object, 2 members") != std::string::npos );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( templater_globals )
+{
+    TemplateEngine engine;
+
+    Value features{Value::ObjectTag()};
+    features["newCheckout"] = true;
+
+    engine.setGlobal("features", features);
+    engine.setGlobal("site", "<Shop>");
+
+    BOOST_CHECK( engine.hasGlobal("site") );
+    BOOST_CHECK( engine.hasGlobal("user") == false );
+
+    Template templ = engine.templ("@site: @if(features.newCheckout) {new} else {old}");
+
+    BOOST_CHECK( templ.render() == "&lt;Shop&gt;: new" );
+    BOOST_CHECK( templ.dump() == "html text \"&lt;Shop&gt;: new\"\n" );
+
+    features["newCheckout"] = false;
+    engine.setGlobal("features", features);
+
+    BOOST_CHECK( templ.render() == "&lt;Shop&gt;: old" );
+
+    {
+        // globals take precedence over the render context
+        Value values{Value::ObjectTag()};
+        values["site"] = "other";
+        BOOST_CHECK( templ.render(values) == "&lt;Shop&gt;: old" );
+    }
+
+    {
+        // cached fragments of the old tree are not served by the new one
+        Template cached = engine.templ("@cache(\"header\") {@site}");
+
+        BOOST_CHECK( cached.render() == "&lt;Shop&gt;" );
+        engine.setGlobal("site", "Store");
+        BOOST_CHECK( cached.render() == "Store" );
+    }
+
+    {
+        // renders keep their tree while a changed global compiles a new one
+        Template shop = engine.templ("@site@if(features.newCheckout) {!}");
+        boost::thread_group threads;
+        boost::mutex mutex;
+        int failures = 0;
+
+        for(int t = 0; t < 4; ++t)
+        {
+            threads.create_thread([&shop, &mutex, &failures]() {
+                for(int i = 0; i < 2000; ++i)
+                {
+                    const std::string result = shop.render();
+
+                    if( result != "Store" && result != "Store!" )
+                    {
+                        boost::mutex::scoped_lock lock(mutex);
+                        ++failures;
+                    }
+                }
+            });
+        }
+
+        for(int i = 0; i < 200; ++i)
+        {
+            features["newCheckout"] = i % 2 == 0;
+            engine.setGlobal("features", features);
+        }
+
+        threads.join_all();
+        BOOST_CHECK( failures == 0 );
+    }
+}
+
 BOOST_AUTO_TEST_CASE( templater_escape )
 {
     TemplateEngine engine;
@@ -489,5 +1461,65 @@ BOOST_AUTO_TEST_CASE( templater_unsafe )
 }
 
 
+BOOST_AUTO_TEST_CASE( templater_json_helper )
+{
+    TemplateEngine engine;
+    Value values{Value::ObjectTag()};
+    Value state{Value::ObjectTag()};
+    Value items{Value::ArrayTag()};
+
+    items.append(1);
+    items.append(-2);
+    state["items"] = items;
+    state["name"] = "Tom & \"Jerry\"\n</script>";
+    state["ok"] = true;
+    state["none"] = Value();
+    state["price"] = 0.1;
+    state["line"] = "a\xE2\x80\xA8" "b\x01";
+    values["state"] = state;
+
+    BOOST_CHECK( engine.templ("<script>var state = @json(state);</script>").render(values) ==
+                 "<script>var state = {\"items\":[1,-2],\"line\":\"a\\u2028b\\u0001\","
+                 "\"name\":\"Tom \\u0026 \\\"Jerry\\\"\\n\\u003c/script\\u003e\","
+                 "\"none\":null,\"ok\":true,\"price\":0.1};</script>" );
+    BOOST_CHECK( engine.templ("@json(missing) @json(state.ok)").render(values) == "null true" );
+
+    // strings are given to json as they are, not html escaped first
+    BOOST_CHECK( engine.templ("@json(state.name)").render(values) ==
+                 "\"Tom \\u0026 \\\"Jerry\\\"\\n\\u003c/script\\u003e\"" );
+}
+
+BOOST_AUTO_TEST_CASE( templater_table )
+{
+    TemplateEngine engine;
+    Value values{Value::ObjectTag()};
+    Table table;
+
+    table.addColumn("id", Value::Int);
+    table.addColumn("name", Value::String);
+    table.addColumn("note", Value::UnsafeString);
+    table.addColumn("price", Value::Double);
+
+    for(int i = 0; i < 3; ++i)
+    {
+        Value row{Value::ObjectTag()};
+
+        row["id"] = i;
+        row["name"] = "<" + std::to_string(i) + ">";
+        row["note"] = "<b>" + std::to_string(i) + "</b>";
+        row["price"] = i * 1.5;
+        table.appendRow(row);
+    }
+
+    values["table"] = Value::fromValue(table);
+
+    BOOST_CHECK( engine.templ("@for(row in table){@{row.id}:@{row.name}:@{row.note}:@{row.price * 2}"
+                              "@{loop.last ? \"\" : \",\"}}").render(values) ==
+                 "0:&lt;0&gt;:<b>0</b>:0,1:&lt;1&gt;:<b>1</b>:3,2:&lt;2&gt;:<b>2</b>:6" );
+    BOOST_CHECK( engine.templ("@{table.length}").render(values) == "3" );
+    BOOST_CHECK( engine.templ("@for(row in table){@{row.price} @{row.name};}").render(values) ==
+                 "0 &lt;0&gt;;1.5 &lt;1&gt;;3 &lt;2&gt;;" );
+}
+
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,95 +4,148 @@
  */
 
 #include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/replace.hpp>
+#include <boost/functional/hash.hpp>
+#include <algorithm>
+#include <set>
+#include <sstream>
 #include <string>
 #include <list>
+#include <vector>
+#include <new>
+#include <stdio.h>
 
 #include "value.h"
 #include "templateasttree.h"
 #include "templateengine.h"
+#include "templateengineimpl.h"
 #include "templatecontext.h"
 
 using namespace cpptl;
 
 static Value nodeEval(const Node *node, const TemplateContext &context);
-static std::string nodeTraverse(const Node *node, const TemplateContext &context);
-static std::string escapeHtml(const std::string &s);
+static void nodeWrite(const Node *node, const TemplateContext &context, std::string &out);
+static void nodeTraverse(const Node *node, const TemplateContext &context, std::string &out);
+static void escapeHtml(std::string &out, const char *s, size_t size);
+static void appendInteger(std::string &out, int64_t value);
 
-extern "C" void dump(const std::string &tabs, const Node *node, int level);
+static void nodeDumpList(std::ostream &os, const Node *node, int level);
 
 struct IfConditionNode {
-    IfConditionNode(const AstNode *expression, const AstNode *ifStatement,
-                    const AstNode *elseIfStatement, const AstNode *elseStatement)
+    IfConditionNode(AstNode *expression, AstNode *ifStatement,
+                    AstNode *elseIfStatement, AstNode *elseStatement)
         : expression(expression), ifStatement(ifStatement),
           elseIfStatement(elseIfStatement), elseStatement(elseStatement)
     {}
 
     ~IfConditionNode();
 
-    const AstNode *expression;
-    const AstNode *ifStatement;
-    const AstNode *elseIfStatement;
-    const AstNode *elseStatement;
+    AstNode *expression;
+    AstNode *ifStatement;
+    AstNode *elseIfStatement;
+    AstNode *elseStatement;
 };
 
 struct ElseIfConditionNode {
-    ElseIfConditionNode(const AstNode *expression, const AstNode *statement)
+    ElseIfConditionNode(AstNode *expression, AstNode *statement)
         : expression(expression), statement(statement)
     {}
 
     ~ElseIfConditionNode();
 
-    const AstNode *expression;
+    AstNode *expression;
+    AstNode *statement;
+};
+
+// An @if or @unless around a call site in a loop body and the branch of it
+// the call is in
+struct LoopGuard {
+    const AstNode *condition;
     const AstNode *statement;
 };
 
 struct HelperNode {
-    HelperNode(const std::string &name, const AstNode *arguments, const AstNode *member)
-        : name(name), arguments(arguments), member(member)
+    HelperNode(const std::string &name, AstNode *arguments, AstNode *member)
+        : name(name), arguments(arguments), member(member), argumentsCount(0),
+          loopSlot(-1), loopCall(0), batchable(false)
     {}
 
     ~HelperNode();
 
     const std::string name;
-    const AstNode *arguments;
-    const AstNode *member;
+    AstNode *arguments;
+    AstNode *member;
+    HelperEntryPtr entry;   // bound when the template is compiled
+    size_t argumentsCount;
+    int loopSlot;           // frame slot of the innermost loop or -1
+    size_t loopCall;        // index in the call sites of that loop
+    std::vector<LoopGuard> guards;  // branches the call is in, the outer ones first
+    bool batchable;         // false if the guards call helpers themselves
 };
 
 struct UnlessConditionNode {
-    UnlessConditionNode(const AstNode *expression, const AstNode *unlessStatement,
-                        const AstNode *elseStatement)
+    UnlessConditionNode(AstNode *expression, AstNode *unlessStatement,
+                        AstNode *elseStatement)
         : expression(expression), unlessStatement(unlessStatement), elseStatement(elseStatement)
     {}
 
     ~UnlessConditionNode();
 
-    const AstNode *expression;
-    const AstNode *unlessStatement;
-    const AstNode *elseStatement;
+    AstNode *expression;
+    AstNode *unlessStatement;
+    AstNode *elseStatement;
 };
 
 struct ForLoopNode {
-    ForLoopNode(const AstNode *variable, const AstNode *list, const AstNode *statement)
-        : variable(variable), list(list), statement(statement)
+    ForLoopNode(AstNode *variable, AstNode *list, AstNode *statement)
+        : variable(variable), list(list), statement(statement), slot(0)
     {}
 
     ~ForLoopNode();
 
-    const AstNode *variable;
-    const AstNode *list;
-    const AstNode *statement;
+    AstNode *variable;
+    AstNode *list;
+    AstNode *statement;
+    int slot;       // loop frame slot for the item, assigned by compileTreeNodes
+    std::vector<HelperNode *> helpers;  // call sites in the body, may be batched
+};
+
+struct CacheNode {
+    CacheNode(AstNode *arguments, AstNode *statement)
+        : arguments(arguments), statement(statement)
+    {}
+
+    ~CacheNode();
+
+    AstNode *arguments;     // key and optional ttl in seconds
+    AstNode *statement;
+    std::string block;      // the template and the block in it, assigned by compileTreeNodes
 };
 
 struct VariableNode {
+    enum LoopMeta {
+        NoMeta,
+        LoopIndex,
+        LoopFirst,
+        LoopLast,
+        LoopSize
+    };
+
+    enum {
+        RootSlot = -1,
+        GlobalSlot = -2
+    };
+
     VariableNode(const std::string &name, AstNode *member)
-        : name(name), member(member)
+        : name(name), member(member), slot(RootSlot), meta(NoMeta), global(Value::Null)
     {}
 
     ~VariableNode();
 
     const std::string name;
     AstNode *member;
+    int slot;       // loop frame slot, RootSlot or GlobalSlot
+    LoopMeta meta;  // loop.index, loop.first... of the innermost loop
+    Value global;   // value of the engine global for GlobalSlot
 };
 
 struct ObjectNode {
@@ -106,14 +159,14 @@ struct ObjectNode {
 };
 
 struct ObjectMemberNode {
-    ObjectMemberNode(const std::string &name, const AstNode *value)
+    ObjectMemberNode(const std::string &name, AstNode *value)
         : name(name), value(value)
     {}
 
     ~ObjectMemberNode();
 
     const std::string name;
-    const AstNode *value;
+    AstNode *value;
 };
 
 struct BinaryExpressionOp {
@@ -130,15 +183,15 @@ struct BinaryExpressionOp {
         Less,
     };
 
-    BinaryExpressionOp(Operation operation, const AstNode *lhs, const AstNode *rhs)
+    BinaryExpressionOp(Operation operation, AstNode *lhs, AstNode *rhs)
         : operation(operation), lhs(lhs), rhs(rhs)
     {}
 
     ~BinaryExpressionOp();
 
     Operation operation;
-    const AstNode *lhs;
-    const AstNode *rhs;
+    AstNode *lhs;
+    AstNode *rhs;
 };
 
 struct AstNode
@@ -156,7 +209,9 @@ struct AstNode
         Helper = 9,
         Object = 10,
         ObjectMember = 11,
-        BinaryExpression = 12
+        BinaryExpression = 12,
+        Constant = 13,      // literal or folded expression, evaluated at compile time
+        Cache = 14
     };
 
     AstNode(NodeType type) : type(type), next(0)
@@ -200,6 +255,12 @@ struct AstNode
         case BinaryExpression:
             delete value.binaryExpr;
             break;
+        case Constant:
+            delete value.constant;
+            break;
+        case Cache:
+            delete value.cache;
+            break;
         case IntegerValue:
         case Invalid:
         default:
@@ -219,6 +280,8 @@ struct AstNode
         ObjectNode *object;
         ObjectMemberNode *objectMember;
         BinaryExpressionOp *binaryExpr;
+        Value *constant;
+        CacheNode *cache;
     } value;
 
     NodeType type;
@@ -252,6 +315,12 @@ UnlessConditionNode::~UnlessConditionNode()
     delete elseStatement;
 }
 
+CacheNode::~CacheNode()
+{
+    delete arguments;
+    delete statement;
+}
+
 ForLoopNode::~ForLoopNode()
 {
     delete variable;
@@ -281,6 +350,200 @@ BinaryExpressionOp::~BinaryExpressionOp()
 }
 
 
+static void nodeDump(std::ostream &os, const std::string &tabs, const Node *node, int level)
+{
+    assert( node != NULL );
+
+    switch(node->type)
+    {
+    case AstNode::IntegerValue:
+        os << tabs << "integer " << node->value.integer << std::endl;
+        break;
+    case AstNode::StringValue:
+        os << tabs << "string \"" << *node->value.text << '\"' << std::endl;
+        break;
+    case AstNode::HtmlText:
+        os << tabs << "html text \"" << *node->value.text << '\"' << std::endl;
+        break;
+    case AstNode::Constant: {
+        const Value &value = *node->value.constant;
+
+        os << tabs << "constant ";
+
+        if( value.type() == Value::Object )
+            os << "object, " << value.size() << " members";
+        else if( value.type() == Value::Array )
+            os << "array, " << value.size() << " items";
+        else if( value.type() == Value::Null )
+            os << "null";
+        else
+            os << '\"' << value.toString() << '\"';
+
+        os << std::endl;
+        break;
+    }
+    case AstNode::Variable: {
+        os << tabs << "variable " << node->value.variable->name;
+
+        if( node->value.variable->slot >= 0 )
+            os << " (loop slot " << node->value.variable->slot << ")";
+        os << std::endl;
+
+        Node *member = node->value.variable->member;
+        while( member ) {
+            os << tabs << "    member: " << member->value.variable->name << std::endl;
+            member = member->next;
+        }
+
+        break;
+    }
+    case AstNode::IfCondition:
+        os << tabs << "if condition: " << std::endl;
+        nodeDumpList(os, node->value.ifCondition->expression, level + 2);
+        os << tabs << "    statement" << std::endl;
+        nodeDumpList(os, node->value.ifCondition->ifStatement, level + 2);
+
+        if( node->value.ifCondition->elseIfStatement ) {
+            os << tabs << "    else if statement" << std::endl;
+            nodeDumpList(os, node->value.ifCondition->elseIfStatement, level + 2);
+        }
+        if( node->value.ifCondition->elseStatement ) {
+            os << tabs << "    else statement" << std::endl;
+            nodeDumpList(os, node->value.ifCondition->elseStatement, level + 2);
+        }
+        os << tabs << "endif" << std::endl;
+        break;
+    case AstNode::ElseIfCondition:
+        os << tabs << "else-if condition:" << std::endl;
+        nodeDumpList(os, node->value.elseIfCondition->expression, level + 2);
+        nodeDumpList(os, node->value.elseIfCondition->statement, level + 2);
+        os <<  "\n";
+        break;
+    case AstNode::UnlessCondition:
+        os << tabs << "unless condition:" << std::endl;
+        nodeDumpList(os, node->value.unlessCondition->expression, level + 2);
+        os << tabs << "    statement:" << std::endl;
+        nodeDumpList(os, node->value.unlessCondition->unlessStatement , level + 2);
+
+        if( node->value.unlessCondition->elseStatement ) {
+            os << tabs << "    else statement:" << std::endl;
+            nodeDumpList(os, node->value.unlessCondition->elseStatement, level + 2);
+        }
+
+        os << "\n";
+        break;
+    case AstNode::ForLoop:
+        os << tabs << "for loop:" << std::endl;
+        nodeDumpList(os, node->value.forLoop->variable, level + 1);
+        nodeDumpList(os, node->value.forLoop->list, level + 1);
+        nodeDumpList(os, node->value.forLoop->statement , level + 2);
+        os << "\n";
+        break;
+    case AstNode::Cache:
+        os << tabs << "cache:" << std::endl;
+        nodeDumpList(os, node->value.cache->arguments, level + 1);
+        os << tabs << "    statement:" << std::endl;
+        nodeDumpList(os, node->value.cache->statement, level + 2);
+        os << "\n";
+        break;
+    case AstNode::Helper:
+        os << tabs << "helper: " << node->value.helper->name << std::endl;
+
+        if( node->value.helper->arguments ) {
+            os << tabs << "arguments: " << std::endl;
+            nodeDumpList(os, node->value.helper->arguments, level + 2);
+        }
+
+        if( node->value.helper->member ) {
+            os << tabs << "members: " << std::endl;
+
+            const Node *member = node->value.helper->member;
+            while( member ) {
+                os << tabs << "    member: " << member->value.helper->name << std::endl;
+                member = member->next;
+            }
+        }
+
+        os << "\n";
+        break;
+    case AstNode::ObjectMember:
+        os << tabs << "object member: " << node->value.objectMember->name << std::endl;
+        nodeDumpList(os, node->value.objectMember->value, level + 2 );
+        os << "\n";
+        break;
+    case AstNode::Object:
+        if( node->value.object->members ) {
+            os << tabs << "object: " << std::endl;
+            nodeDumpList(os, node->value.object->members, level + 1 );
+        }
+        else {
+            os << tabs << "object: empty" << std::endl;
+        }
+        os << "\n";
+        break;
+    case AstNode::BinaryExpression: {
+        const AstNode *lhs = node->value.binaryExpr->lhs;
+        const AstNode *rhs = node->value.binaryExpr->rhs;
+
+        switch( node->value.binaryExpr->operation )
+        {
+        case BinaryExpressionOp::Plus:
+            os << tabs << "expression plus" << std::endl;
+            break;
+        case BinaryExpressionOp::Minus:
+            os << tabs << "expression minus" << std::endl;
+            break;
+        case BinaryExpressionOp::Multiply:
+            os << tabs << "expression multiply" << std::endl;
+            break;
+        case BinaryExpressionOp::Divide:
+            os << tabs << "expression divide" << std::endl;
+            break;
+        case BinaryExpressionOp::Eq:
+            os << tabs << "expression eq" << std::endl;
+            break;
+        case BinaryExpressionOp::NotEq:
+            os << tabs << "expression not-eq" << std::endl;
+            break;
+        case BinaryExpressionOp::GreatOrEq:
+            os << tabs << "expression great-or-eq" << std::endl;
+            break;
+        case BinaryExpressionOp::Great:
+            os << tabs << "expression great" << std::endl;
+            break;
+        case BinaryExpressionOp::LessOrEq:
+            os << tabs << "expression less-or-eq" << std::endl;
+            break;
+        case BinaryExpressionOp::Less:
+            os << tabs << "expression less" << std::endl;
+            break;
+        default:
+            abort();
+        }
+
+        os << tabs << "   lhs:" << std::endl;
+        nodeDumpList(os, lhs, level + 2 );
+        os << tabs << "   rhs:" << std::endl;
+        nodeDumpList(os, rhs, level + 2 );
+
+        os << "\n";
+        break;
+    }
+    default:
+        abort();
+    }
+}
+
+static void nodeDumpList(std::ostream &os, const Node *node, int level)
+{
+    std::string tabs;
+    for(int i = 0; i < level; ++i)
+        tabs += "    ";
+
+    for(; node; node = node->next)
+        nodeDump(os, tabs, node, level);
+}
+
 extern "C" {
 
 Node *nodeAddIntegerExpression(int value)
@@ -406,6 +669,14 @@ Node *nodeAddForLoop(Node *variableName, Node *list, Node *statement)
     return node;
 }
 
+Node *nodeAddCache(Node *arguments, Node *statement)
+{
+    CacheNode *cacheNode = new CacheNode(arguments, statement);
+    Node *node = new AstNode(AstNode::Cache);
+    node->value.cache = cacheNode;
+    return node;
+}
+
 Node *nodeAddHelper(const char *name, Node *arguments)
 {
     HelperNode *helper = new HelperNode(name, arguments, NULL);
@@ -537,224 +808,223 @@ Node *nodeAddLess(Node *lhs, Node *rhs)
     return node;
 }
 
-void dump(const std::string &tabs, const Node *node, int level)
+void nodePrint2(const Node *node, int level)
 {
-    assert( node != NULL );
+    nodeDumpList(std::cerr, node, level);
+}
 
-    switch(node->type)
-    {
-    case AstNode::IntegerValue:
-        std::cerr << tabs << "integer " << node->value.integer << std::endl;
-        break;
-    case AstNode::StringValue:
-        std::cerr << tabs << "string \"" << *node->value.text << '\"' << std::endl;
-        break;
-    case AstNode::HtmlText:
-        std::cerr << tabs << "html text \"" << *node->value.text << '\"' << std::endl;
-        break;
-    case AstNode::Variable: {
-        std::cerr << tabs << "variable " << node->value.variable->name << std::endl;
+void nodePrint(const char *text, const Node *node)
+{
+    std::cerr << "printNode: " << text << std::endl;
+    nodePrint2(node, 0);
+}
 
-        Node *member = node->value.variable->member;
-        while( member ) {
-            std::cerr << tabs << "    member: " << member->value.variable->name << std::endl;
-            member = member->next;
-        }
+void freeNodes(Node *root)
+{
+    delete root;
+}
 
-        break;
-    }
-    case AstNode::IfCondition:
-        std::cerr << tabs << "if condition: " << std::endl;
-        nodePrint2(node->value.ifCondition->expression, level + 2);
-        std::cerr << tabs << "    statement" << std::endl;
-        nodePrint2(node->value.ifCondition->ifStatement, level + 2);
+}
 
-        if( node->value.ifCondition->elseIfStatement ) {
-            std::cerr << tabs << "    else if statement" << std::endl;
-            nodePrint2(node->value.ifCondition->elseIfStatement, level + 2);
-        }
-        if( node->value.ifCondition->elseStatement ) {
-            std::cerr << tabs << "    else statement" << std::endl;
-            nodePrint2(node->value.ifCondition->elseStatement, level + 2);
-        }
-        std::cerr << tabs << "endif" << std::endl;
-        break;
-    case AstNode::ElseIfCondition:
-        std::cerr << tabs << "else-if condition:" << std::endl;
-        nodePrint2(node->value.elseIfCondition->expression, level + 2);
-        nodePrint2(node->value.elseIfCondition->statement, level + 2);
-        std::cerr <<  "\n";
-        break;
-    case AstNode::UnlessCondition:
-        std::cerr << tabs << "unless condition:" << std::endl;
-        nodePrint2(node->value.unlessCondition->expression, level + 2);
-        std::cerr << tabs << "    statement:" << std::endl;
-        nodePrint2(node->value.unlessCondition->unlessStatement , level + 2);
+static Value helperArgument(const HelperNode *helper, const Node *arg,
+                            const TemplateContext &context);
+static const Node *selectStatement(const Node *node, const TemplateContext &context);
 
-        if( node->value.unlessCondition->elseStatement ) {
-            std::cerr << tabs << "    else statement:" << std::endl;
-            nodePrint2(node->value.unlessCondition->elseStatement, level + 2);
-        }
+// True if the call site is in the taken branches for the current item
+static bool guardsTaken(const HelperNode *helper, const TemplateContext &context)
+{
+    for(size_t i = 0; i < helper->guards.size(); ++i)
+    {
+        const LoopGuard &guard = helper->guards[i];
 
-        std::cerr << "\n";
-        break;
-    case AstNode::ForLoop:
-        std::cerr << tabs << "for loop:" << std::endl;
-        nodePrint2(node->value.forLoop->variable, level + 1);
-        nodePrint2(node->value.forLoop->list, level + 1);
-        nodePrint2(node->value.forLoop->statement , level + 2);
-        std::cerr << "\n";
-        break;
-    case AstNode::Helper:
-        std::cerr << tabs << "helper: " << node->value.helper->name << std::endl;
+        if( selectStatement(guard.condition, context) != guard.statement )
+            return false;
+    }
 
-        if( node->value.helper->arguments ) {
-            std::cerr << tabs << "arguments: " << std::endl;
-            nodePrint2(node->value.helper->arguments, level + 2);
-        }
+    return true;
+}
 
-        if( node->value.helper->member ) {
-            std::cerr << tabs << "members: " << std::endl;
+// Evaluates the arguments of the batch helpers called in the loop body for
+// every item that makes the call and calls each of them once, the call sites
+// pick their result by the loop index. Returns false if the loop has no
+// batch helpers.
+static bool evalBatchHelpers(const ForLoopNode *loop,
+                             const Value &array,
+                             const TemplateContext &context,
+                             BatchResults &results)
+{
+    LoopSlot &slot = context.frame[loop->slot];
+    bool found = false;
 
-            const Node *member = node->value.helper->member;
-            while( member ) {
-                std::cerr << tabs << "    member: " << member->value.helper->name << std::endl;
-                member = member->next;
-            }
-        }
+    for(size_t i = 0; i < loop->helpers.size(); ++i)
+    {
+        const HelperNode *helper = loop->helpers[i];
 
-        std::cerr << "\n";
-        break;
-    case AstNode::ObjectMember:
-        std::cerr << tabs << "object member: " << node->value.objectMember->name << std::endl;
-        nodePrint2( node->value.objectMember->value, level + 2 );
-        std::cerr << "\n";
-        break;
-    case AstNode::Object:
-        if( node->value.object->members ) {
-            std::cerr << tabs << "object: " << std::endl;
-            nodePrint2( node->value.object->members, level + 1 );
-        }
-        else {
-            std::cerr << tabs << "object: empty" << std::endl;
-        }
-        std::cerr << "\n";
-        break;
-    case AstNode::BinaryExpression: {
-        const AstNode *lhs = node->value.binaryExpr->lhs;
-        const AstNode *rhs = node->value.binaryExpr->lhs;
+        if( !helper->entry->batchHelper || helper->batchable == false )
+            continue;
 
-        switch( node->value.binaryExpr->operation )
+        if( found == false )
         {
-        case BinaryExpressionOp::Plus:
-            std::cerr << tabs << "expression plus" << std::endl;
-            break;
-        case BinaryExpressionOp::Minus:
-            std::cerr << tabs << "expression minus" << std::endl;
-            break;
-        case BinaryExpressionOp::Multiply:
-            std::cerr << tabs << "expression multiply" << std::endl;
-            break;
-        case BinaryExpressionOp::Divide:
-            std::cerr << tabs << "expression divide" << std::endl;
-            break;
-        case BinaryExpressionOp::Eq:
-            std::cerr << tabs << "expression eq" << std::endl;
-            break;
-        case BinaryExpressionOp::NotEq:
-            std::cerr << tabs << "expression not-eq" << std::endl;
-            break;
-        case BinaryExpressionOp::GreatOrEq:
-            std::cerr << tabs << "expression great-or-eq" << std::endl;
-            break;
-        case BinaryExpressionOp::Great:
-            std::cerr << tabs << "expression great" << std::endl;
-            break;
-        case BinaryExpressionOp::LessOrEq:
-            std::cerr << tabs << "expression less-or-eq" << std::endl;
-            break;
-        case BinaryExpressionOp::Less:
-            std::cerr << tabs << "expression less" << std::endl;
-            break;
-        default:
-            abort();
+            results.resize(loop->helpers.size());
+            found = true;
         }
 
-        std::cerr << tabs << "   lhs:" << std::endl;
-        nodePrint2( lhs, level + 2 );
-        std::cerr << tabs << "   rhs:" << std::endl;
-        nodePrint2( rhs, level + 2 );
+        std::vector<Value> values;
+        std::vector<HelperArgs> calls;
+        std::vector<size_t> rows;   // items making the call
+        Value::ValueIterator it(array);
 
-        std::cerr << "\n";
-        break;
-    }
-    default:
-        abort();
-    }
-}
+        values.reserve(slot.count * helper->argumentsCount);
+        rows.reserve(slot.count);
 
-void nodePrint2(const Node *node, int level)
-{
-    std::string tabs;
-    for(int i = 0; i < level; ++i)
-        tabs += "    ";
+        for(slot.index = 0; it.hasNext(); ++slot.index)
+        {
+            slot.item = &it.next();
 
-    dump(tabs, node, level);
+            // an @if around the call may skip it, and its arguments may call helpers
+            if( guardsTaken(helper, context) == false )
+                continue;
 
-    while(node->next) {
-        dump(tabs, node->next, level);
-        node = node->next;
-    }
-}
+            rows.push_back(slot.index);
 
-void nodePrint(const char *text, const Node *node)
-{
-    std::cerr << "printNode: " << text << std::endl;
-    nodePrint2(node, 0);
-}
+            for(const Node *arg = helper->arguments; arg; arg = arg->next)
+                values.push_back( helperArgument(helper, arg, context) );
+        }
 
-void freeNodes(Node *root)
-{
-    delete root;
-}
+        if( rows.empty() )
+            continue;
 
-}
+        calls.reserve(rows.size());
 
-static std::string evalForArray(const std::string &varName,
-                               const Node *statement,
-                               const Value &array,
-                               const TemplateContext &context)
-{
-    std::string result;
-    Value newContext = Value(Value::ObjectTag());
+        for(size_t call = 0; call < rows.size(); ++call)
+            calls.push_back( HelperArgs(values.empty() ? NULL : &values[call * helper->argumentsCount],
+                                        helper->argumentsCount) );
 
-    newContext["parentContext"] = context.context;
+        std::vector<Value> returned;
 
-    Value::ValueIterator it(array);
+        helper->entry->batchHelper(context.context, calls, returned);
+        returned.resize(rows.size());
+        results[i].resize(slot.count);
 
-    while(it.hasNext())
-    {
-        newContext[varName] = it.next();
-        TemplateContext ctx = {context.templ, newContext, context.caller};
-        result += nodeTraverse(statement, ctx);
+        for(size_t call = 0; call < rows.size(); ++call)
+            results[i][rows[call]] = returned[call];
     }
 
-    return result;
+    return found;
 }
 
-Value findVariable(const Value &context, const std::string &name)
+static void evalForArray(const ForLoopNode *loop,
+                         const Value &array,
+                         const TemplateContext &context,
+                         std::string &out)
+{
+    LoopSlot &slot = context.frame[loop->slot];
+
+    assert( loop->slot == context.depth );
+
+    slot.name = loop->variable->value.text;
+    slot.scope = Value(Value::Null);
+    slot.index = 0;
+    slot.count = array.size();
+    slot.batch = NULL;
+
+    // batch helpers need the arguments of all the items before the first one
+    if( array.type() == Value::Generator && loop->helpers.empty() == false )
+    {
+        for(size_t i = 0; i < loop->helpers.size(); ++i)
+        {
+            if( loop->helpers[i]->entry->batchHelper )
+            {
+                evalForArray(loop, array.materialize(), context, out);
+                return;
+            }
+        }
+    }
+
+    TemplateContext ctx = {context.templ, context.context, context.caller,
+                           context.frame, context.depth + 1,
+                           context.engine, context.helperCache,
+                           context.output, context.pending};
+    BatchResults batch;
+
+    if( loop->helpers.empty() == false && evalBatchHelpers(loop, array, ctx, batch) )
+        slot.batch = &batch;
+
+    Value::ValueIterator it(array);
+    const bool generated = array.type() == Value::Generator;
+
+    for(slot.index = 0; it.hasNext(); ++slot.index)
+    {
+        slot.item = &it.next();
+
+        // the end of a generator is known one item ahead
+        if( generated )
+            slot.count = slot.index + (it.hasNext() ? 2 : 1);
+
+        nodeTraverse(loop->statement, ctx, out);
+    }
+
+    slot.batch = NULL;
+}
+
+// Helpers still expect the loop variables as members of their context, so
+// build the old-style scope objects lazily, only when a helper is called.
+static Value scopeContext(const TemplateContext &context)
+{
+    Value parent = context.context;
+
+    for(int i = 0; i < context.depth; ++i)
+    {
+        LoopSlot &slot = context.frame[i];
+
+        if( slot.scope.isNull() )
+        {
+            slot.scope = Value(Value::ObjectTag());
+            slot.scope["parentContext"] = parent;
+        }
+
+        slot.scope[*slot.name] = *slot.item;
+        parent = slot.scope;
+    }
+
+    return parent;
+}
+
+// Async helpers run on while the loops go on and change the scopes above,
+// they get scope objects of their own with the current loop variables.
+static Value detachedScopeContext(const TemplateContext &context)
+{
+    Value parent = context.context;
+
+    for(int i = 0; i < context.depth; ++i)
+    {
+        const LoopSlot &slot = context.frame[i];
+        Value scope(Value::Object);
+
+        scope["parentContext"] = parent;
+        scope[*slot.name] = *slot.item;
+        parent = scope;
+    }
+
+    return parent;
+}
+
+Value findVariable(const Value &context, const std::string &name)
 {
     assert(name.empty() == false );
 
-    if( context.hasMember(name) )
+    Value result;
+
+    if( context.findMember(name, result) )
     {
-        return context.member(name);
+        return result.resolve();
     }
-    else if( context.hasMember("parentContext") )
+    else if( context.findMember("parentContext", result) )
     {
-        return findVariable(context.member("parentContext"), name);
+        return findVariable(result, name);
     }
-    else if( context.type() == Value::Array || context.type() == Value::Object )
+    else if( context.type() == Value::Array || context.type() == Value::Object
+             || context.type() == Value::UserType )
     {
         switch(name[0]) {
         case 'l':
@@ -780,212 +1050,1563 @@ Value findVariable(const Value &context, const std::string &name)
     return Value();
 }
 
-// TODO Value обойдется дорого, надо что-нибудь придумать!
-static Value nodeEval(const Node *node, const TemplateContext &context)
+// Lazy values are resolved on every step, a loop item or a global may be one
+static Value memberValue(Value value, const Node *member)
 {
-    switch(node->type)
-    {
-    case AstNode::IntegerValue:
-        return Value(node->value.integer);
-        break;
-    case AstNode::StringValue:
-        return Value(*node->value.text);
-        break;
-    case AstNode::HtmlText:
-        return Value(*node->value.text);
-        break;
-    case AstNode::Variable: {
-        Value value = findVariable(context.context, *node->value.text);
-        const Node *member = node->value.variable->member;
+    value = value.resolve();
 
-        while( member && value.isNull() == false ) {
-            value = findVariable(value, *member->value.text);
-            member = member->value.variable->member;
-        }
+    while( member && value.isNull() == false ) {
+        value = findVariable(value, *member->value.text);
+        member = member->value.variable->member;
+    }
 
-        if(value.type() == Value::String)
-            value = escapeHtml(value.toString());
+    return value;
+}
 
-        return value;
-        break;
+// Unboxed bool, int64 or double operand of an expression, so arithmetic and
+// comparisons in loops do not allocate a Value per intermediate result
+struct Scalar {
+    enum Type {
+        Null,
+        Bool,
+        Int,
+        Double
+    };
+
+    Scalar() : type(Null) { data.i = 0; }
+    explicit Scalar(bool b) : type(Bool) { data.b = b; }
+    explicit Scalar(int64_t i) : type(Int) { data.i = i; }
+    explicit Scalar(double d) : type(Double) { data.d = d; }
+
+    bool isNumeric() const {
+        return type == Int || type == Double;
     }
-    case AstNode::IfCondition: {
-        Value value = nodeEval(node->value.ifCondition->expression, context);
 
-        if( value.toBool() )
-        {
-            return nodeTraverse( node->value.ifCondition->ifStatement, context );
-        }
-        else if( node->value.ifCondition->elseIfStatement )
-        {
-            const Node *elseIfNode = node->value.ifCondition->elseIfStatement;
+    bool toBool() const;
+    int64_t toInt() const;
+    double toDouble() const;
+    Value box() const;
 
-            while( elseIfNode )
-            {
-                assert( elseIfNode->type == AstNode::ElseIfCondition );
-                Value value = nodeEval(elseIfNode->value.elseIfCondition->expression, context);
+    Type type;
+    union {
+        bool b;
+        int64_t i;
+        double d;
+    } data;
+};
 
-                if( value.toBool() )
-                    return nodeTraverse( elseIfNode->value.elseIfCondition->statement, context );
-                else
-                    elseIfNode = elseIfNode->next;
-            }
-        }
+bool Scalar::toBool() const
+{
+    switch(type)
+    {
+    case Bool:
+        return data.b;
+    case Int:
+        return data.i != 0;
+    case Double:
+        return static_cast<int64_t>(data.d) != 0; // as Value::toBool()
+    default:
+        return false;
+    }
+}
 
-        if( node->value.ifCondition->elseStatement )
-            return nodeTraverse( node->value.ifCondition->elseStatement, context );
-        else
-            return Value();
+int64_t Scalar::toInt() const
+{
+    switch(type)
+    {
+    case Bool:
+        return data.b;
+    case Int:
+        return data.i;
+    case Double:
+        return static_cast<int64_t>(data.d);
+    default:
+        return 0;
+    }
+}
 
-        break;
+double Scalar::toDouble() const
+{
+    switch(type)
+    {
+    case Bool:
+        return data.b;
+    case Int:
+        return static_cast<double>(data.i);
+    case Double:
+        return data.d;
+    default:
+        return 0;
     }
-    case AstNode::UnlessCondition: {
-        Value value = nodeEval(node->value.unlessCondition->expression, context);
+}
 
-        if( value.toBool() == false )
-            return nodeTraverse(node->value.unlessCondition->unlessStatement, context);
-        else if( node->value.unlessCondition->elseStatement )
-            return nodeTraverse(node->value.unlessCondition->elseStatement, context);
-        else
-            return Value();
-        break;
+Value Scalar::box() const
+{
+    switch(type)
+    {
+    case Bool:
+        return Value(data.b);
+    case Int:
+        return Value(data.i);
+    case Double:
+        return Value(data.d);
+    default:
+        return Value();
     }
-    case AstNode::ForLoop: {
-        assert( node->value.forLoop->variable->type == AstNode::StringValue );
+}
 
-        Value list = nodeEval(node->value.forLoop->list, context);
-        const Node *statement = node->value.forLoop->statement;
-        const std::string varName = *node->value.forLoop->variable->value.text;
+static bool toScalar(const Value &value, Scalar &scalar)
+{
+    switch(value.type())
+    {
+    case Value::Null:
+        scalar = Scalar();
+        return true;
+    case Value::Bool:
+        scalar = Scalar(value.toBool());
+        return true;
+    case Value::Int:
+        scalar = Scalar(value.toInt64());
+        return true;
+    case Value::Double:
+        scalar = Scalar(value.toDouble());
+        return true;
+    default:
+        return false;
+    }
+}
 
-        if( list.type() == Value::Array || list.type() == Value::Object )
-            return evalForArray(varName, statement, list, context);
+static bool scalarEqual(const Scalar &lhs, const Scalar &rhs)
+{
+    switch(lhs.type)
+    {
+    case Scalar::Null:
+        return rhs.type == Scalar::Null;
+    case Scalar::Bool:
+        return rhs.type == Scalar::Bool && lhs.data.b == rhs.data.b;
+    case Scalar::Int:
+        if( rhs.type == Scalar::Int )
+            return lhs.data.i == rhs.data.i;
+        else if( rhs.type == Scalar::Double )
+            return Value::equalNumbers(lhs.data.i, rhs.data.d);
         else
-            return Value();
-
-        break;
+            return false;
+    case Scalar::Double:
+        if( rhs.type == Scalar::Double )
+            return lhs.data.d == rhs.data.d;
+        else if( rhs.type == Scalar::Int )
+            return Value::equalNumbers(rhs.data.i, lhs.data.d);
+        else
+            return false;
+    default:
+        return false;
     }
-    case AstNode::Helper: {
-        const std::string &name = node->value.helper->name;
-        const Node *argsNode = node->value.helper->arguments;
-        Value args = Value(Value::ArrayTag());
+}
 
-        {
-            const Node *examine = argsNode;
-            while(examine) {
-                args.append( nodeEval(examine, context) );
-                examine = examine->next;
-            }
-        }
+// Same rules as operator > for Values: null is less than anything
+static bool scalarGreat(const Scalar &lhs, const Scalar &rhs)
+{
+    if( lhs.type == Scalar::Null )
+        return rhs.type != Scalar::Null;
 
+    if( rhs.type == Scalar::Null )
+        return true;
 
-        const TemplateEngine &engine = context.caller.engine();
-        Value result = engine.callHelper(name, context.context, args );
-        const Node *member = node->value.helper->member;
+    switch(lhs.type)
+    {
+    case Scalar::Bool:
+        return lhs.data.b > rhs.toBool();
+    case Scalar::Int:
+        if( rhs.type == Scalar::Double )
+            return lhs.data.i > rhs.data.d;
+        else
+            return lhs.data.i > rhs.toInt();
+    default:
+        return lhs.data.d > rhs.toDouble();
+    }
+}
 
-        while( member )
-        {
-            result = findVariable(result, *member->value.text);
-            member = member->value.variable->member;
-        }
+static bool scalarLess(const Scalar &lhs, const Scalar &rhs)
+{
+    if( lhs.type == Scalar::Null )
+        return rhs.type == Scalar::Null;
 
-        return result;
+    if( rhs.type == Scalar::Null )
+        return false;
 
-        break;
+    switch(lhs.type)
+    {
+    case Scalar::Bool:
+        return lhs.data.b < rhs.toBool();
+    case Scalar::Int:
+        if( rhs.type == Scalar::Double )
+            return lhs.data.i < rhs.data.d;
+        else
+            return lhs.data.i < rhs.toInt();
+    default:
+        return lhs.data.d < rhs.toDouble();
     }
-    case AstNode::Object: {
-        Value obj(Value::Object);
-        const Node *member = node->value.object->members;
+}
 
-        while( member ) {
-            obj[member->value.objectMember->name.c_str()] = nodeEval(member->value.objectMember->value, context);
-            member = member->next;
-        }
+static Scalar scalarArithmetic(BinaryExpressionOp::Operation operation,
+                               const Scalar &lhs, const Scalar &rhs)
+{
+    if( lhs.isNumeric() == false || rhs.isNumeric() == false )
+        return Scalar();
 
-        return obj;
-        break;
-    }
-    case AstNode::BinaryExpression: {
-        const Value &lhs = nodeEval(node->value.binaryExpr->lhs, context);
-        const Value &rhs = nodeEval(node->value.binaryExpr->rhs, context);
+    if( lhs.type == Scalar::Int && rhs.type == Scalar::Int )
+    {
+        const int64_t l = lhs.data.i;
+        const int64_t r = rhs.data.i;
 
-        switch( node->value.binaryExpr->operation )
+        switch( operation )
         {
         case BinaryExpressionOp::Plus:
-            return lhs + rhs;
-            break;
+            return Scalar(l + r);
         case BinaryExpressionOp::Minus:
-            return lhs - rhs;
-            break;
+            return Scalar(l - r);
         case BinaryExpressionOp::Multiply:
-            return lhs * rhs;
-            break;
-        case BinaryExpressionOp::Divide:
-            return lhs / rhs;
-            break;
-        case BinaryExpressionOp::Eq:
-            return lhs == rhs;
-            break;
-        case BinaryExpressionOp::NotEq:
-            return lhs != rhs;
-            break;
-        case BinaryExpressionOp::GreatOrEq:
-            return lhs >= rhs;
-            break;
-        case BinaryExpressionOp::Great:
-            return lhs > rhs;
-            break;
-        case BinaryExpressionOp::LessOrEq:
-            return lhs <= rhs;
-            break;
-        case BinaryExpressionOp::Less:
-            return lhs < rhs;
-            break;
+            return Scalar(l * r);
         default:
-            std::cerr << "invalid expression type: " << node->value.binaryExpr->operation
-                      << std::endl;
+            if( r == 0 )
+                return Scalar(); // divide by zero!
+            else
+                return Scalar(l / r);
+        }
+    }
+    else
+    {
+        const double l = lhs.toDouble();
+        const double r = rhs.toDouble();
 
-            abort();
+        switch( operation )
+        {
+        case BinaryExpressionOp::Plus:
+            return Scalar(l + r);
+        case BinaryExpressionOp::Minus:
+            return Scalar(l - r);
+        case BinaryExpressionOp::Multiply:
+            return Scalar(l * r);
+        default:
+            if( r == 0 )
+                return Scalar(); // divide by zero!
+            else
+                return Scalar(l / r);
         }
-        break;
     }
+}
+
+static Scalar scalarOperation(BinaryExpressionOp::Operation operation,
+                              const Scalar &lhs, const Scalar &rhs)
+{
+    switch( operation )
+    {
+    case BinaryExpressionOp::Plus:
+    case BinaryExpressionOp::Minus:
+    case BinaryExpressionOp::Multiply:
+    case BinaryExpressionOp::Divide:
+        return scalarArithmetic(operation, lhs, rhs);
+    case BinaryExpressionOp::Eq:
+        return Scalar(scalarEqual(lhs, rhs));
+    case BinaryExpressionOp::NotEq:
+        return Scalar(!scalarEqual(lhs, rhs));
+    case BinaryExpressionOp::GreatOrEq:
+        return Scalar(!scalarLess(lhs, rhs));
+    case BinaryExpressionOp::Great:
+        return Scalar(scalarGreat(lhs, rhs));
+    case BinaryExpressionOp::LessOrEq:
+        return Scalar(!scalarGreat(lhs, rhs));
+    case BinaryExpressionOp::Less:
+        return Scalar(scalarLess(lhs, rhs));
     default:
-        break;
+        std::cerr << "invalid expression type: " << operation << std::endl;
+        abort();
     }
-
-    std::cerr << "invalid nodeType: " << node->type << std::endl;
-    abort();
-    return Value();
 }
 
-static std::string nodeTraverse(const Node *node, const TemplateContext &context)
+static Scalar loopMetaScalar(const VariableNode *variable, const TemplateContext &context)
 {
-    std::string result = nodeEval(node, context).toString();
+    const LoopSlot &slot = context.frame[variable->slot];
 
-    while( node->next )
+    switch(variable->meta)
     {
-        result += nodeEval(node->next, context).toString();
-        node = node->next;
+    case VariableNode::LoopIndex:
+        return Scalar(static_cast<int64_t>(slot.index));
+    case VariableNode::LoopFirst:
+        return Scalar(slot.index == 0);
+    case VariableNode::LoopLast:
+        return Scalar(slot.index + 1 == slot.count);
+    case VariableNode::LoopSize:
+        return Scalar(static_cast<int64_t>(slot.count));
+    default:
+        return Scalar();
     }
+}
 
-    return result;
+static Value loopMetaValue(const VariableNode *variable, const TemplateContext &context)
+{
+    return loopMetaScalar(variable, context).box();
 }
 
-std::string traverserTreeNodes(const Node *node, const TemplateContext &context)
+// Value of the variable without html escaping
+static Value variableValue(const VariableNode *variable, const TemplateContext &context)
 {
-    if( node )
-        return nodeTraverse(node, context);
+    if( variable->meta != VariableNode::NoMeta )
+        return loopMetaValue(variable, context);
+
+    Value value;
+
+    if( variable->slot >= 0 )
+        value = *context.frame[variable->slot].item;
+    else if( variable->slot == VariableNode::GlobalSlot )
+        value = variable->global;
+    else
+        value = findVariable(context.context, variable->name);
+
+    return memberValue(value, variable->member);
+}
+
+static bool evalOperand(const Node *node, const TemplateContext &context,
+                        Scalar &scalar, Value &value);
+
+static bool nodeTest(const Node *node, const TemplateContext &context)
+{
+    Scalar scalar;
+    Value value;
+
+    if( evalOperand(node, context, scalar, value) )
+        return scalar.toBool();
     else
-        return std::string();
+        return value.toBool();
+}
+
+static const Node *selectStatement(const Node *node, const TemplateContext &context)
+{
+    if( node->type == AstNode::UnlessCondition )
+    {
+        if( nodeTest(node->value.unlessCondition->expression, context) == false )
+            return node->value.unlessCondition->unlessStatement;
+        else
+            return node->value.unlessCondition->elseStatement;
+    }
+
+    assert( node->type == AstNode::IfCondition );
+
+    if( nodeTest(node->value.ifCondition->expression, context) )
+        return node->value.ifCondition->ifStatement;
+
+    const Node *elseIfNode = node->value.ifCondition->elseIfStatement;
+
+    while( elseIfNode )
+    {
+        assert( elseIfNode->type == AstNode::ElseIfCondition );
+
+        if( nodeTest(elseIfNode->value.elseIfCondition->expression, context) )
+            return elseIfNode->value.elseIfCondition->statement;
+        else
+            elseIfNode = elseIfNode->next;
+    }
+
+    return node->value.ifCondition->elseStatement;
+}
+
+static Value binaryOperation(BinaryExpressionOp::Operation operation,
+                             const Value &lhs, const Value &rhs)
+{
+    Scalar l, r;
+
+    if( toScalar(lhs, l) && toScalar(rhs, r) )
+        return scalarOperation(operation, l, r).box();
+
+    switch( operation )
+    {
+    case BinaryExpressionOp::Plus:
+        return lhs + rhs;
+    case BinaryExpressionOp::Minus:
+        return lhs - rhs;
+    case BinaryExpressionOp::Multiply:
+        return lhs * rhs;
+    case BinaryExpressionOp::Divide:
+        return lhs / rhs;
+    case BinaryExpressionOp::Eq:
+        return lhs == rhs;
+    case BinaryExpressionOp::NotEq:
+        return lhs != rhs;
+    case BinaryExpressionOp::GreatOrEq:
+        return lhs >= rhs;
+    case BinaryExpressionOp::Great:
+        return lhs > rhs;
+    case BinaryExpressionOp::LessOrEq:
+        return lhs <= rhs;
+    case BinaryExpressionOp::Less:
+        return lhs < rhs;
+    default:
+        std::cerr << "invalid expression type: " << operation << std::endl;
+        abort();
+    }
+}
+
+static bool evalBinary(const BinaryExpressionOp *expr, const TemplateContext &context,
+                       Scalar &scalar, Value &value);
+
+// Evaluates the expression unboxed if it is a number, bool or null (returns true),
+// otherwise stores the value
+static bool evalOperand(const Node *node, const TemplateContext &context,
+                        Scalar &scalar, Value &value)
+{
+    switch(node->type)
+    {
+    case AstNode::IntegerValue:
+        scalar = Scalar(static_cast<int64_t>(node->value.integer));
+        return true;
+    case AstNode::Constant:
+        if( toScalar(*node->value.constant, scalar) )
+            return true;
+
+        value = *node->value.constant;
+        return false;
+    case AstNode::Variable: {
+        const VariableNode *variable = node->value.variable;
+
+        if( variable->meta != VariableNode::NoMeta )
+        {
+            scalar = loopMetaScalar(variable, context);
+            return true;
+        }
+
+        value = variableValue(variable, context);
+
+        if( toScalar(value, scalar) )
+            return true;
+
+        if( value.type() == Value::String )
+        {
+            std::string escaped;
+            value.appendString(escaped, escapeHtml);
+            value = escaped;
+        }
+
+        return false;
+    }
+    case AstNode::BinaryExpression:
+        return evalBinary(node->value.binaryExpr, context, scalar, value);
+    default:
+        value = nodeEval(node, context);
+        return toScalar(value, scalar);
+    }
 }
 
-static std::string escapeHtml(const std::string &s)
+static bool evalBinary(const BinaryExpressionOp *expr, const TemplateContext &context,
+                       Scalar &scalar, Value &value)
 {
-    std::string result = s;
+    Scalar l, r;
+    Value lhs, rhs;
+    const bool isScalarLhs = evalOperand(expr->lhs, context, l, lhs);
+    const bool isScalarRhs = evalOperand(expr->rhs, context, r, rhs);
 
-    boost::replace_all( result, "&", "&amp;" );
-    boost::replace_all( result, ">", "&gt;" );
-    boost::replace_all( result, "<", "&lt;" );
-    boost::replace_all( result, "\"", "&quot;" );
+    if( isScalarLhs && isScalarRhs )
+    {
+        scalar = scalarOperation(expr->operation, l, r);
+        return true;
+    }
+
+    // strings, arrays and objects go the boxed way
+    if( isScalarLhs )
+        lhs = l.box();
+    if( isScalarRhs )
+        rhs = r.box();
+
+    value = binaryOperation(expr->operation, lhs, rhs);
+    return toScalar(value, scalar);
+}
+
+static void writeValue(std::string &out, const Value &value);
+
+static void writeScalar(std::string &out, const Scalar &scalar)
+{
+    switch(scalar.type)
+    {
+    case Scalar::Bool:
+        out += scalar.data.b ? "true" : "false";
+        break;
+    case Scalar::Int:
+        appendInteger(out, scalar.data.i);
+        break;
+    case Scalar::Double: {
+        char buf[32];
+        int size = snprintf(buf, sizeof(buf), "%g", scalar.data.d); // as std::ostream does
+        out.append(buf, size);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Helper arguments, evaluated into a buffer on the stack unless there are
+// too many of them
+class ArgumentList {
+public:
+    explicit ArgumentList(size_t capacity)
+        : buffer(capacity > InplaceSize ? static_cast<Value *>(operator new(capacity * sizeof(Value)))
+                                        : reinterpret_cast<Value *>(inplace.bytes)),
+          capacity(capacity), size(0)
+    {}
+
+    ~ArgumentList()
+    {
+        for(size_t i = 0; i < size; ++i)
+            buffer[i].~Value();
+
+        if( capacity > InplaceSize )
+            operator delete(buffer);
+    }
+
+    void append(const Value &value)
+    {
+        assert( size < capacity );
+        new (buffer + size++) Value(value);
+    }
+
+    HelperArgs values() const
+    {
+        return HelperArgs(buffer, size);
+    }
+
+private:
+    ArgumentList(const ArgumentList &);
+    ArgumentList &operator = (const ArgumentList &);
+
+    enum { InplaceSize = 8 };
+
+    union {
+        char bytes[InplaceSize * sizeof(Value)];
+        void *align;
+    } inplace;
+
+    Value *buffer;
+    const size_t capacity;
+    size_t size;
+};
+
+// TODO Value обойдется дорого, надо что-нибудь придумать!
+// as nodeEval(), but strings of variables are not html escaped: keys of
+// @cache blocks, arguments of helpers writing their own escapes
+static Value rawEval(const Node *node, const TemplateContext &context)
+{
+    if( node->type == AstNode::Variable )
+        return variableValue(node->value.variable, context);
+    else
+        return nodeEval(node, context);
+}
+
+static Value helperArgument(const HelperNode *helper, const Node *arg,
+                            const TemplateContext &context)
+{
+    return helper->entry->rawArguments ? rawEval(arg, context) : nodeEval(arg, context);
+}
+
+static Value nodeEval(const Node *node, const TemplateContext &context)
+{
+    switch(node->type)
+    {
+    case AstNode::IntegerValue:
+        return Value(node->value.integer);
+        break;
+    case AstNode::StringValue:
+        return Value(*node->value.text);
+        break;
+    case AstNode::HtmlText:
+        return Value(*node->value.text);
+        break;
+    case AstNode::Constant:
+        return *node->value.constant;
+        break;
+    case AstNode::Variable: {
+        Value value = variableValue(node->value.variable, context);
+
+        if(value.type() == Value::String)
+        {
+            std::string escaped;
+            value.appendString(escaped, escapeHtml);
+            value = escaped;
+        }
+
+        return value;
+        break;
+    }
+    case AstNode::IfCondition:
+    case AstNode::UnlessCondition: {
+        const Node *statement = selectStatement(node, context);
+
+        if( statement )
+        {
+            std::string result;
+            nodeTraverse( statement, context, result );
+            return result;
+        }
+        else
+        {
+            return Value();
+        }
+
+        break;
+    }
+    case AstNode::ForLoop:
+    case AstNode::Cache: {
+        std::string result;
+        nodeWrite(node, context, result);
+        return result;
+        break;
+    }
+    case AstNode::Helper: {
+        const HelperNode *helper = node->value.helper;
+        const LoopSlot *loop = helper->loopSlot >= 0 ? &context.frame[helper->loopSlot] : NULL;
+        Value result;
+
+        if( loop && loop->batch && (*loop->batch)[helper->loopCall].empty() == false )
+        {
+            // called in a batch before the loop
+            result = (*loop->batch)[helper->loopCall][loop->index];
+        }
+        else
+        {
+            ArgumentList args(helper->argumentsCount);
+
+            for(const Node *arg = helper->arguments; arg; arg = arg->next)
+                args.append( helperArgument(helper, arg, context) );
+
+            const HelperEntry &entry = *helper->entry;
+
+            // pure helpers do not look at the context, no need to build the loop scope
+            result = context.engine.callHelper(entry,
+                                               context.depth && entry.pure == false
+                                                    ? scopeContext(context) : context.context,
+                                               args.values(), &context.helperCache);
+        }
+
+        const Node *member = helper->member;
+
+        while( member )
+        {
+            result = findVariable(result, *member->value.text);
+            member = member->value.variable->member;
+        }
+
+        return result;
+
+        break;
+    }
+    case AstNode::Object: {
+        Value obj(Value::Object);
+        const Node *member = node->value.object->members;
+
+        while( member ) {
+            obj[member->value.objectMember->name.c_str()] = nodeEval(member->value.objectMember->value, context);
+            member = member->next;
+        }
+
+        return obj;
+        break;
+    }
+    case AstNode::BinaryExpression: {
+        Scalar scalar;
+        Value value;
+
+        if( evalBinary(node->value.binaryExpr, context, scalar, value) )
+            return scalar.box();
+        else
+            return value;
+        break;
+    }
+    default:
+        break;
+    }
+
+    std::cerr << "invalid nodeType: " << node->type << std::endl;
+    abort();
+    return Value();
+}
+
+static void appendInteger(std::string &out, int64_t value)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *ptr = end;
+    uint64_t abs = value < 0 ? -static_cast<uint64_t>(value) : value;
+
+    do {
+        *--ptr = '0' + abs % 10;
+        abs /= 10;
+    } while( abs );
+
+    if( value < 0 )
+        *--ptr = '-';
+
+    out.append(ptr, end);
+}
+
+static void nodeWrite(const Node *node, const TemplateContext &context, std::string &out)
+{
+    switch(node->type)
+    {
+    case AstNode::HtmlText:
+        out += *node->value.text;
+        break;
+    case AstNode::Variable: {
+        const VariableNode *variable = node->value.variable;
+
+        if( variable->meta == VariableNode::LoopIndex )
+        {
+            appendInteger(out, context.frame[variable->slot].index);
+        }
+        else if( variable->slot >= 0 && variable->meta == VariableNode::NoMeta
+                 && variable->member && variable->member->value.variable->member == NULL
+                 && context.frame[variable->slot].item->writeMember(*variable->member->value.text,
+                                                                    out, escapeHtml) )
+        {
+            // a field of the loop item written by its type, a table cell
+        }
+        else
+        {
+            const Value &value = variableValue(variable, context);
+
+            // strings are read in place, they may be large views or ropes
+            if( value.type() == Value::String )
+                value.appendString(out, escapeHtml);
+            else
+                writeValue(out, value);
+        }
+        break;
+    }
+    case AstNode::IfCondition:
+    case AstNode::UnlessCondition: {
+        const Node *statement = selectStatement(node, context);
+
+        if( statement )
+            nodeTraverse(statement, context, out);
+        break;
+    }
+    case AstNode::BinaryExpression: {
+        Scalar scalar;
+        Value value;
+
+        if( evalBinary(node->value.binaryExpr, context, scalar, value) )
+            writeScalar(out, scalar);
+        else
+            writeValue(out, value);
+        break;
+    }
+    case AstNode::ForLoop: {
+        assert( node->value.forLoop->variable->type == AstNode::StringValue );
+
+        const Value &list = nodeEval(node->value.forLoop->list, context);
+
+        if( list.type() == Value::Array || list.type() == Value::Object
+                || list.type() == Value::Generator || list.type() == Value::UserType )
+            evalForArray(node->value.forLoop, list, context, out);
+        break;
+    }
+    case AstNode::Cache: {
+        const CacheNode *cache = node->value.cache;
+        const Node *ttlNode = cache->arguments ? cache->arguments->next : NULL;
+        const std::string key = cache->arguments ? rawEval(cache->arguments, context).toString()
+                                                 : std::string();
+        FragmentCache &fragments = context.engine.fragments;
+
+        if( fragments.find(key, cache->block, out) )
+            break;
+
+        const size_t begin = out.size();
+        const size_t pending = context.pending.size();
+
+        nodeTraverse(cache->statement, context, out);
+
+        // results of async helpers are not in the output yet
+        if( context.pending.size() == pending )
+        {
+            const int64_t ttl = ttlNode ? nodeEval(ttlNode, context).toInt64() : 0;
+            fragments.insert(key, cache->block, out.substr(begin), ttl > 0 ? ttl : 0);
+        }
+        break;
+    }
+    case AstNode::Helper: {
+        const HelperNode *helper = node->value.helper;
+
+        if( helper->entry->asyncHelper && &out == context.output )
+        {
+            // issue the call and go on, the result is spliced in when the render is finished
+            ArgumentList args(helper->argumentsCount);
+
+            for(const Node *arg = helper->arguments; arg; arg = arg->next)
+                args.append( helperArgument(helper, arg, context) );
+
+            PendingOutput part = {out.size(),
+                                  helper->entry->asyncHelper(context.depth
+                                                                 ? detachedScopeContext(context)
+                                                                 : context.context,
+                                                             args.values()),
+                                  helper->member};
+            context.pending.push_back(part);
+        }
+        else if( helper->entry->writer && helper->member == NULL )
+        {
+            ArgumentList args(helper->argumentsCount);
+
+            for(const Node *arg = helper->arguments; arg; arg = arg->next)
+                args.append( helperArgument(helper, arg, context) );
+
+            helper->entry->writer(out, args.values());
+        }
+        else
+        {
+            writeValue(out, nodeEval(node, context));
+        }
+        break;
+    }
+    default:
+        writeValue(out, nodeEval(node, context));
+        break;
+    }
+}
+
+// Helper results and expressions are written without html escaping
+static void writeValue(std::string &out, const Value &value)
+{
+    Scalar scalar;
+
+    if( toScalar(value, scalar) )
+        writeScalar(out, scalar);
+    else if( value.type() == Value::String || value.type() == Value::UnsafeString )
+        value.appendString(out);
+    else if( value.type() == Value::Lazy )
+        writeValue(out, value.resolve());
+    // arrays, objects, generators and user types have no text
+}
+
+static void nodeTraverse(const Node *node, const TemplateContext &context, std::string &out)
+{
+    for(; node; node = node->next)
+        nodeWrite(node, context, out);
+}
+
+struct CompileState {
+    std::vector<const std::string *> scope;
+    size_t frameSize;
+    TemplateEngineImpl &engine;
+    std::set<std::string> &names;
+    std::set<const HelperEntry *> &helpers;
+    std::string templateId;     // identifies the template among the cached fragments
+    size_t cacheBlocks;
+};
+
+static void nodeCompile(Node *node, CompileState &state)
+{
+    for(; node; node = node->next)
+    {
+        switch(node->type)
+        {
+        case AstNode::Variable: {
+            VariableNode *variable = node->value.variable;
+
+            const std::vector<const std::string *> &scope = state.scope;
+
+            variable->slot = VariableNode::RootSlot;
+            variable->meta = VariableNode::NoMeta;
+
+            for(size_t i = scope.size(); i > 0; --i)
+            {
+                if( *scope[i - 1] == variable->name )
+                {
+                    variable->slot = i - 1;
+                    break;
+                }
+            }
+
+            // loop.index, first, last and size inside a loop are its meta,
+            // other members of loop are looked up as usual
+            if( variable->slot < 0 && variable->name == "loop"
+                    && scope.empty() == false && variable->member )
+            {
+                const std::string &name = variable->member->value.variable->name;
+
+                if( name == "index" )
+                    variable->meta = VariableNode::LoopIndex;
+                else if( name == "first" )
+                    variable->meta = VariableNode::LoopFirst;
+                else if( name == "last" )
+                    variable->meta = VariableNode::LoopLast;
+                else if( name == "size" )
+                    variable->meta = VariableNode::LoopSize;
+
+                if( variable->meta != VariableNode::NoMeta )
+                    variable->slot = scope.size() - 1;
+            }
+
+            if( variable->slot < 0 )
+            {
+                state.names.insert(variable->name);
+
+                const Value &globals = state.engine.globals;
+
+                if( variable->meta == VariableNode::NoMeta && globals.hasMember(variable->name) )
+                {
+                    variable->slot = VariableNode::GlobalSlot;
+                    variable->global = globals.member(variable->name);
+                }
+            }
+            break;
+        }
+        case AstNode::IfCondition:
+            nodeCompile(node->value.ifCondition->expression, state);
+            nodeCompile(node->value.ifCondition->ifStatement, state);
+            nodeCompile(node->value.ifCondition->elseIfStatement, state);
+            nodeCompile(node->value.ifCondition->elseStatement, state);
+            break;
+        case AstNode::ElseIfCondition:
+            nodeCompile(node->value.elseIfCondition->expression, state);
+            nodeCompile(node->value.elseIfCondition->statement, state);
+            break;
+        case AstNode::UnlessCondition:
+            nodeCompile(node->value.unlessCondition->expression, state);
+            nodeCompile(node->value.unlessCondition->unlessStatement, state);
+            nodeCompile(node->value.unlessCondition->elseStatement, state);
+            break;
+        case AstNode::ForLoop: {
+            ForLoopNode *loop = node->value.forLoop;
+
+            // the list is evaluated in the enclosing scope
+            nodeCompile(loop->list, state);
+
+            loop->slot = state.scope.size();
+            state.scope.push_back(loop->variable->value.text);
+            state.frameSize = std::max(state.frameSize, state.scope.size());
+
+            nodeCompile(loop->statement, state);
+            state.scope.pop_back();
+            break;
+        }
+        case AstNode::Helper: {
+            HelperNode *helper = node->value.helper;
+
+            helper->entry = state.engine.bindHelper(helper->name);
+            state.helpers.insert(helper->entry.get());
+            helper->argumentsCount = 0;
+
+            for(const Node *arg = helper->arguments; arg; arg = arg->next)
+                ++helper->argumentsCount;
+
+            // members of the helper result are names, not variables
+            nodeCompile(helper->arguments, state);
+            break;
+        }
+        case AstNode::Cache: {
+            CacheNode *cache = node->value.cache;
+            std::ostringstream block;
+
+            block << state.templateId << ':' << state.cacheBlocks++;
+            cache->block = block.str();
+
+            nodeCompile(cache->arguments, state);
+            nodeCompile(cache->statement, state);
+            break;
+        }
+        case AstNode::Object:
+            nodeCompile(node->value.object->members, state);
+            break;
+        case AstNode::ObjectMember:
+            nodeCompile(node->value.objectMember->value, state);
+            break;
+        case AstNode::BinaryExpression:
+            nodeCompile(node->value.binaryExpr->lhs, state);
+            nodeCompile(node->value.binaryExpr->rhs, state);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+size_t compileTreeNodes(Node *node, const std::string &templ,
+                        TemplateEngineImpl &engine, std::set<std::string> &names,
+                        std::set<const HelperEntry *> &helpers, size_t &cacheBlocks)
+{
+    std::ostringstream templateId;
+
+    // a template compiled again for a changed global renders other fragments
+    templateId << std::hex << boost::hash<std::string>()(templ) << '-' << templ.size()
+               << '-' << engine.globalsRevision;
+
+    CompileState state = {std::vector<const std::string *>(), 0, engine, names, helpers,
+                          templateId.str(), 0};
+
+    nodeCompile(node, state);
+    cacheBlocks = state.cacheBlocks;
+
+    return state.frameSize;
+}
+
+static Node *makeConstant(const Value &value)
+{
+    Node *node = new AstNode(AstNode::Constant);
+    node->value.constant = new Value(value);
+    return node;
+}
+
+static void freeNode(Node *node)
+{
+    if( node )
+    {
+        node->next = NULL;
+        delete node;
+    }
+}
+
+static bool isConstant(const Node *node)
+{
+    return node && node->type == AstNode::Constant;
+}
+
+static Node *optimizeStatements(Node *node);
+
+// Expression position: the result is a single node, the sibling link of
+// the original node is kept by the caller.
+static Node *optimizeExpression(Node *node)
+{
+    if( node == NULL )
+        return NULL;
+
+    switch(node->type)
+    {
+    case AstNode::IntegerValue: {
+        Node *result = makeConstant(Value(node->value.integer));
+        freeNode(node);
+        return result;
+    }
+    case AstNode::StringValue: {
+        Node *result = makeConstant(Value(*node->value.text));
+        freeNode(node);
+        return result;
+    }
+    case AstNode::Variable: {
+        const VariableNode *variable = node->value.variable;
+
+        if( variable->slot != VariableNode::GlobalSlot )
+            return node;
+
+        Value value = memberValue(variable->global, variable->member);
+
+        if( value.type() == Value::String )
+        {
+            std::string escaped;
+            value.appendString(escaped, escapeHtml);
+            value = escaped;
+        }
+
+        freeNode(node);
+        return makeConstant(value);
+    }
+    case AstNode::BinaryExpression: {
+        BinaryExpressionOp *expr = node->value.binaryExpr;
+
+        expr->lhs = optimizeExpression(expr->lhs);
+        expr->rhs = optimizeExpression(expr->rhs);
+
+        if( isConstant(expr->lhs) && isConstant(expr->rhs) )
+        {
+            Node *result = makeConstant(binaryOperation(expr->operation,
+                                                        *expr->lhs->value.constant,
+                                                        *expr->rhs->value.constant));
+            freeNode(node);
+            return result;
+        }
+
+        return node;
+    }
+    case AstNode::Object: {
+        bool constant = true;
+
+        for(Node *member = node->value.object->members; member; member = member->next)
+        {
+            ObjectMemberNode *objectMember = member->value.objectMember;
+
+            objectMember->value = optimizeExpression(objectMember->value);
+            constant = constant && isConstant(objectMember->value);
+        }
+
+        // the object is built once and shared by every render
+        if( constant )
+        {
+            Value obj(Value::Object);
+
+            for(Node *member = node->value.object->members; member; member = member->next)
+                obj[member->value.objectMember->name] = *member->value.objectMember->value->value.constant;
+
+            // helpers may get it at the same time, none of them may change it
+            obj.freeze();
+            freeNode(node);
+            return makeConstant(obj);
+        }
+
+        return node;
+    }
+    case AstNode::Helper: {
+        Node **arg = &node->value.helper->arguments;
+
+        while( *arg )
+        {
+            Node *next = (*arg)->next;
+
+            (*arg)->next = NULL;
+            *arg = optimizeExpression(*arg);
+            (*arg)->next = next;
+            arg = &(*arg)->next;
+        }
+
+        return node;
+    }
+    case AstNode::IfCondition: {
+        // inline "condition ? lhs : rhs", evaluates to the text of the branch
+        IfConditionNode *cond = node->value.ifCondition;
+
+        cond->expression = optimizeExpression(cond->expression);
+        cond->ifStatement = optimizeExpression(cond->ifStatement);
+        cond->elseStatement = optimizeExpression(cond->elseStatement);
+
+        if( isConstant(cond->expression) )
+        {
+            Node *branch = cond->expression->value.constant->toBool()
+                    ? cond->ifStatement : cond->elseStatement;
+
+            if( branch == NULL )
+            {
+                freeNode(node);
+                return makeConstant(Value());
+            }
+            else if( isConstant(branch) )
+            {
+                Node *result = makeConstant(branch->value.constant->toString());
+                freeNode(node);
+                return result;
+            }
+        }
+
+        return node;
+    }
+    default:
+        return node;
+    }
+}
+
+// Removes a constant condition, returns the statements that are always taken
+static Node *resolveCondition(Node *node)
+{
+    if( node->type == AstNode::UnlessCondition )
+    {
+        UnlessConditionNode *cond = node->value.unlessCondition;
+
+        if( isConstant(cond->expression) == false )
+            return node;
+
+        Node *result = NULL;
+
+        if( cond->expression->value.constant->toBool() == false )
+            std::swap(result, cond->unlessStatement);
+        else
+            std::swap(result, cond->elseStatement);
+
+        freeNode(node);
+        return result;
+    }
+
+    IfConditionNode *cond = node->value.ifCondition;
+
+    // else-if branches that can never be taken are dropped, the first one
+    // that is always taken becomes the else branch
+    for(Node **elseIf = &cond->elseIfStatement; *elseIf; )
+    {
+        ElseIfConditionNode *elseIfCond = (*elseIf)->value.elseIfCondition;
+
+        if( isConstant(elseIfCond->expression) == false )
+        {
+            elseIf = &(*elseIf)->next;
+        }
+        else if( elseIfCond->expression->value.constant->toBool() == false )
+        {
+            Node *dead = *elseIf;
+            *elseIf = dead->next;
+            freeNode(dead);
+        }
+        else
+        {
+            Node *taken = *elseIf;
+
+            delete cond->elseStatement;
+            cond->elseStatement = elseIfCond->statement;
+            elseIfCond->statement = NULL;
+            *elseIf = NULL;
+            delete taken;
+        }
+    }
+
+    while( isConstant(cond->expression) )
+    {
+        Node *result = NULL;
+
+        if( cond->expression->value.constant->toBool() )
+        {
+            std::swap(result, cond->ifStatement);
+        }
+        else if( cond->elseIfStatement )
+        {
+            // the first else-if becomes the condition
+            Node *elseIf = cond->elseIfStatement;
+            ElseIfConditionNode *elseIfCond = elseIf->value.elseIfCondition;
+
+            delete cond->expression;
+            delete cond->ifStatement;
+            cond->expression = elseIfCond->expression;
+            cond->ifStatement = elseIfCond->statement;
+            cond->elseIfStatement = elseIf->next;
+
+            elseIfCond->expression = NULL;
+            elseIfCond->statement = NULL;
+            freeNode(elseIf);
+            continue;
+        }
+        else
+        {
+            std::swap(result, cond->elseStatement);
+        }
+
+        freeNode(node);
+        return result;
+    }
+
+    return node;
+}
+
+// Statement position: the result is a list of nodes or NULL
+static Node *optimizeStatement(Node *node)
+{
+    switch(node->type)
+    {
+    case AstNode::HtmlText:
+        return node;
+    case AstNode::IfCondition: {
+        IfConditionNode *cond = node->value.ifCondition;
+
+        cond->expression = optimizeExpression(cond->expression);
+        cond->ifStatement = optimizeStatements(cond->ifStatement);
+        cond->elseStatement = optimizeStatements(cond->elseStatement);
+
+        for(Node *elseIf = cond->elseIfStatement; elseIf; elseIf = elseIf->next)
+        {
+            ElseIfConditionNode *elseIfCond = elseIf->value.elseIfCondition;
+
+            elseIfCond->expression = optimizeExpression(elseIfCond->expression);
+            elseIfCond->statement = optimizeStatements(elseIfCond->statement);
+        }
+
+        return resolveCondition(node);
+    }
+    case AstNode::UnlessCondition: {
+        UnlessConditionNode *cond = node->value.unlessCondition;
+
+        cond->expression = optimizeExpression(cond->expression);
+        cond->unlessStatement = optimizeStatements(cond->unlessStatement);
+        cond->elseStatement = optimizeStatements(cond->elseStatement);
+
+        return resolveCondition(node);
+    }
+    case AstNode::ForLoop:
+        node->value.forLoop->list = optimizeExpression(node->value.forLoop->list);
+        node->value.forLoop->statement = optimizeStatements(node->value.forLoop->statement);
+        return node;
+    case AstNode::Cache: {
+        CacheNode *cache = node->value.cache;
+        Node **arg = &cache->arguments;
+
+        while( *arg )
+        {
+            Node *next = (*arg)->next;
+
+            (*arg)->next = NULL;
+            *arg = optimizeExpression(*arg);
+            (*arg)->next = next;
+            arg = &(*arg)->next;
+        }
+
+        cache->statement = optimizeStatements(cache->statement);
+
+        // nothing to save for plain text
+        if( cache->statement == NULL
+                || (cache->statement->type == AstNode::HtmlText && cache->statement->next == NULL) )
+        {
+            Node *result = cache->statement ? cache->statement : nodeAddHtmlText("");
+
+            cache->statement = NULL;
+            freeNode(node);
+            return result;
+        }
+
+        return node;
+    }
+    default: {
+        Node *result = optimizeExpression(node);
+
+        // constant output is plain text
+        if( isConstant(result) )
+        {
+            Node *text = nodeAddHtmlText(result->value.constant->toString().c_str());
+            freeNode(result);
+            return text;
+        }
+
+        return result;
+    }
+    }
+}
+
+static Node *optimizeStatements(Node *node)
+{
+    Node *head = NULL;
+    Node **tail = &head;
+
+    while( node )
+    {
+        Node *next = node->next;
+
+        node->next = NULL;
+        *tail = optimizeStatement(node);
+
+        while( *tail )
+            tail = &(*tail)->next;
+
+        node = next;
+    }
+
+    // merge adjacent text into one segment
+    for(Node **examine = &head; *examine; )
+    {
+        Node *text = *examine;
+
+        if( text->type != AstNode::HtmlText )
+        {
+            examine = &text->next;
+            continue;
+        }
+
+        while( text->next && text->next->type == AstNode::HtmlText )
+        {
+            Node *next = text->next;
+
+            *text->value.text += *next->value.text;
+            text->next = next->next;
+            freeNode(next);
+        }
+
+        if( text->value.text->empty() )
+        {
+            *examine = text->next;
+            freeNode(text);
+        }
+        else
+        {
+            examine = &text->next;
+        }
+    }
+
+    return head;
+}
+
+static void nodeCollectLoopHelpers(Node *node, ForLoopNode *loop,
+                                   std::vector<LoopGuard> &guards, bool batchable);
+
+static void nodeCollectBranch(const Node *condition, Node *statement, ForLoopNode *loop,
+                              std::vector<LoopGuard> &guards, bool batchable)
+{
+    if( statement == NULL )
+        return;
+
+    const LoopGuard guard = {condition, statement};
+
+    guards.push_back(guard);
+    nodeCollectLoopHelpers(statement, loop, guards, batchable);
+    guards.pop_back();
+}
+
+// Call sites are known only after the optimizer has dropped dead branches.
+// Batch calls in a branch are made only for the items that take it, the
+// branch is chosen once more for every item before the loop, so the call
+// sites under conditions calling helpers are not batched.
+static void nodeCollectLoopHelpers(Node *node, ForLoopNode *loop,
+                                   std::vector<LoopGuard> &guards, bool batchable)
+{
+    for(; node; node = node->next)
+    {
+        switch(node->type)
+        {
+        case AstNode::IfCondition: {
+            IfConditionNode *condition = node->value.ifCondition;
+            const size_t calls = loop ? loop->helpers.size() : 0;
+
+            nodeCollectLoopHelpers(condition->expression, loop, guards, batchable);
+
+            // tested only when the conditions before are false
+            for(Node *elseIf = condition->elseIfStatement; elseIf; elseIf = elseIf->next)
+                nodeCollectLoopHelpers(elseIf->value.elseIfCondition->expression, loop, guards, false);
+
+            const bool guarded = batchable && (loop == NULL || loop->helpers.size() == calls);
+
+            nodeCollectBranch(node, condition->ifStatement, loop, guards, guarded);
+
+            for(Node *elseIf = condition->elseIfStatement; elseIf; elseIf = elseIf->next)
+                nodeCollectBranch(node, elseIf->value.elseIfCondition->statement, loop, guards, guarded);
+
+            nodeCollectBranch(node, condition->elseStatement, loop, guards, guarded);
+            break;
+        }
+        case AstNode::UnlessCondition: {
+            UnlessConditionNode *condition = node->value.unlessCondition;
+            const size_t calls = loop ? loop->helpers.size() : 0;
+
+            nodeCollectLoopHelpers(condition->expression, loop, guards, batchable);
+
+            const bool guarded = batchable && (loop == NULL || loop->helpers.size() == calls);
+
+            nodeCollectBranch(node, condition->unlessStatement, loop, guards, guarded);
+            nodeCollectBranch(node, condition->elseStatement, loop, guards, guarded);
+            break;
+        }
+        case AstNode::ForLoop: {
+            ForLoopNode *inner = node->value.forLoop;
+
+            // the inner loop is batched when it is run, under its guards
+            std::vector<LoopGuard> innerGuards;
+
+            nodeCollectLoopHelpers(inner->list, loop, guards, batchable);
+            inner->helpers.clear();
+            nodeCollectLoopHelpers(inner->statement, inner, innerGuards, true);
+            break;
+        }
+        case AstNode::Helper: {
+            HelperNode *helper = node->value.helper;
+
+            if( loop )
+            {
+                helper->loopSlot = loop->slot;
+                helper->loopCall = loop->helpers.size();
+                helper->guards = guards;
+                helper->batchable = batchable;
+                loop->helpers.push_back(helper);
+            }
+            else
+            {
+                helper->loopSlot = -1;
+            }
+
+            nodeCollectLoopHelpers(helper->arguments, loop, guards, batchable);
+            break;
+        }
+        case AstNode::Cache:
+            nodeCollectLoopHelpers(node->value.cache->arguments, loop, guards, batchable);
+            nodeCollectLoopHelpers(node->value.cache->statement, loop, guards, batchable);
+            break;
+        case AstNode::Object:
+            nodeCollectLoopHelpers(node->value.object->members, loop, guards, batchable);
+            break;
+        case AstNode::ObjectMember:
+            nodeCollectLoopHelpers(node->value.objectMember->value, loop, guards, batchable);
+            break;
+        case AstNode::BinaryExpression:
+            nodeCollectLoopHelpers(node->value.binaryExpr->lhs, loop, guards, batchable);
+            nodeCollectLoopHelpers(node->value.binaryExpr->rhs, loop, guards, batchable);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+Node *optimizeTreeNodes(Node *node)
+{
+    node = optimizeStatements(node);
+
+    if( node == NULL )
+        node = nodeAddHtmlText("");
+
+    std::vector<LoopGuard> guards;
+    nodeCollectLoopHelpers(node, NULL, guards, true);
+
+    return node;
+}
+
+std::string dumpTreeNodes(const Node *node)
+{
+    std::ostringstream os;
+    nodeDumpList(os, node, 0);
+    return os.str();
+}
+
+std::string traverserTreeNodes(const Node *node, const TemplateContext &context)
+{
+    std::string result;
+    TemplateContext ctx = {context.templ, context.context, context.caller,
+                           context.frame, context.depth,
+                           context.engine, context.helperCache,
+                           &result, context.pending};
+
+    if( node )
+        nodeTraverse(node, ctx, result);
+
+    if( ctx.pending.empty() )
+        return result;
+
+    // all the async calls are issued, wait for them in order
+    std::string spliced;
+    size_t offset = 0;
+
+    spliced.reserve(result.size());
+
+    for(size_t i = 0; i < ctx.pending.size(); ++i)
+    {
+        const PendingOutput &part = ctx.pending[i];
+
+        spliced.append(result, offset, part.offset - offset);
+        writeValue(spliced, memberValue(part.result.get(), part.member));
+        offset = part.offset;
+    }
+
+    spliced.append(result, offset, std::string::npos);
+    ctx.pending.clear();
+
+    return spliced;
+}
+
+static void escapeHtml(std::string &out, const char *s, size_t size)
+{
+    const char *ptr = s;
+    const char *end = ptr + size;
+    const char *plain = ptr;
+
+    for(; ptr != end; ++ptr)
+    {
+        const char *entity;
+
+        switch(*ptr)
+        {
+        case '&': entity = "&amp;"; break;
+        case '>': entity = "&gt;"; break;
+        case '<': entity = "&lt;"; break;
+        case '"': entity = "&quot;"; break;
+        default: continue;
+        }
+
+        out.append(plain, ptr);
+        out += entity;
+        plain = ptr + 1;
+    }
 
-    return result;
+    out.append(plain, end);
 }
@@ -31,6 +31,7 @@ Node *nodeAddIfElseIfElseCondition(Node *expression, Node *ifStatement, Node *el
 Node *nodeAddUnlessCondition(Node *expression, Node *statement);
 Node *nodeAddUnlessElseCondition(Node *expression, Node *unlessStatement, Node *elseStatement);
 Node *nodeAddForLoop(Node *variableName, Node *list, Node *statement);
+Node *nodeAddCache(Node *arguments, Node *statement);
 Node *nodeAddHelper(const char *name, Node *arguments);
 Node *nodeAddHelperMembers(Node *helper, Node *member);
 Node *nodeAddQuotedHelper(const char *name, Node *arguments, Node *member);
@@ -58,8 +59,24 @@ void freeNodes(Node *root);
 #ifdef __cplusplus
 }
 
-class TemplateContext;
+#include <set>
 
+struct TemplateContext;
+
+namespace cpptl {
+    class TemplateEngineImpl;
+    struct HelperEntry;
+} // namespace cpptl
+
+// Resolves variables to loop frame slots and engine globals, binds helpers,
+// collects the names looked up in the root context, the helpers called and
+// the number of @cache blocks, returns the frame size needed to render
+size_t compileTreeNodes(Node *node, const std::string &templ,
+                        cpptl::TemplateEngineImpl &engine, std::set<std::string> &names,
+                        std::set<const cpptl::HelperEntry *> &helpers, size_t &cacheBlocks);
+// Merges text, folds constants and drops constant branches, returns the new root
+Node *optimizeTreeNodes(Node *node);
+std::string dumpTreeNodes(const Node *node);
 std::string traverserTreeNodes(const Node *node, const TemplateContext &context);
 #endif
 
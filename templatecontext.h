@@ -7,16 +7,53 @@
 #define CPPTL_TEMPLATECONTEXT_H
 
 #include <string>
+#include <vector>
+#include <boost/thread/future.hpp>
+
+#include "value.h"
 
 namespace cpptl {
-    class Value;
     class Template;
+    class TemplateEngineImpl;
+    class HelperCache;
 } // namespace cpptl
 
+struct AstNode;
+
+// Result of an async helper written to the output, spliced in at the offset
+// when the render is finished
+struct PendingOutput {
+    size_t offset;
+    boost::shared_future<cpptl::Value> result;
+    const AstNode *member;  // members of the result to write
+};
+
+// Results of the batch helpers of a loop by call site and loop index
+typedef std::vector< std::vector<cpptl::Value> > BatchResults;
+
+// One slot per nesting level of @for loops, the slot index of each loop
+// and loop variable is resolved when the template is compiled.
+struct LoopSlot {
+    LoopSlot() : name(0), item(0), index(0), count(0), scope(cpptl::Value::Null), batch(0) {}
+
+    const std::string *name;
+    const cpptl::Value *item;
+    size_t index;           // loop.index, loop.first and loop.last come from here
+    size_t count;
+    cpptl::Value scope;     // context object for helpers, built on demand
+    const BatchResults *batch;
+};
+
 struct TemplateContext {
     const std::string &templ;
     const cpptl::Value &context;
     const cpptl::Template &caller;
+    LoopSlot *frame;
+    int depth;
+    cpptl::TemplateEngineImpl &engine;
+    cpptl::HelperCache &helperCache;    // results of pure helpers within the render
+    const std::string *output;          // the render buffer, async results are deferred only there
+    std::vector<PendingOutput> &pending;
 };
 
 #endif // CPPTL_TEMPLATECONTEXT_H
@@ -4,27 +4,171 @@
  */
 
 #include <map>
+#include <set>
+#include <vector>
 #include <fstream>
 #include <boost/bind.hpp>
 
 #include "templateengine.h"
+#include "templateengineimpl.h"
 #include "buildinhelpers.h"
 
 namespace cpptl {
 
-class TemplateEngineImpl {
-public:
+const Value &HelperArgs::operator[] (size_t index) const
+{
+    static const Value null;
+
+    if( index < count )
+        return values[index];
+    else
+        return null;
+}
+
+Value HelperArgs::toArray() const
+{
+    Value result(Value::Array);
+
+    for(size_t i = 0; i < count; ++i)
+        result.append(values[i]);
+
+    return result;
+}
+
+Value HelperEntry::call(const Value &context, const HelperArgs &args) const
+{
+    if( argsHelper )
+    {
+        return argsHelper(context, args);
+    }
+    else if( helper )
+    {
+        return helper(context, args.toArray());
+    }
+    else if( batchHelper )
+    {
+        std::vector<HelperArgs> calls(1, args);
+        std::vector<Value> results;
+
+        batchHelper(context, calls, results);
+        return results.empty() ? Value() : results.front();
+    }
+    else if( asyncHelper )
+    {
+        return asyncHelper(context, args).get();
+    }
+    else
+    {
+        std::cerr << "helper \"" << name << "\" not found" << std::endl;
+        return std::string();
+    }
+}
+
+TemplateEngineImpl::TemplateEngineImpl()
+    : helperCacheSize(0), fragments(16 * 1024 * 1024), templateIds(0),
+      globals(Value::ObjectTag()), globalsRevision(0)
+{
+}
+
+Value TemplateEngineImpl::callHelper(const HelperEntry &helper, const Value &context,
+                                     const HelperArgs &args, HelperCache *renderCache)
+{
+    if( helper.pure == false || HelperCache::isCacheable(args) == false )
+        return helper.call(context, args);
+
+    Value result;
+
+    if( renderCache && renderCache->find(&helper, args, result) )
+    {
+        boost::mutex::scoped_lock lock(helperCacheMutex);
+
+        ++helperCacheStats.hits;
+        return result;
+    }
+
+    bool cached;
 
-    std::map<std::string, TemplateEngine::Helper> helpers;
-    std::map<std::string, Template> cache;
-};
+    {
+        boost::mutex::scoped_lock lock(helperCacheMutex);
+
+        cached = helperCacheSize && helperCache.find(&helper, args, result);
+
+        if( cached )
+            ++helperCacheStats.hits;
+        else
+            ++helperCacheStats.misses;
+    }
+
+    if( cached == false )
+    {
+        // not under the lock, helpers may be slow or render templates
+        result = helper.call(context, args);
+
+        boost::mutex::scoped_lock lock(helperCacheMutex);
+
+        if( helperCacheSize )
+            helperCache.insert(&helper, args, result);
+    }
+
+    if( renderCache )
+        renderCache->insert(&helper, args, result);
+
+    return result;
+}
+
+void TemplateEngineImpl::clearHelperCache()
+{
+    boost::mutex::scoped_lock lock(helperCacheMutex);
+
+    helperCache.clear();
+}
+
+HelperEntryPtr TemplateEngineImpl::bindHelper(const std::string &name)
+{
+    HelperEntryPtr &entry = helpers[name];
+
+    if( !entry )
+        entry.reset(new HelperEntry(name));
+
+    return entry;
+}
+
+bool TemplateEngineImpl::globalsChanged(const std::set<std::string> &names,
+                                        unsigned int revision) const
+{
+    std::set<std::string>::const_iterator it = names.begin();
+    std::set<std::string>::const_iterator end = names.end();
+
+    for(; it != end; ++it)
+    {
+        std::map<std::string, unsigned int>::const_iterator changed = globalRevisions.find(*it);
+
+        if( changed != globalRevisions.end() && changed->second > revision )
+            return true;
+    }
+
+    return false;
+}
 
 TemplateEngine::TemplateEngine()
 {
     pimpl.reset(new TemplateEngineImpl);
 
-    registerHelper("include", boost::bind(include, boost::ref(*this), _1, _2));
-    registerHelper("rawHtml", rawHtml);
+    registerArgsHelper("include", boost::bind(include, boost::ref(*this), _1, _2));
+    registerArgsHelper("rawHtml", rawHtml, true);
+    registerArgsHelper("union", unionHelper, true);
+    registerArgsHelper("intersection", intersectionHelper, true);
+    registerArgsHelper("difference", differenceHelper, true);
+    registerArgsHelper("unique", uniqueHelper, true);
+    registerArgsHelper("sum", sumHelper, true);
+    registerArgsHelper("avg", avgHelper, true);
+    registerArgsHelper("min", minHelper, true);
+    registerArgsHelper("max", maxHelper, true);
+    registerArgsHelper("count", countHelper, true);
+    registerArgsHelper("json", jsonHelper);
+    // json escapes the strings for a script itself
+    pimpl->bindHelper("json")->writer = writeJsonHelper;
+    pimpl->bindHelper("json")->rawArguments = true;
 }
 
 TemplateEngine::~TemplateEngine()
@@ -72,21 +216,204 @@ Template TemplateEngine::templFile(const std::string &fileName)
 
 bool TemplateEngine::hasHelper(const std::string &name)
 {
-    return pimpl->helpers.find(name) != pimpl->helpers.end();
+    std::map<std::string, HelperEntryPtr>::const_iterator it = pimpl->helpers.find(name);
+
+    return it != pimpl->helpers.end() && it->second->isRegistered();
+}
+
+void TemplateEngine::registerHelper(const std::string &name, const Helper &handler, bool pure)
+{
+    HelperEntryPtr entry = pimpl->bindHelper(name);
+
+    entry->helper = handler;
+    entry->argsHelper.clear();
+    entry->batchHelper.clear();
+    entry->asyncHelper.clear();
+    entry->pure = pure;
+    entry->writer = NULL;
+    entry->rawArguments = false;
+
+    // results of the previous helper are stale
+    pimpl->clearHelperCache();
+    pimpl->renders.clear();
+}
+
+void TemplateEngine::registerArgsHelper(const std::string &name, const ArgsHelper &handler, bool pure)
+{
+    HelperEntryPtr entry = pimpl->bindHelper(name);
+
+    entry->helper.clear();
+    entry->argsHelper = handler;
+    entry->batchHelper.clear();
+    entry->asyncHelper.clear();
+    entry->pure = pure;
+    entry->writer = NULL;
+    entry->rawArguments = false;
+
+    pimpl->clearHelperCache();
+    pimpl->renders.clear();
+}
+
+void TemplateEngine::registerBatchHelper(const std::string &name, const BatchHelper &handler)
+{
+    HelperEntryPtr entry = pimpl->bindHelper(name);
+
+    entry->helper.clear();
+    entry->argsHelper.clear();
+    entry->batchHelper = handler;
+    entry->asyncHelper.clear();
+    entry->pure = false;
+    entry->writer = NULL;
+    entry->rawArguments = false;
+
+    pimpl->clearHelperCache();
+    pimpl->renders.clear();
+}
+
+void TemplateEngine::registerAsyncHelper(const std::string &name, const AsyncHelper &handler)
+{
+    HelperEntryPtr entry = pimpl->bindHelper(name);
+
+    entry->helper.clear();
+    entry->argsHelper.clear();
+    entry->batchHelper.clear();
+    entry->asyncHelper = handler;
+    entry->pure = false;
+    entry->writer = NULL;
+    entry->rawArguments = false;
+
+    pimpl->clearHelperCache();
+    pimpl->renders.clear();
+}
+
+void TemplateEngine::setHelperCacheSize(size_t size)
+{
+    boost::mutex::scoped_lock lock(pimpl->helperCacheMutex);
+
+    pimpl->helperCacheSize = size;
+    pimpl->helperCache.setCapacity(size);
+
+    if( size == 0 )
+        pimpl->helperCache.clear();
+}
+
+HelperCacheStats TemplateEngine::helperCacheStats() const
+{
+    boost::mutex::scoped_lock lock(pimpl->helperCacheMutex);
+    HelperCacheStats stats = pimpl->helperCacheStats;
+
+    stats.size = pimpl->helperCache.size();
+    return stats;
+}
+
+void TemplateEngine::resetHelperCacheStats()
+{
+    boost::mutex::scoped_lock lock(pimpl->helperCacheMutex);
+
+    pimpl->helperCacheStats = HelperCacheStats();
+}
+
+void TemplateEngine::setFragmentCacheSize(size_t bytes)
+{
+    pimpl->fragments.setMaxBytes(bytes);
+}
+
+void TemplateEngine::invalidateFragments(const std::string &key)
+{
+    pimpl->fragments.invalidate(key);
+    // renders could have the fragments in them
+    pimpl->renders.clear();
+}
+
+void TemplateEngine::clearFragmentCache()
+{
+    pimpl->fragments.clear();
+    pimpl->renders.clear();
+}
+
+FragmentCacheStats TemplateEngine::fragmentCacheStats() const
+{
+    return pimpl->fragments.stats();
+}
+
+void TemplateEngine::resetFragmentCacheStats()
+{
+    pimpl->fragments.resetStats();
+}
+
+void TemplateEngine::setRenderCacheSize(size_t size)
+{
+    pimpl->renders.setCapacity(size);
+}
+
+void TemplateEngine::clearRenderCache()
+{
+    pimpl->renders.clear();
 }
 
-void TemplateEngine::registerHelper(const std::string &name, const Helper &handler)
+RenderCacheStats TemplateEngine::renderCacheStats() const
 {
-    pimpl->helpers[name] = handler;
+    return pimpl->renders.stats();
+}
+
+void TemplateEngine::resetRenderCacheStats()
+{
+    pimpl->renders.resetStats();
+}
+
+void TemplateEngine::setGlobal(const std::string &name, const Value &value)
+{
+    // compiled templates keep the value as a constant, it is read by renders
+    // at the same time; the caller may go on changing its own value
+    Value frozen = value.clone();
+    frozen.freeze();
+
+    boost::mutex::scoped_lock lock(pimpl->globalsMutex);
+
+    pimpl->globals[name] = frozen;
+    pimpl->globalRevisions[name] = ++pimpl->globalsRevision;
+}
+
+bool TemplateEngine::hasGlobal(const std::string &name) const
+{
+    boost::mutex::scoped_lock lock(pimpl->globalsMutex);
+
+    return pimpl->globals.hasMember(name);
+}
+
+Value TemplateEngine::global(const std::string &name) const
+{
+    boost::mutex::scoped_lock lock(pimpl->globalsMutex);
+
+    return pimpl->globals.member(name);
 }
 
 Value TemplateEngine::callHelper(const std::string &name, const Value &context, const Value &args) const
 {
-    std::map<std::string, TemplateEngine::Helper>::iterator it = pimpl->helpers.find(name);
+    std::map<std::string, HelperEntryPtr>::const_iterator it = pimpl->helpers.find(name);
+
+    if( it != pimpl->helpers.end() && it->second->helper && it->second->pure == false )
+    {
+        return it->second->helper(context, args);
+    }
+    else
+    {
+        std::vector<Value> values;
+
+        for(size_t i = 0; i < args.size(); ++i)
+            values.push_back(args[i]);
+
+        return callHelper(name, context, HelperArgs(values.empty() ? NULL : &values[0], values.size()));
+    }
+}
+
+Value TemplateEngine::callHelper(const std::string &name, const Value &context, const HelperArgs &args) const
+{
+    std::map<std::string, HelperEntryPtr>::const_iterator it = pimpl->helpers.find(name);
 
     if( it != pimpl->helpers.end() )
     {
-        return it->second(context, args);
+        return pimpl->callHelper(*it->second, context, args, NULL);
     }
     else
     {
@@ -6,7 +6,9 @@
 #ifndef CPPTL_TEMPLATEENGINE_H
 #define CPPTL_TEMPLATEENGINE_H
 
+#include <vector>
 #include <boost/function.hpp>
+#include <boost/thread/future.hpp>
 #include <boost/scoped_ptr.hpp>
 
 #include "template.h"
@@ -16,9 +18,62 @@ namespace cpptl {
 
 class TemplateEngineImpl;
 
+/* Helper arguments: a view of the values evaluated by the template,
+ * valid only during the helper call */
+class HelperArgs {
+public:
+    HelperArgs(const Value *values, size_t count)
+        : values(values), count(count)
+    {}
+
+    size_t size() const { return count; }
+    bool isEmpty() const { return count == 0; }
+
+    const Value *begin() const { return values; }
+    const Value *end() const { return values + count; }
+
+    /* null for an index out of range */
+    const Value &operator[] (size_t index) const;
+
+    Value toArray() const;
+
+private:
+    const Value *values;
+    size_t count;
+};
+
+struct HelperCacheStats {
+    HelperCacheStats() : hits(0), misses(0), size(0) {}
+
+    size_t hits;    // pure helper calls answered from a cache
+    size_t misses;  // pure helper calls that ran the helper
+    size_t size;    // results kept in the engine cache
+};
+
+struct FragmentCacheStats {
+    FragmentCacheStats() : hits(0), misses(0), bytes(0), fragments(0) {}
+
+    size_t hits;
+    size_t misses;
+    size_t bytes;       // size of the cached output
+    size_t fragments;
+};
+
+struct RenderCacheStats {
+    RenderCacheStats() : hits(0), misses(0), size(0) {}
+
+    size_t hits;
+    size_t misses;
+    size_t size;    // renders kept
+};
+
 class TemplateEngine {
 public:
     typedef boost::function<Value(const Value &, const Value &)> Helper;
+    typedef boost::function<Value(const Value &, const HelperArgs &)> ArgsHelper;
+    typedef boost::function<void(const Value &, const std::vector<HelperArgs> &,
+                                 std::vector<Value> &)> BatchHelper;
+    typedef boost::function<boost::shared_future<Value>(const Value &, const HelperArgs &)> AsyncHelper;
 
     TemplateEngine();
     ~TemplateEngine();
@@ -28,10 +83,66 @@ public:
 
     bool hasHelper(const std::string &name);
 
-    void registerHelper(const std::string &name, const Helper &helper);
+    /* A pure helper depends on its arguments only (not on the context), so its
+     * results are reused within a render and, if the engine cache is enabled,
+     * between renders. */
+    void registerHelper(const std::string &name, const Helper &helper, bool pure = false);
     Value callHelper(const std::string &name, const Value &context, const Value &args) const;
 
+    /* Helpers taking the arguments as HelperArgs, called without building
+     * an array of arguments */
+    void registerArgsHelper(const std::string &name, const ArgsHelper &helper, bool pure = false);
+    Value callHelper(const std::string &name, const Value &context, const HelperArgs &args) const;
+
+    /* Helpers called once per loop: the engine evaluates the arguments of the
+     * call site for every item of the innermost @for loop (also for the items
+     * where the call is skipped by a condition), calls the helper with the
+     * render context and all the argument lists and expects a result for each
+     * of them in the same order. Outside of loops it is called with a single
+     * argument list. */
+    void registerBatchHelper(const std::string &name, const BatchHelper &helper);
+
+    /* Helpers returning a future. Calls written straight to the output do not
+     * block: the render issues all of them and waits for the results at the
+     * end, keeping the output order. Where the result is needed at once (an
+     * argument, a condition) the render waits for it. */
+    void registerAsyncHelper(const std::string &name, const AsyncHelper &helper);
+
+    /* Number of pure helper results kept between renders, 0 (the default)
+     * disables the engine cache */
+    void setHelperCacheSize(size_t size);
+    HelperCacheStats helperCacheStats() const;
+    void resetHelperCacheStats();
+
+    /* Output of @cache(key, ttlSeconds) { ... } blocks, kept by template and
+     * key up to the given number of bytes (16 MB by default) */
+    void setFragmentCacheSize(size_t bytes);
+    void invalidateFragments(const std::string &key);
+    void clearFragmentCache();
+    FragmentCacheStats fragmentCacheStats() const;
+    void resetFragmentCacheStats();
+
+    /* Number of whole renders kept by template and context, 0 (the default)
+     * disables the cache. A render is reused when the context has the same
+     * contents (compared deeply, not by identity); a frozen context is
+     * looked up without walking it again. Templates calling helpers
+     * that are not registered as pure (include, batch and async helpers
+     * too) are always rendered. */
+    void setRenderCacheSize(size_t size);
+    void clearRenderCache();
+    RenderCacheStats renderCacheStats() const;
+    void resetRenderCacheStats();
+
+    /* Engine wide constants. Templates see them as variables that are known
+     * at compile time and take precedence over the render context; setting a
+     * global recompiles the templates that use it on their next render. */
+    void setGlobal(const std::string &name, const Value &value);
+    bool hasGlobal(const std::string &name) const;
+    Value global(const std::string &name) const;
+
 private:
+    friend class TemplateImpl;
+
     boost::scoped_ptr<TemplateEngineImpl> pimpl;
 };
 
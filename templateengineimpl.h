@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) Alex Nekipelov (alex@nekipelov.net)
+ * License: BSD
+ */
+
+#ifndef CPPTL_TEMPLATEENGINEIMPL_H
+#define CPPTL_TEMPLATEENGINEIMPL_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "templateengine.h"
+#include "helpercache.h"
+#include "fragmentcache.h"
+#include "rendercache.h"
+
+namespace cpptl {
+
+// Helper call sites keep a pointer to the entry, so registering a helper
+// again (or for the first time) updates them in place
+struct HelperEntry {
+    // writes the result to the output instead of returning it, see json
+    typedef void (*Writer)(std::string &out, const HelperArgs &args);
+
+    explicit HelperEntry(const std::string &name)
+        : name(name), pure(false), writer(NULL), rawArguments(false) {}
+
+    bool isRegistered() const {
+        return helper || argsHelper || batchHelper || asyncHelper;
+    }
+
+    Value call(const Value &context, const HelperArgs &args) const;
+
+    const std::string name;
+    TemplateEngine::Helper helper;
+    TemplateEngine::ArgsHelper argsHelper;
+    TemplateEngine::BatchHelper batchHelper;
+    TemplateEngine::AsyncHelper asyncHelper;
+    bool pure;
+    Writer writer;  // of a built-in helper, along with argsHelper
+    bool rawArguments;  // strings of variables are given not html escaped
+};
+
+typedef boost::shared_ptr<HelperEntry> HelperEntryPtr;
+
+class TemplateEngineImpl {
+public:
+    TemplateEngineImpl();
+
+    // entry of the helper, created empty if it is not registered yet
+    HelperEntryPtr bindHelper(const std::string &name);
+
+    // calls the helper, results of pure helpers are looked up in the render
+    // cache (if any) and the engine cache first
+    Value callHelper(const HelperEntry &helper, const Value &context,
+                     const HelperArgs &args, HelperCache *renderCache);
+
+    void clearHelperCache();
+
+    // true if one of the globals in names was set after the revision
+    bool globalsChanged(const std::set<std::string> &names, unsigned int revision) const;
+
+    std::map<std::string, HelperEntryPtr> helpers;
+    std::map<std::string, Template> cache;
+
+    // renders call helpers at the same time, the cache and its stats are
+    // used under the lock
+    mutable boost::mutex helperCacheMutex;
+    HelperCache helperCache;
+    size_t helperCacheSize;
+    HelperCacheStats helperCacheStats;
+
+    FragmentCache fragments;
+
+    RenderCache renders;
+
+    // templates are compiled under the lock, they read the globals
+    mutable boost::mutex globalsMutex;
+    size_t templateIds;     // last id given to a compiled template
+    Value globals;
+    std::map<std::string, unsigned int> globalRevisions;
+    unsigned int globalsRevision;
+};
+
+} // namespace cpptl
+
+#endif // CPPTL_TEMPLATEENGINEIMPL_H
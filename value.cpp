@@ -3,12 +3,16 @@
  * License: BSD
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cstdlib>
 #include <sstream>
 
 #include <stdio.h>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "value.h"
 
@@ -17,11 +21,79 @@ namespace cpptl {
 static bool stringToBool(const Value &v);
 static double stringToDouble(const Value &v);
 static Value &fakeValueObject();
+static bool isIntegral(double d);
+
+// items of a packed array, all of the same type
+struct PackedArray {
+    explicit PackedArray(Value::Type type) : type(type) {}
+
+    size_t size() const {
+        return type == Value::Double ? doubles.size() : integers.size();
+    }
+
+    Value at(size_t index) const {
+        switch(type)
+        {
+        case Value::Bool:
+            return Value(integers[index] != 0);
+        case Value::Int:
+            return Value(integers[index]);
+        default:
+            return Value(doubles[index]);
+        }
+    }
+
+    Value::Type type;               // Bool, Int or Double
+    std::vector<int64_t> integers;  // of bools and integers
+    std::vector<double> doubles;
+};
+
+// the callback of a lazy value and its result once computed
+struct LazyValue {
+    explicit LazyValue(const boost::function<Value ()> &compute)
+        : compute(compute), computed(false) {}
+
+    boost::function<Value ()> compute;
+    boost::mutex mutex;     // the value may be read by several renders
+    bool computed;
+    Value value;
+};
+
+// the bytes of a string owned by someone else
+struct StringView {
+    StringView(const char *data, size_t size, const boost::shared_ptr<const void> &anchor)
+        : data(data), size(size), anchor(anchor) {}
+
+    const char *data;
+    size_t size;
+    boost::shared_ptr<const void> anchor;
+};
+
+// Two strings joined by +, long chains are built without copying the
+// bytes again and again. Pieces are written out by walking the tree; the
+// joined bytes are made only when asked for and are kept.
+struct StringRope {
+    StringRope(const Value &left, const Value &right)
+        : left(left), right(right), size(left.stringSize() + right.stringSize()), flat(NULL) {}
+    ~StringRope() { delete flat; }
+
+    Value left;     // strings or ropes
+    Value right;
+    size_t size;
+    std::string *flat;
+};
+
+// shorter strings are joined right away
+static const size_t minRopeSize = 256;
+
+// the joined bytes of ropes shared by renders are made once
+static boost::mutex ropeMutex;
+static boost::mutex discardedMutex;    // see Value::discarded()
 
 Value::Value()
 {
     // TODO надо бы переделать так, чтобы это выделение памяти было не обязательным
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Null;
     holder->data.ptr = 0;
 }
@@ -30,7 +102,7 @@ Value::Value(Type type)
 {
     if( type != Null )
     {
-        holder.reset( new Holder );
+        holder = boost::make_shared<Holder>();
 
         switch(type)
         {
@@ -72,20 +144,38 @@ Value::~Value()
 }
 
 Value::Holder::Holder()
-    : type(Value::Null)
+    : type(Value::Null), packed(false), view(false), rope(false), hash(0), hashed(false), frozen(false), discarded(NULL)
 {
 }
 
+bool Value::Holder::isWritable() const
+{
+    if( frozen )
+        std::cerr << "value is frozen" << std::endl;
+
+    return frozen == false;
+}
+
 Value::Holder::~Holder()
 {
+    delete discarded;
+
     switch(type)
     {
     case UnsafeString:
     case String:
-        delete data.string;
+        if( view )
+            delete data.view;
+        else if( rope )
+            releaseRope(data.rope);
+        else
+            delete data.string;
         break;
     case Array:
-        delete data.array;
+        if( packed )
+            delete data.packed;
+        else
+            delete data.array;
         break;
     case Object:
         delete data.members;
@@ -93,6 +183,12 @@ Value::Holder::~Holder()
     case UserType:
         delete data.userType;
         break;
+    case Lazy:
+        delete data.lazy;
+        break;
+    case Generator:
+        delete data.generator;
+        break;
     default:
         break;
     }
@@ -100,88 +196,105 @@ Value::Holder::~Holder()
 
 Value::Value(const struct ObjectTag &)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Object;
     holder->data.members = new std::map<std::string, Value>();
 }
 
 Value::Value(const struct ArrayTag &)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Array;
     holder->data.array = new std::vector<Value>();
 }
 
 Value::Value(bool b)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Bool;
     holder->data.b = b;
 }
 
 Value::Value(int i)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Int;
     holder->data.i = i;
 }
 
 Value::Value(unsigned int i)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Int; // FIXME must be unsigned
     holder->data.i = i;
 }
 
 Value::Value(int64_t ii)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Int;
     holder->data.i = ii;
 }
 
 Value::Value(uint64_t ii)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Int; // FIXME must be unsigned
     holder->data.i = ii;
 }
 
 Value::Value(double d)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = Double;
     holder->data.d = d;
 }
 
 Value::Value(const char *s)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = String;
     holder->data.string = new std::string(s);
 }
 
 Value::Value(const std::string &s)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = String;
     holder->data.string = new std::string(s);
 }
 
 Value::Value(const char *s, const UnsafeStringTag &)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = UnsafeString;
     holder->data.string = new std::string(s);
 }
 
 Value::Value(const std::string &s, const UnsafeStringTag &)
 {
-    holder.reset( new Holder );
+    holder = boost::make_shared<Holder>();
     holder->type = UnsafeString;
     holder->data.string = new std::string(s);
 }
 
+Value::Value(const char *data, size_t size, const boost::shared_ptr<const void> &anchor)
+{
+    holder = boost::make_shared<Holder>();
+    holder->type = String;
+    holder->view = true;
+    holder->data.view = new StringView(data, size, anchor);
+}
+
+Value::Value(const char *data, size_t size, const boost::shared_ptr<const void> &anchor,
+             const UnsafeStringTag &)
+{
+    holder = boost::make_shared<Holder>();
+    holder->type = UnsafeString;
+    holder->view = true;
+    holder->data.view = new StringView(data, size, anchor);
+}
+
 Value::Type Value::type() const
 {
     if( holder )
@@ -253,12 +366,448 @@ std::string Value::toString() const
     return toValue<std::string>();
 }
 
+const char *Value::stringData() const
+{
+    if( type() != String && type() != UnsafeString )
+        return NULL;
+    else if( holder->view )
+        return holder->data.view->data;
+    else if( holder->rope == false )
+        return holder->data.string->data();
+
+    StringRope &rope = *holder->data.rope;
+    boost::mutex::scoped_lock lock(ropeMutex);
+
+    if( rope.flat == NULL )
+    {
+        std::string *flat = new std::string();
+
+        flat->reserve(rope.size);
+        appendString(*flat);
+        rope.flat = flat;
+    }
+
+    return rope.flat->data();
+}
+
+size_t Value::stringSize() const
+{
+    if( type() != String && type() != UnsafeString )
+        return 0;
+    else if( holder->view )
+        return holder->data.view->size;
+    else if( holder->rope )
+        return holder->data.rope->size;
+    else
+        return holder->data.string->size();
+}
+
+void Value::appendString(std::string &out, StringWriter write) const
+{
+    if( (type() == String || type() == UnsafeString) && holder->rope == false )
+    {
+        if( write )
+            write(out, stringData(), stringSize());
+        else
+            out.append(stringData(), stringSize());
+
+        return;
+    }
+
+    // a loop, not recursion: a string built by += in a loop is a deep tree
+    std::vector<const Value *> pending(1, this);
+
+    while( pending.empty() == false )
+    {
+        const Value &value = *pending.back();
+
+        pending.pop_back();
+
+        if( value.type() != String && value.type() != UnsafeString )
+            continue;
+
+        if( value.holder->rope )
+        {
+            const StringRope &rope = *value.holder->data.rope;
+
+            pending.push_back(&rope.right);
+            pending.push_back(&rope.left);
+        }
+        else if( write )
+        {
+            write(out, value.stringData(), value.stringSize());
+        }
+        else
+        {
+            out.append(value.stringData(), value.stringSize());
+        }
+    }
+}
+
+// text written by writeJson() to a sink at once
+static const size_t jsonChunkSize = 16 * 1024;
+
+static bool needsJsonEscape(unsigned char c)
+{
+    // 0xE2 starts the line separators U+2028 and U+2029
+    return c < 0x20 || c == '"' || c == '\\' || c == '<' || c == '>' || c == '&' || c == 0xE2;
+}
+
+// a string for JSON in a <script> element, it may not contain </script>,
+// <!-- or the line separators (not allowed in older JavaScript strings)
+static void escapeJson(std::string &out, const char *data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = p + size;
+
+    while( p != end )
+    {
+        const unsigned char *plain = p;
+
+        while( p != end && needsJsonEscape(*p) == false )
+            ++p;
+
+        out.append(reinterpret_cast<const char *>(plain), p - plain);
+
+        if( p == end )
+            break;
+
+        const unsigned char c = *p++;
+
+        switch(c)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case 0xE2:
+            if( end - p >= 2 && p[0] == 0x80 && (p[1] == 0xA8 || p[1] == 0xA9) )
+            {
+                out += p[1] == 0xA8 ? "\\u2028" : "\\u2029";
+                p += 2;
+            }
+            else
+            {
+                out += static_cast<char>(c);
+            }
+            break;
+        default: {
+            const char escape[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+
+            out.append(escape, sizeof(escape));
+            break;
+        }
+        }
+    }
+}
+
+static void appendJsonString(std::string &out, const char *data, size_t size)
+{
+    out += '"';
+    escapeJson(out, data, size);
+    out += '"';
+}
+
+static void appendJsonInteger(std::string &out, int64_t value)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *ptr = end;
+    uint64_t abs = value < 0 ? -static_cast<uint64_t>(value) : value;
+
+    do {
+        *--ptr = '0' + abs % 10;
+        abs /= 10;
+    } while( abs );
+
+    if( value < 0 )
+        *--ptr = '-';
+
+    out.append(ptr, end);
+}
+
+// A number that reads back the same. Most doubles of a context are prices
+// and the like with a few decimals: if n / 10^k rounds to d, then "n / 10^k"
+// written in decimal is read as d too, no need for printf.
+static void appendJsonDouble(std::string &out, double d)
+{
+    const double maxExact = 9007199254740992.0; // 2^53
+    char buf[32];
+
+    if( d - d != 0 )
+    {
+        out += "null";  // nan and infinities
+        return;
+    }
+
+    int64_t scale = 1;
+
+    for(int digits = 0; digits <= 6 && d * scale < maxExact && d * scale > -maxExact;
+        ++digits, scale *= 10)
+    {
+        const int64_t n = static_cast<int64_t>(d * scale);
+
+        if( static_cast<double>(n) / scale != d )
+            continue;
+
+        const int64_t whole = n / scale;
+        int64_t fraction = n % scale;
+
+        if( n < 0 && whole == 0 )
+            out += '-';
+
+        appendJsonInteger(out, whole);
+
+        if( digits )
+        {
+            char *end = buf + digits + 1;
+
+            buf[0] = '.';
+
+            for(char *p = end; p != buf + 1; fraction /= 10)
+                *--p = '0' + (fraction < 0 ? -fraction : fraction) % 10;
+
+            out.append(buf, end);
+        }
+
+        return;
+    }
+
+    int size = snprintf(buf, sizeof(buf), "%.15g", d);
+
+    if( strtod(buf, NULL) != d )
+        size = snprintf(buf, sizeof(buf), "%.17g", d);
+
+    out.append(buf, size);
+}
+
+static void flushJson(std::string &out, JsonSink *sink)
+{
+    if( sink && out.size() >= jsonChunkSize )
+    {
+        sink->write(out.data(), out.size());
+        out.clear();
+    }
+}
+
+void Value::writeJson(JsonSink &sink) const
+{
+    std::string out;
+
+    out.reserve(jsonChunkSize * 2);
+    writeJson(out, &sink);
+
+    if( out.empty() == false )
+        sink.write(out.data(), out.size());
+}
+
+void Value::writeJson(std::string &out) const
+{
+    writeJson(out, NULL);
+}
+
+void Value::writeJson(std::string &out, JsonSink *sink) const
+{
+    switch(type())
+    {
+    case Bool:
+        out += holder->data.b ? "true" : "false";
+        break;
+    case Int:
+        appendJsonInteger(out, holder->data.i);
+        break;
+    case Double:
+        appendJsonDouble(out, holder->data.d);
+        break;
+    case String:
+    case UnsafeString:
+        out += '"';
+        appendString(out, escapeJson);
+        out += '"';
+        flushJson(out, sink);
+        break;
+    case Array:
+        out += '[';
+
+        if( isPacked() )
+        {
+            const PackedArray &packed = *holder->data.packed;
+
+            for(size_t i = 0; i < packed.size(); ++i)
+            {
+                if( i )
+                    out += ',';
+
+                if( packed.type == Double )
+                    appendJsonDouble(out, packed.doubles[i]);
+                else if( packed.type == Int )
+                    appendJsonInteger(out, packed.integers[i]);
+                else
+                    out += packed.integers[i] ? "true" : "false";
+
+                flushJson(out, sink);
+            }
+        }
+        else
+        {
+            const std::vector<Value> &array = *holder->data.array;
+
+            for(size_t i = 0; i < array.size(); ++i)
+            {
+                if( i )
+                    out += ',';
+
+                array[i].writeJson(out, sink);
+            }
+        }
+
+        out += ']';
+        break;
+    case Object: {
+        std::map<std::string, Value>::const_iterator it = holder->data.members->begin();
+        std::map<std::string, Value>::const_iterator end = holder->data.members->end();
+
+        out += '{';
+
+        for(; it != end; ++it)
+        {
+            if( it != holder->data.members->begin() )
+                out += ',';
+
+            appendJsonString(out, it->first.data(), it->first.size());
+            out += ':';
+            it->second.writeJson(out, sink);
+        }
+
+        out += '}';
+        break;
+    }
+    case UserType: {
+        const UserTypeHolderBase &object = *holder->data.userType;
+
+        if( object.writeJson(out) )
+        {
+            flushJson(out, sink);
+            break;
+        }
+
+        out += '[';
+
+        for(size_t i = 0; i < object.size(); ++i)
+        {
+            if( i )
+                out += ',';
+
+            object.at(i).writeJson(out, sink);
+        }
+
+        out += ']';
+        break;
+    }
+    case Lazy:
+        resolve().writeJson(out, sink);
+        break;
+    case Generator: {
+        ValueIterator it(*this);
+        bool first = true;
+
+        out += '[';
+
+        while( it.hasNext() )
+        {
+            if( first == false )
+                out += ',';
+
+            it.next().writeJson(out, sink);
+            first = false;
+        }
+
+        out += ']';
+        break;
+    }
+    default:
+        out += "null";
+        break;
+    }
+}
+
+Value Value::concatenate(const Value &lhs, const Value &rhs)
+{
+    if( lhs.stringSize() + rhs.stringSize() < minRopeSize )
+    {
+        std::string result;
+
+        result.reserve(lhs.stringSize() + rhs.stringSize());
+        lhs.appendString(result);
+        rhs.appendString(result);
+
+        return result;
+    }
+
+    Value result;
+
+    result.holder->type = String;
+    result.holder->rope = true;
+    result.holder->data.rope = new StringRope(lhs, rhs);
+
+    return result;
+}
+
+// Nobody else holds the pieces of a deep tree, they are released one by
+// one instead of by a recursion as deep as the tree.
+void Value::releaseRope(StringRope *rope)
+{
+    std::vector<Value> pending;
+
+    pending.push_back(rope->left);
+    pending.push_back(rope->right);
+    delete rope;
+
+    while( pending.empty() == false )
+    {
+        Value value = pending.back();
+
+        pending.pop_back();
+
+        if( value.holder.use_count() == 1 && value.holder->rope )
+        {
+            StringRope *child = value.holder->data.rope;
+
+            pending.push_back(child->left);
+            pending.push_back(child->right);
+            child->left = Value();
+            child->right = Value();
+        }
+    }
+}
+
+// strcmp for strings that may contain zeros
+static int compareStrings(const Value &lhs, const Value &rhs)
+{
+    const size_t lhsSize = lhs.stringSize();
+    const size_t rhsSize = rhs.stringSize();
+    const int result = memcmp(lhs.stringData(), rhs.stringData(), std::min(lhsSize, rhsSize));
+
+    if( result != 0 )
+        return result;
+    else
+        return lhsSize < rhsSize ? -1 : (lhsSize > rhsSize ? 1 : 0);
+}
+
 size_t Value::size() const
 {
     if( type() == Object )
         return holder->data.members->size();
+    else if( isPacked() )
+        return holder->data.packed->size();
     else if( type() == Array )
         return holder->data.array->size();
+    else if( userType() )
+        return userType()->size();
     else
         return 0;
 }
@@ -275,13 +824,38 @@ bool Value::hasMember(const std::string &name) const
 {
     if( type() == Object )
         return holder->data.members->find(name) != holder->data.members->end();
+    else if( userType() )
+        return userType()->member(name, NULL);
 
     return false;
 }
 
-Value Value::member(const std::string &name)
+bool Value::findMember(const std::string &name, Value &result) const
 {
     if( type() == Object )
+    {
+        std::map<std::string, Value>::const_iterator it = holder->data.members->find(name);
+
+        if( it == holder->data.members->end() )
+            return false;
+
+        result = it->second;
+        return true;
+    }
+    else if( userType() && userType()->member(name, &result) )
+    {
+        result = ownedPart(result);
+        return true;
+    }
+
+    return false;
+}
+
+Value Value::member(const std::string &name)
+{
+    if( (type() == Object && holder->frozen) || type() == UserType )
+        return static_cast<const Value *>(this)->member(name);
+    else if( type() == Object )
         return (*holder->data.members)[name];
     else
         return Value();
@@ -296,16 +870,32 @@ const Value Value::member(const std::string &name) const
         if( it != holder->data.members->end() )
             return it->second;
     }
+    else if( userType() )
+    {
+        Value result;
+
+        if( userType()->member(name, &result) )
+            return ownedPart(result);
+    }
 
     return Value();
 }
 
 Value &Value::operator[] (const std::string &memberName)
 {
-    if( type() == Object )
+    if( type() == Object && holder->frozen )
+    {
+        std::cerr << "value is frozen, member \"" << memberName << "\" not changed" << std::endl;
+        return discarded();
+    }
+    else if( type() == Object )
+    {
         return (*holder->data.members)[memberName];
+    }
     else
+    {
         return fakeValueObject();
+    }
 }
 
 const Value Value::operator[] (const std::string &memberName) const
@@ -316,55 +906,457 @@ const Value Value::operator[] (const std::string &memberName) const
 Value Value::append(const Value &value)
 {
     if( type() == Array ) {
-        holder->data.array->push_back(value);
+        if( holder->isWritable() && appendPacked(value) == false )
+            unpack().push_back(value);
         return *this;
     }
 
     throw Value();
 }
 
+void Value::reserve(size_t size)
+{
+    if( type() != Array || holder->isWritable() == false )
+        return;
+
+    if( holder->packed == false )
+        holder->data.array->reserve(size);
+    else if( holder->data.packed->type == Double )
+        holder->data.packed->doubles.reserve(size);
+    else
+        holder->data.packed->integers.reserve(size);
+}
+
 Value Value::at(size_t arrayIndex)
 {
-    if( type() == Array )
+    if( type() == UserType
+            || (type() == Array && (holder->frozen || (isPacked() && arrayIndex < size()))) )
+    {
+        return static_cast<const Value *>(this)->at(arrayIndex);
+    }
+    else if( type() == Array )
+    {
+        std::vector<Value> &array = unpack();
+
+        if( arrayIndex >= array.size() )
+            array.resize(arrayIndex + 1);
+
+        return array[arrayIndex];
+    }
+
+    return Value();
+}
+
+const Value Value::at(size_t arrayIndex) const
+{
+    if( isPacked() )
+    {
+        if( holder->data.packed->size() > arrayIndex )
+            return holder->data.packed->at(arrayIndex);
+    }
+    else if( type() == Array )
+    {
+        if(  holder->data.array->size() > arrayIndex )
+            return (*holder->data.array)[arrayIndex];
+    }
+    else if( userType() )
+    {
+        if( userType()->size() > arrayIndex )
+            return ownedPart(userType()->at(arrayIndex));
+    }
+
+    return Value();
+}
+
+const Value::UserTypeHolderBase *Value::userType() const
+{
+    return type() == UserType ? holder->data.userType : NULL;
+}
+
+bool Value::writeMember(const std::string &name, std::string &out, StringWriter write) const
+{
+    return userType() && userType()->writeMember(name, out, write);
+}
+
+// ValueTypeInfo gives the items of a vector and the fields of a struct as
+// references (see Value::reference), a value owning the object (made by
+// fromValue) must outlive them. A value shared with others is not changed,
+// it was kept somewhere before and is no part of this one.
+Value Value::ownedPart(const Value &part) const
+{
+    if( part.type() == UserType && part.holder.unique()
+            && part.holder->data.userType->isReference() && !part.holder->data.userType->owner )
+    {
+        part.holder->data.userType->owner = holder;
+    }
+
+    return part;
+}
+
+Value &Value::operator[] (size_t index)
+{
+    if( type() == Array && holder->frozen )
+    {
+        std::cerr << "value is frozen, item " << index << " not changed" << std::endl;
+        return discarded();
+    }
+    else if( type() == Array )
+    {
+        // the item can be changed through the reference, it must be a Value
+        std::vector<Value> &array = unpack();
+
+        if( index >= array.size() )
+            array.resize(index + 1);
+
+        return array[index];
+    }
+    else
+    {
+        return fakeValueObject();
+    }
+}
+
+const Value Value::operator[] (size_t index) const
+{
+    return at(index);
+}
+
+Value Value::lazy(const boost::function<Value ()> &compute)
+{
+    Value result;
+
+    result.holder->type = Lazy;
+    result.holder->data.lazy = new LazyValue(compute);
+
+    return result;
+}
+
+Value Value::generator(const boost::function<Generate ()> &start)
+{
+    Value result;
+
+    result.holder->type = Generator;
+    result.holder->data.generator = new boost::function<Generate ()>(start);
+
+    return result;
+}
+
+Value Value::resolve() const
+{
+    if( type() != Lazy )
+        return *this;
+
+    LazyValue &lazy = *holder->data.lazy;
+    boost::mutex::scoped_lock lock(lazy.mutex);
+
+    if( lazy.computed == false )
+    {
+        if( lazy.compute )
+            lazy.value = lazy.compute().resolve();
+
+        lazy.compute.clear();
+        lazy.computed = true;
+    }
+
+    return lazy.value;
+}
+
+Value Value::materialize() const
+{
+    if( type() != Generator )
+        return *this;
+
+    Value result(Array);
+    ValueIterator it(*this);
+
+    while( it.hasNext() )
+        result.append(it.next());
+
+    return result;
+}
+
+bool Value::isPacked() const
+{
+    return holder && holder->packed;
+}
+
+const int64_t *Value::packedIntegers() const
+{
+    if( isPacked() && holder->data.packed->type == Int )
+        return holder->data.packed->integers.data();
+
+    return NULL;
+}
+
+const double *Value::packedDoubles() const
+{
+    if( isPacked() && holder->data.packed->type == Double )
+        return holder->data.packed->doubles.data();
+
+    return NULL;
+}
+
+bool Value::appendPacked(const Value &value)
+{
+    const Type itemType = value.type();
+
+    if( itemType != Bool && itemType != Int && itemType != Double )
+        return false;
+
+    if( holder->packed == false )
+    {
+        if( holder->data.array->empty() == false )
+            return false;
+
+        const size_t capacity = holder->data.array->capacity();
+
+        delete holder->data.array;
+        holder->data.packed = new PackedArray(itemType);
+        holder->packed = true;
+
+        // keep what was reserved
+        if( itemType == Double )
+            holder->data.packed->doubles.reserve(capacity);
+        else
+            holder->data.packed->integers.reserve(capacity);
+    }
+
+    PackedArray &packed = *holder->data.packed;
+
+    if( packed.type != itemType )
+        return false;
+
+    if( itemType == Double )
+        packed.doubles.push_back(value.holder->data.d);
+    else if( itemType == Int )
+        packed.integers.push_back(value.holder->data.i);
+    else
+        packed.integers.push_back(value.holder->data.b);
+
+    return true;
+}
+
+std::vector<Value> &Value::unpack()
+{
+    if( holder->packed )
+    {
+        std::vector<Value> *array = new std::vector<Value>();
+
+        arrayItems(*array);
+
+        delete holder->data.packed;
+        holder->data.array = array;
+        holder->packed = false;
+    }
+
+    return *holder->data.array;
+}
+
+const std::vector<Value> &Value::arrayItems(std::vector<Value> &buffer) const
+{
+    if( holder->packed )
+    {
+        const PackedArray &packed = *holder->data.packed;
+
+        buffer.clear();
+        buffer.reserve(packed.size());
+
+        for(size_t i = 0; i < packed.size(); ++i)
+            buffer.push_back(packed.at(i));
+
+        return buffer;
+    }
+
+    return *holder->data.array;
+}
+
+namespace {
+
+// Items of arrays matched with ==. Integers (and doubles equal to them) are
+// kept by value, the others by pointer with the hash next to it, so most
+// lookups do not touch the holders.
+class ItemSet {
+public:
+    explicit ItemSet(size_t size = 0) : integers(size) {}
+
+    bool insert(const Value &value) {
+        int64_t integer;
+
+        if( toInteger(value, integer) )
+            return integers.insert(integer).second;
+
+        Item item = {value.hash(), &value};
+        return others.insert(item).second;
+    }
+
+    bool contains(const Value &value) const {
+        int64_t integer;
+
+        if( toInteger(value, integer) )
+            return integers.find(integer) != integers.end();
+
+        Item item = {value.hash(), &value};
+        return others.find(item) != others.end();
+    }
+
+private:
+    struct Item {
+        size_t hash;
+        const Value *value;
+    };
+
+    struct ItemHash {
+        size_t operator()(const Item &item) const { return item.hash; }
+    };
+
+    struct ItemEqual {
+        bool operator()(const Item &lhs, const Item &rhs) const {
+            return lhs.hash == rhs.hash && *lhs.value == *rhs.value;
+        }
+    };
+
+    static bool toInteger(const Value &value, int64_t &integer) {
+        if( value.type() == Value::Int )
+        {
+            integer = value.toInt64();
+            return true;
+        }
+        else if( value.type() == Value::Double && isIntegral(value.toDouble()) )
+        {
+            integer = static_cast<int64_t>(value.toDouble());
+            return true;
+        }
+
+        return false;
+    }
+
+    boost::unordered_set<int64_t> integers;
+    boost::unordered_set<Item, ItemHash, ItemEqual> others;
+};
+
+class IntegerSet {
+public:
+    explicit IntegerSet(size_t size = 0) : integers(size) {}
+
+    bool insert(int64_t integer) { return integers.insert(integer).second; }
+    bool contains(int64_t integer) const { return integers.find(integer) != integers.end(); }
+
+private:
+    boost::unordered_set<int64_t> integers;
+};
+
+enum SetOperation { Difference, Union, Intersection, Unique };
+
+template<typename Item, typename Set>
+static void setOperation(SetOperation operation, const std::vector<Item> &lhs,
+                         const std::vector<Item> &rhs, std::vector<Item> &out)
+{
+    Set other(operation == Difference || operation == Intersection ? rhs.size() : 0);
+    Set seen(operation == Difference ? 0 : lhs.size());
+
+    switch(operation)
+    {
+    case Difference:
+        for(size_t i = 0; i < rhs.size(); ++i)
+            other.insert(rhs[i]);
+
+        if( lhs.size() > rhs.size() )
+            out.reserve(lhs.size() - rhs.size());
+
+        for(size_t i = 0; i < lhs.size(); ++i)
+        {
+            if( other.contains(lhs[i]) == false )
+                out.push_back(lhs[i]);
+        }
+        break;
+    case Union:
+        out.reserve(lhs.size() + rhs.size());
+
+        for(size_t i = 0; i < lhs.size(); ++i)
+        {
+            if( seen.insert(lhs[i]) )
+                out.push_back(lhs[i]);
+        }
+
+        for(size_t i = 0; i < rhs.size(); ++i)
+        {
+            if( seen.insert(rhs[i]) )
+                out.push_back(rhs[i]);
+        }
+        break;
+    case Intersection:
+        for(size_t i = 0; i < rhs.size(); ++i)
+            other.insert(rhs[i]);
+
+        for(size_t i = 0; i < lhs.size(); ++i)
+        {
+            if( other.contains(lhs[i]) && seen.insert(lhs[i]) )
+                out.push_back(lhs[i]);
+        }
+        break;
+    case Unique:
+        for(size_t i = 0; i < lhs.size(); ++i)
+        {
+            if( seen.insert(lhs[i]) )
+                out.push_back(lhs[i]);
+        }
+        break;
+    }
+}
+
+} // namespace
+
+Value Value::arraySetOperation(int operation, const Value &other) const
+{
+    if( type() != Array || other.type() != Array )
+        return Value();
+
+    Value result(Array);
+    SetOperation op = static_cast<SetOperation>(operation);
+
+    if( isPacked() && other.isPacked()
+            && holder->data.packed->type == Int && other.holder->data.packed->type == Int )
+    {
+        // lists of ids, no Values at all
+        PackedArray *packed = new PackedArray(Int);
+
+        delete result.holder->data.array;
+        result.holder->data.packed = packed;
+        result.holder->packed = true;
+
+        setOperation<int64_t, IntegerSet>(op, holder->data.packed->integers,
+                                          other.holder->data.packed->integers, packed->integers);
+    }
+    else
     {
-        if( arrayIndex >= holder->data.array->size() )
-            holder->data.array->resize(arrayIndex + 1);
+        std::vector<Value> lhsBuffer;
+        std::vector<Value> rhsBuffer;
 
-        return (*holder->data.array)[arrayIndex];
+        setOperation<Value, ItemSet>(op, arrayItems(lhsBuffer), other.arrayItems(rhsBuffer),
+                                     *result.holder->data.array);
     }
 
-    return Value();
+    return result;
 }
 
-const Value Value::at(size_t arrayIndex) const
+Value Value::difference(const Value &other) const
 {
-    if( type() == Array )
-    {
-        if(  holder->data.array->size() > arrayIndex )
-            return (*holder->data.array)[arrayIndex];
-    }
-
-    return Value();
+    return arraySetOperation(Difference, other);
 }
 
-Value &Value::operator[] (size_t index)
+Value Value::unite(const Value &other) const
 {
-    if( type() == Array )
-    {
-        if( index >= holder->data.array->size() )
-            holder->data.array->resize(index + 1);
+    return arraySetOperation(Union, other);
+}
 
-        return (*holder->data.array)[index];
-    }
-    else
-    {
-        return fakeValueObject();
-    }
+Value Value::intersection(const Value &other) const
+{
+    return arraySetOperation(Intersection, other);
 }
 
-const Value Value::operator[] (size_t index) const
+Value Value::unique() const
 {
-    return at(index);
+    return arraySetOperation(Unique, *this);
 }
 
 int64_t Value::safeCastToNumber(const Value &value)
@@ -381,9 +1373,9 @@ int64_t Value::safeCastToNumber(const Value &value)
     case Value::String:
     case Value::UnsafeString:
 #ifdef _MSC_VER
-        return _strtoi64(holder->data.string->c_str(), 0, 10);
+        return _strtoi64(value.toString().c_str(), 0, 10);
 #else
-        return strtoll(holder->data.string->c_str(), 0, 10);
+        return strtoll(value.toString().c_str(), 0, 10);
 #endif
     default:
         assert( false );
@@ -394,7 +1386,7 @@ int64_t Value::safeCastToNumber(const Value &value)
 bool Value::convertHelper(const Value &v, Value::Type type, void *ptr)
 {
     assert( v.type() != Null );
-    assert( v.type() != type );
+    assert( v.type() != type || v.holder->view || v.holder->rope );
     assert( ptr );
 
     switch(type) {
@@ -431,7 +1423,7 @@ bool Value::convertHelper(const Value &v, Value::Type type, void *ptr)
         }
     }
     case Int:
-        *reinterpret_cast<int *>( ptr ) = safeCastToNumber(v);
+        *reinterpret_cast<int64_t *>( ptr ) = safeCastToNumber(v);
         return true;
     case UnsafeString:
     case String: {
@@ -454,7 +1446,7 @@ bool Value::convertHelper(const Value &v, Value::Type type, void *ptr)
             return true;
         case String:
         case UnsafeString:
-            *s = *v.holder->data.string;
+            s->assign(v.stringData(), v.stringSize());
             return true;
         default:
             return false;
@@ -493,98 +1485,477 @@ static double stringToDouble(const Value &v)
         return 0;
 }
 
-class Value::ValueIteratorPrivate {
-public:
-    ValueIteratorPrivate(const Value &value)
-        : value(value)
+Value::ValueIterator::ValueIterator(const Value &value)
+    : container(value), packed(NULL), index(0), more(false)
+{
+    if( value.type() == Value::Object )
     {
+        mapIterator = value.holder->data.members->begin();
     }
+    else if( value.isPacked() )
+    {
+        packed = value.holder->data.packed;
+    }
+    else if( value.type() == Value::Array )
+    {
+        arrayIterator = value.holder->data.array->begin();
+    }
+    else if( value.type() == Value::Generator && *value.holder->data.generator )
+    {
+        generate = (*value.holder->data.generator)();
+        more = generate && generate(ahead);
+    }
+}
 
-    const Value &value;
-
-    std::map<std::string, Value>::const_iterator mapIterator;
-    std::vector<Value>::const_iterator arrayIterator;
-};
+Value::ValueIterator::~ValueIterator()
+{
+}
 
-Value::ValueIterator::ValueIterator(const Value &value)
+// the item is written in place unless it was copied somewhere
+const Value &Value::ValueIterator::packedItem(size_t position)
 {
-    pimpl.reset(new Value::ValueIteratorPrivate(value));
+    if( item.holder.unique() && item.holder->type == packed->type && item.holder->frozen == false )
+    {
+        if( packed->type == Value::Double )
+            item.holder->data.d = packed->doubles[position];
+        else if( packed->type == Value::Int )
+            item.holder->data.i = packed->integers[position];
+        else
+            item.holder->data.b = packed->integers[position] != 0;
+    }
+    else
+    {
+        item = packed->at(position);
+    }
 
-    if( value.type() == Value::Object )
-        pimpl->mapIterator = value.holder->data.members->begin();
-    else if( value.type() == Value::Array )
-        pimpl->arrayIterator = value.holder->data.array->begin();
+    return item;
 }
 
-Value::ValueIterator::~ValueIterator()
+// the item of a user type is moved in place unless it was copied somewhere,
+// see ValueTypeInfoBase::seek()
+const Value &Value::ValueIterator::userItem(size_t position)
 {
+    if( item.holder.unique() && item.holder->type == Value::UserType && item.holder->frozen == false
+            && item.holder->data.userType->seek(position) )
+        return item;
+
+    item = container.at(position);
+    return item;
 }
 
 bool Value::ValueIterator::hasNext() const
 {
-    if( pimpl->value.type() == Value::Object )
-        return pimpl->mapIterator != pimpl->value.holder->data.members->end();
-    else if( pimpl->value.type() == Value::Array )
-        return pimpl->arrayIterator != pimpl->value.holder->data.array->end();
+    if( packed )
+        return index < packed->size();
+    else if( container.type() == Value::Object )
+        return mapIterator != container.holder->data.members->end();
+    else if( container.type() == Value::Array )
+        return arrayIterator != container.holder->data.array->end();
+    else if( container.type() == Value::UserType )
+        return index < container.size();
     else
-        return false;
+        return more;
 }
 
 bool Value::ValueIterator::hasPrev() const
 {
-    if( pimpl->value.type() == Value::Object )
-        return pimpl->mapIterator != pimpl->value.holder->data.members->begin();
-    else if( pimpl->value.type() == Value::Array )
-        return pimpl->arrayIterator != pimpl->value.holder->data.array->begin();
+    if( packed )
+        return index != 0;
+    else if( container.type() == Value::Object )
+        return mapIterator != container.holder->data.members->begin();
+    else if( container.type() == Value::Array )
+        return arrayIterator != container.holder->data.array->begin();
+    else if( container.type() == Value::UserType )
+        return index != 0;
     else
         return false;
 }
 
 const Value &Value::ValueIterator::next()
 {
-    if( pimpl->value.type() == Value::Object ) {
-        assert( pimpl->mapIterator != pimpl->value.holder->data.members->end() );
-        return (pimpl->mapIterator++)->second;
+    if( packed ) {
+        assert( index < packed->size() );
+        return packedItem(index++);
     }
-    else if( pimpl->value.type() == Value::Array ) {
-        assert( pimpl->arrayIterator != pimpl->value.holder->data.array->end() );
-        return *pimpl->arrayIterator++;
+    else if( container.type() == Value::Object ) {
+        assert( mapIterator != container.holder->data.members->end() );
+        return (mapIterator++)->second;
+    }
+    else if( container.type() == Value::Array ) {
+        assert( arrayIterator != container.holder->data.array->end() );
+        return *arrayIterator++;
+    }
+    else if( container.type() == Value::UserType ) {
+        assert( index < container.size() );
+        return userItem(index++);
+    }
+    else if( more ) {
+        // a new Value, the generator must not change the previous item
+        item = ahead;
+        ahead = Value();
+        more = generate(ahead);
+        return item;
     }
     else {
         assert( false );
+        return fakeValueObject();
     }
 }
 
 const Value &Value::ValueIterator::prev()
 {
-    if( pimpl->value.type() == Value::Object ) {
-        assert( pimpl->mapIterator != pimpl->value.holder->data.members->begin() );
-        return (pimpl->mapIterator--)->second;
+    if( packed ) {
+        assert( index != 0 );
+        return packedItem(index--);
     }
-    else if( pimpl->value.type() == Value::Array ) {
-        assert( pimpl->arrayIterator != pimpl->value.holder->data.array->begin() );
-        return *pimpl->arrayIterator--;
+    else if( container.type() == Value::Object ) {
+        assert( mapIterator != container.holder->data.members->begin() );
+        return (mapIterator--)->second;
+    }
+    else if( container.type() == Value::Array ) {
+        assert( arrayIterator != container.holder->data.array->begin() );
+        return *arrayIterator--;
+    }
+    else if( container.type() == Value::UserType ) {
+        assert( index != 0 );
+        return userItem(index--);
     }
     else {
         assert( false );
+        return fakeValueObject();
+    }
+}
+
+const std::string &Value::ValueIterator::key() const
+{
+    static const std::string empty;
+
+    if( container.type() == Value::Object ) {
+        assert( mapIterator != container.holder->data.members->end() );
+        return mapIterator->first;
     }
+
+    return empty;
 }
 
 Value Value::ValueIterator::value() const
 {
-    if( pimpl->value.type() == Value::Object ) {
-        assert( pimpl->mapIterator != pimpl->value.holder->data.members->end() );
-        return pimpl->mapIterator->second;
+    if( container.type() == Value::Object ) {
+        assert( mapIterator != container.holder->data.members->end() );
+        return mapIterator->second;
+    }
+    else if( packed ) {
+        assert( index < packed->size() );
+        return packed->at(index);
+    }
+    else if( container.type() == Value::Array ) {
+        assert( arrayIterator != container.holder->data.array->end() );
+        return *arrayIterator;
+    }
+    else if( container.type() == Value::UserType ) {
+        assert( index < container.size() );
+        return container.at(index);
     }
-    else if( pimpl->value.type() == Value::Array ) {
-        assert( pimpl->arrayIterator != pimpl->value.holder->data.array->end() );
-        return *pimpl->arrayIterator;
+    else if( more ) {
+        return ahead;
     }
 
     throw 1;
 }
 
 
+static bool isIntegral(double d)
+{
+    return d >= -9223372036854775808.0 && d < 9223372036854775808.0
+            && d == static_cast<double>(static_cast<int64_t>(d));
+}
+
+// an integer and a double are equal only if the double is exactly that integer
+bool Value::equalNumbers(int64_t integer, double d)
+{
+    return isIntegral(d) && static_cast<int64_t>(d) == integer;
+}
+
+bool Value::integralDouble(const Value &integer, const Value &d)
+{
+    return integer.type() == Int && d.type() == Double
+            && equalNumbers(integer.holder->data.i, d.holder->data.d);
+}
+
+static size_t hashBool(bool b)
+{
+    size_t seed = 0;
+    boost::hash_combine(seed, b);
+    return seed;
+}
+
+static size_t hashInteger(int64_t i)
+{
+    size_t seed = 0;
+    boost::hash_combine(seed, i);
+    return seed;
+}
+
+// integral doubles hash as integers, they are equal to them
+static size_t hashDouble(double d)
+{
+    if( isIntegral(d) )
+        return hashInteger(static_cast<int64_t>(d));
+
+    size_t seed = 0;
+    boost::hash_combine(seed, d);
+    return seed;
+}
+
+size_t Value::hash() const
+{
+    if( holder && holder->hashed )
+        return holder->hash;
+
+    size_t seed = 0;
+
+    switch(type())
+    {
+    case Null:
+        break;
+    case Bool:
+        seed = hashBool(holder->data.b);
+        break;
+    case Int:
+        seed = hashInteger(holder->data.i);
+        break;
+    case Double:
+        seed = hashDouble(holder->data.d);
+        break;
+    case String:
+    case UnsafeString:
+        // the same text is == in both, they differ for equals() only
+        boost::hash_combine(seed, String);
+        boost::hash_combine(seed, boost::hash_range(stringData(), stringData() + stringSize()));
+        break;
+    case Array: {
+        boost::hash_combine(seed, type());
+
+        if( holder->packed )
+        {
+            // the same as for the items as Values
+            const PackedArray &packed = *holder->data.packed;
+
+            for(size_t i = 0; i < packed.size(); ++i)
+            {
+                if( packed.type == Double )
+                    boost::hash_combine(seed, hashDouble(packed.doubles[i]));
+                else if( packed.type == Int )
+                    boost::hash_combine(seed, hashInteger(packed.integers[i]));
+                else
+                    boost::hash_combine(seed, hashBool(packed.integers[i] != 0));
+            }
+        }
+        else
+        {
+            std::vector<Value>::const_iterator it = holder->data.array->begin();
+            std::vector<Value>::const_iterator end = holder->data.array->end();
+
+            for(; it != end; ++it)
+                boost::hash_combine(seed, it->hash());
+        }
+        break;
+    }
+    case Object: {
+        std::map<std::string, Value>::const_iterator it = holder->data.members->begin();
+        std::map<std::string, Value>::const_iterator end = holder->data.members->end();
+
+        boost::hash_combine(seed, type());
+
+        for(; it != end; ++it)
+        {
+            boost::hash_combine(seed, it->first);
+            boost::hash_combine(seed, it->second.hash());
+        }
+        break;
+    }
+    case UserType:
+    default:
+        boost::hash_combine(seed, holder->data.ptr);
+        break;
+    }
+
+    return seed;
+}
+
+bool Value::equals(const Value &other) const
+{
+    return equals(other, false);
+}
+
+bool Value::identical(const Value &other) const
+{
+    return equals(other, true);
+}
+
+// exact: numbers of different types differ
+bool Value::equals(const Value &other, bool exact) const
+{
+    if( holder == other.holder )
+        return true;
+
+    // the hashes of frozen values are computed once
+    if( isFrozen() && other.isFrozen() && hash() != other.hash() )
+        return false;
+
+    switch(type())
+    {
+    case Null:
+        return other.type() == Null;
+    case Bool:
+        return other.type() == Bool && holder->data.b == other.holder->data.b;
+    case Int:
+    case Double:
+        if( type() == other.type() )
+            return type() == Int ? holder->data.i == other.holder->data.i
+                                 : holder->data.d == other.holder->data.d;
+        else if( exact == false && (other.type() == Int || other.type() == Double) )
+            return integralDouble(*this, other) || integralDouble(other, *this);
+        else
+            return false;
+    case String:
+    case UnsafeString:
+        return type() == other.type() && compareStrings(*this, other) == 0;
+    case Array: {
+        if( other.type() != Array || size() != other.size() )
+            return false;
+
+        if( holder->packed && other.holder->packed
+                && holder->data.packed->type == other.holder->data.packed->type )
+        {
+            const PackedArray &lhs = *holder->data.packed;
+            const PackedArray &rhs = *other.holder->data.packed;
+
+            return lhs.type == Double ? lhs.doubles == rhs.doubles : lhs.integers == rhs.integers;
+        }
+
+        std::vector<Value> lhsBuffer;
+        std::vector<Value> rhsBuffer;
+        const std::vector<Value> &lhs = arrayItems(lhsBuffer);
+        const std::vector<Value> &rhs = other.arrayItems(rhsBuffer);
+
+        for(size_t i = 0; i < lhs.size(); ++i)
+        {
+            if( lhs[i].equals(rhs[i], exact) == false )
+                return false;
+        }
+
+        return true;
+    }
+    case Object: {
+        if( other.type() != Object || size() != other.size() )
+            return false;
+
+        std::map<std::string, Value>::const_iterator lhs = holder->data.members->begin();
+        std::map<std::string, Value>::const_iterator end = holder->data.members->end();
+        std::map<std::string, Value>::const_iterator rhs = other.holder->data.members->begin();
+
+        for(; lhs != end; ++lhs, ++rhs)
+        {
+            if( lhs->first != rhs->first || lhs->second.equals(rhs->second, exact) == false )
+                return false;
+        }
+
+        return true;
+    }
+    case UserType:
+    default:
+        return other.type() == UserType && holder->data.ptr == other.holder->data.ptr;
+    }
+}
+
+Value Value::clone() const
+{
+    switch(type())
+    {
+    case Array: {
+        Value result(Array);
+
+        if( holder->packed )
+        {
+            delete result.holder->data.array;
+            result.holder->data.packed = new PackedArray(*holder->data.packed);
+            result.holder->packed = true;
+            return result;
+        }
+
+        std::vector<Value> &array = *result.holder->data.array;
+
+        array.reserve(size());
+
+        for(size_t i = 0; i < holder->data.array->size(); ++i)
+            array.push_back( (*holder->data.array)[i].clone() );
+
+        return result;
+    }
+    case Object: {
+        Value result(Object);
+        std::map<std::string, Value> &members = *result.holder->data.members;
+        std::map<std::string, Value>::const_iterator it = holder->data.members->begin();
+        std::map<std::string, Value>::const_iterator end = holder->data.members->end();
+
+        for(; it != end; ++it)
+            members.insert(members.end(), std::make_pair(it->first, it->second.clone()));
+
+        return result;
+    }
+    default:
+        // scalars and strings are not changed in place, user types can not be copied
+        return *this;
+    }
+}
+
+void Value::freeze()
+{
+    if( !holder || holder->frozen )
+        return;
+
+    holder->frozen = true;
+
+    if( type() == Array && holder->packed == false )
+    {
+        std::vector<Value>::iterator it = holder->data.array->begin();
+        std::vector<Value>::iterator end = holder->data.array->end();
+
+        for(; it != end; ++it)
+            it->freeze();
+    }
+    else if( type() == Object )
+    {
+        std::map<std::string, Value>::iterator it = holder->data.members->begin();
+        std::map<std::string, Value>::iterator end = holder->data.members->end();
+
+        for(; it != end; ++it)
+            it->second.freeze();
+    }
+
+    // kept before the value is shared, hash() only reads it
+    holder->hash = hash();
+    holder->hashed = true;
+}
+
+// per holder, so the changes lost by one caller are not read by another
+// through a shared value
+Value &Value::discarded() const
+{
+    boost::mutex::scoped_lock lock(discardedMutex);
+
+    if( holder->discarded == NULL )
+        holder->discarded = new Value();
+
+    return *holder->discarded;
+}
+
+bool Value::isFrozen() const
+{
+    return !holder || holder->frozen;
+}
+
 void Value::dump(int level) const
 {
     std::string tabs;
@@ -600,8 +1971,10 @@ void Value::dump(int level) const
     {
         fprintf(stderr, "%sarray: \n", tabs.c_str());
 
-        std::vector<Value>::iterator it = holder->data.array->begin();
-        std::vector<Value>::iterator end = holder->data.array->end();
+        std::vector<Value> buffer;
+        const std::vector<Value> &items = arrayItems(buffer);
+        std::vector<Value>::const_iterator it = items.begin();
+        std::vector<Value>::const_iterator end = items.end();
 
         for(; it != end; ++it)
             it->dump(level+1);
@@ -632,7 +2005,7 @@ Value operator + (const Value &lhs, const Value &rhs)
     if( (lhs.type() == Value::String || lhs.type() == Value::UnsafeString)
             && (rhs.type() == Value::String || rhs.type() == Value::UnsafeString) )
     {
-        return lhs.toString() + rhs.toString();
+        return Value::concatenate(lhs, rhs);
     }
     else if( lhs.type() == Value::Array || rhs.type() == Value::Array )
     {
@@ -640,10 +2013,32 @@ Value operator + (const Value &lhs, const Value &rhs)
 
         std::vector<Value> *vec = result.holder->data.array;
 
-        vec->reserve(lhs.holder->data.array->size() + rhs.holder->data.array->size());
-        vec->assign(lhs.holder->data.array->begin(), lhs.holder->data.array->end());
-        vec->insert(lhs.holder->data.array->end(),
-                      rhs.holder->data.array->begin(), rhs.holder->data.array->end());
+        if( lhs.type() != Value::Array || rhs.type() != Value::Array )
+            return Value();
+
+        if( lhs.isPacked() && rhs.isPacked()
+                && lhs.holder->data.packed->type == rhs.holder->data.packed->type )
+        {
+            PackedArray *packed = new PackedArray(*lhs.holder->data.packed);
+            const PackedArray &tail = *rhs.holder->data.packed;
+
+            packed->integers.insert(packed->integers.end(), tail.integers.begin(), tail.integers.end());
+            packed->doubles.insert(packed->doubles.end(), tail.doubles.begin(), tail.doubles.end());
+
+            delete vec;
+            result.holder->data.packed = packed;
+            result.holder->packed = true;
+            return result;
+        }
+
+        std::vector<Value> lhsBuffer;
+        std::vector<Value> rhsBuffer;
+        const std::vector<Value> &lhsItems = lhs.arrayItems(lhsBuffer);
+        const std::vector<Value> &rhsItems = rhs.arrayItems(rhsBuffer);
+
+        vec->reserve(lhsItems.size() + rhsItems.size());
+        vec->assign(lhsItems.begin(), lhsItems.end());
+        vec->insert(vec->end(), rhsItems.begin(), rhsItems.end());
         return result;
     }
     else
@@ -680,26 +2075,7 @@ Value operator - (const Value &lhs, const Value &rhs)
 {
     if( lhs.type() == Value::Array || rhs.type() == Value::Array )
     {
-        Value result( Value::Array );
-
-        std::vector<Value> *vec = result.holder->data.array;
-
-        if( lhs.holder->data.array->size() > rhs.holder->data.array->size() )
-            vec->reserve(lhs.holder->data.array->size() - rhs.holder->data.array->size());
-
-        size_t size = lhs.holder->data.array->size();
-        std::vector<Value>::iterator begin = rhs.holder->data.array->begin();
-        std::vector<Value>::iterator end   = rhs.holder->data.array->end();
-
-        for(size_t i = 0; i < size; ++i)
-        {
-            const Value &item = (*lhs.holder->data.array)[i];
-            std::vector<Value>::iterator it = std::find(begin, end, item);
-            if( it == end )
-                vec->push_back(item);
-        }
-
-        return result;
+        return lhs.difference(rhs);
     }
     else
     {
@@ -735,15 +2111,15 @@ Value operator * (const Value &lhs, const Value &rhs)
     if( (lhs.type() == Value::String || lhs.type() == Value::UnsafeString)
             && rhs.type() == Value::Int )
     {
-        const std::string *source = lhs.holder->data.string;
+        const char *source = lhs.stringData();
         std::string result;
         int factor = rhs.toInt();
-        int size = source->size();
+        int size = lhs.stringSize();
 
         result.reserve(size * factor);
 
         for(int i = 0; i < factor; ++i)
-            result.insert( result.end(), source->begin(), source->end() );
+            result.append(source, size);
 
         return result;
     }
@@ -751,7 +2127,8 @@ Value operator * (const Value &lhs, const Value &rhs)
     {
         Value result(Value::Array);
         std::vector<Value> *vec = result.holder->data.array;
-        const std::vector<Value> *source = lhs.holder->data.array;
+        std::vector<Value> buffer;
+        const std::vector<Value> *source = &lhs.arrayItems(buffer);
         int factor = rhs.toInt();
 
         vec->reserve(source->size() * factor);
@@ -848,34 +2225,80 @@ bool operator == (const Value &lhs, const Value &rhs)
             return false;
     case Value::Int:
         if(rhs.type() == Value::Int)
-            return lhs.toInt() == rhs.toInt();
+            return lhs.toInt64() == rhs.toInt64();
         else if(rhs.type() == Value::Double)
-            return lhs.toInt() == rhs.toDouble();
+            return Value::integralDouble(lhs, rhs);
         else
             return false;
     case Value::Double:
         if(rhs.type() == Value::Double)
             return lhs.toDouble() == rhs.toDouble();
         else if( rhs.type() == Value::Int)
-            return lhs.toDouble() == rhs.toInt();
+            return Value::integralDouble(rhs, lhs);
         else
             return false;
     case Value::String:
     case Value::UnsafeString:
         if(rhs.type() == Value::String || rhs.type() == Value::UnsafeString)
-            return lhs.toString() == rhs.toString();
+            return compareStrings(lhs, rhs) == 0;
         else
             return false;
     case Value::Array:
         if(rhs.type() == Value::Bool)
+        {
             return lhs.toBool() == rhs.toBool();
+        }
+        else if(rhs.type() == Value::Array)
+        {
+            if( lhs.holder == rhs.holder )
+                return true;
+            else if( lhs.isPacked() || rhs.isPacked() )
+                return lhs.equals(rhs);
+
+            const std::vector<Value> &lhsArray = *lhs.holder->data.array;
+            const std::vector<Value> &rhsArray = *rhs.holder->data.array;
+
+            if( lhsArray.size() != rhsArray.size() )
+                return false;
+
+            for(size_t i = 0; i < lhsArray.size(); ++i)
+            {
+                if( lhsArray[i] != rhsArray[i] )
+                    return false;
+            }
+
+            return true;
+        }
         else
+        {
             return false;
+        }
     case Value::Object:
         if(rhs.type() == Value::Object)
-            return lhs.holder.get() == rhs.holder.get();
+        {
+            const std::map<std::string, Value> &lhsMembers = *lhs.holder->data.members;
+            const std::map<std::string, Value> &rhsMembers = *rhs.holder->data.members;
+
+            if( lhs.holder == rhs.holder )
+                return true;
+            else if( lhsMembers.size() != rhsMembers.size() )
+                return false;
+
+            std::map<std::string, Value>::const_iterator lhsIt = lhsMembers.begin();
+            std::map<std::string, Value>::const_iterator rhsIt = rhsMembers.begin();
+
+            for(; lhsIt != lhsMembers.end(); ++lhsIt, ++rhsIt)
+            {
+                if( lhsIt->first != rhsIt->first || lhsIt->second != rhsIt->second )
+                    return false;
+            }
+
+            return true;
+        }
         else
+        {
             return false;
+        }
     default:
         return false;
     }
@@ -928,7 +2351,7 @@ bool operator > (const Value &lhs, const Value &rhs)
     case Value::String:
     case Value::UnsafeString:
         if(rhs.type() == Value::String || rhs.type() == Value::UnsafeString)
-            return lhs.toString() > rhs.toString();
+            return compareStrings(lhs, rhs) > 0;
         else
             return false;
     case Value::Array:
@@ -982,7 +2405,7 @@ bool operator < (const Value &lhs, const Value &rhs)
     case Value::String:
     case Value::UnsafeString:
         if(rhs.type() == Value::String || rhs.type() == Value::UnsafeString)
-            return lhs.toString() < rhs.toString();
+            return compareStrings(lhs, rhs) < 0;
         else
             return false;
     case Value::Array:
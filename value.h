@@ -14,11 +14,28 @@
 #include <stdint.h>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/type_traits/integral_constant.hpp>
 
 namespace cpptl {
 
 class Holder;
+struct PackedArray;
+struct LazyValue;
+struct StringView;
+struct StringRope;
+
+template<typename T>
+struct ValueTypeInfo;
+
+// Where Value::writeJson() puts the text, in parts of a few KB
+class JsonSink {
+public:
+    virtual ~JsonSink() {}
+    virtual void write(const char *data, size_t size) = 0;
+};
 
 class Value {
 public:
@@ -35,6 +52,8 @@ public:
         Object = 6,
         UserType = 7,
         UnsafeString = 8,
+        Lazy = 9,       // computed on the first read, see lazy()
+        Generator = 10, // items made while iterating, see generator()
         Last = 0xFFFFFFFF
     };
 
@@ -60,6 +79,14 @@ public:
     Value(const char *s, const UnsafeStringTag &);
     Value(const std::string &s, const UnsafeStringTag &);
 
+    /* A string of size bytes at data, which are not copied. The anchor owns
+     * the memory (a buffer of the storage layer, a memory map...) and is
+     * kept by the value and its copies, so the bytes live as long as any of
+     * them. */
+    Value(const char *data, size_t size, const boost::shared_ptr<const void> &anchor);
+    Value(const char *data, size_t size, const boost::shared_ptr<const void> &anchor,
+          const UnsafeStringTag &);
+
     ~Value();
 
     Type type() const;
@@ -78,6 +105,49 @@ public:
 
     std::string toString() const;
 
+    /* the bytes of a string in place (not null terminated), valid while the
+     * value lives; NULL and 0 for other types */
+    const char *stringData() const;
+    size_t stringSize() const;
+
+    /* Appends a string to out, through write if it is given. A string made
+     * by + is kept as its pieces, stringData() joins them once, this
+     * writes them one by one. */
+    typedef void (*StringWriter)(std::string &out, const char *data, size_t size);
+    void appendString(std::string &out, StringWriter write = NULL) const;
+    /* Writes a member of a user type without making a Value of it, if the
+     * type can (see ValueTypeInfoBase::writeMember), strings go through
+     * write. False for the other values. */
+    bool writeMember(const std::string &name, std::string &out, StringWriter write) const;
+
+    /* Writes the value as JSON that may be put into a <script> element:
+     * <, >, & and the line separators in strings are written as \u escapes.
+     * User types are written by ValueTypeInfo::writeJson() or as the array
+     * of their items, numbers that are not finite as null. */
+    void writeJson(JsonSink &sink) const;
+    void writeJson(std::string &out) const;
+
+    /* structural hash, equal values have equal hashes (1 and 1.0 too) */
+    size_t hash() const;
+    /* compares arrays and objects item by item, unlike == a string and
+     * an unsafe string are never equal */
+    bool equals(const Value &other) const;
+    /* as equals(), but an integer and a double are never equal either: 15
+     * and 15.0 render differently (15 / 2 is 7), so renders are cached by
+     * identical contexts. Values of other types are equal by identity. */
+    bool identical(const Value &other) const;
+    /* copy that shares no arrays and objects with this value, they are
+     * not frozen in the copy */
+    Value clone() const;
+
+    /* Makes the value and everything in it read only (for every Value
+     * sharing it). Frozen values keep their hash, so hashing and comparing
+     * large contexts used many times is cheap. Changes of a frozen array or
+     * object are lost: append does nothing, operator[] logs and gives an
+     * empty value of its own, read items through the const operator[]. */
+    void freeze();
+    bool isFrozen() const;
+
     //TODO get(index), get(name), isValidIndex(int), size
     //TODO isEmpty for NULL, empty string, empty object, empty array...
     //TODO append for array, object
@@ -88,6 +158,8 @@ public:
 
     /* object */
     bool hasMember(const std::string &name) const;
+    // hasMember() and member() with one lookup, result is set if there is one
+    bool findMember(const std::string &name, Value &result) const;
     Value member(const std::string &name);
     const Value member(const std::string &name) const;
 
@@ -96,6 +168,8 @@ public:
 
     /* array */
     Value append(const Value &value);
+    /* room for size items, appending them does not reallocate */
+    void reserve(size_t size);
 
     Value at(size_t arrayIndex);
     const Value at(size_t arrayIndex) const;
@@ -103,27 +177,58 @@ public:
     Value &operator[] (size_t arrayIndex);
     const Value operator[] (size_t arrayIndex) const;
 
-    class ValueIteratorPrivate;
-    class ValueIterator  {
-    public:
-        ValueIterator(const Value &value);
-        ~ValueIterator();
-
-        bool hasNext() const;
-        bool hasPrev() const;
-
-        const Value &next();
-        const Value &prev();
-
-        Value value() const;
-
-    private:
-        boost::scoped_ptr<ValueIteratorPrivate> pimpl;
-    };
+    /* set operations on arrays, items are matched with == by hash. The
+     * result keeps the order of the first array, then of the second one.
+     * difference keeps repeated items (as operator -), the others give every
+     * item once. Only numbers and strings match items of another type, an
+     * array does not match true as it does with ==. */
+    Value difference(const Value &other) const;
+    Value unite(const Value &other) const;
+    Value intersection(const Value &other) const;
+    Value unique() const;
+
+    /* items of a packed array of integers or doubles (see isPacked), NULL
+     * for other values, valid until the array is changed */
+    const int64_t *packedIntegers() const;
+    const double *packedDoubles() const;
+
+    /* gives the next item of a generator, false at the end */
+    typedef boost::function<bool (Value &item)> Generate;
+
+    /* A value computed by the callback when a template reads it, so a
+     * context can offer members that most renders never look at. The
+     * result is computed once and kept for every copy of the value.
+     * Templates resolve lazy members themselves, helpers see them as
+     * they are and call resolve(). */
+    static Value lazy(const boost::function<Value ()> &compute);
+    /* An array whose items are made one by one while @for (or
+     * ValueIterator) goes over it, it is never built. start is called for
+     * every iteration and returns the function giving the items. size() of a
+     * generator is 0, loop.count is known at the last item only. */
+    static Value generator(const boost::function<Generate ()> &start);
+
+    /* the computed value of a lazy value, the value itself otherwise */
+    Value resolve() const;
+    /* an array of the items of a generator, the value itself otherwise */
+    Value materialize() const;
+
+    /* true if the double is exactly the integer, == of an Int and a Double */
+    static bool equalNumbers(int64_t integer, double d);
+
+    class ValueIterator;
 
     template<typename T>
     static Value fromValue(const T &value);
 
+    /* A value referring to the object without copying it, the object must
+     * outlive the value. Templates see the fields of a described struct (see
+     * VALUE_DECLARE_STRUCT) and iterate a vector of them; numbers, strings
+     * and Values are copied as usual. fromValue() of a described struct
+     * works the same way on a copy. */
+    template<typename T>
+    static Value reference(const T &object);
+    static Value reference(const Value &value) { return value; }
+
     template<typename T>
     T toValue() const;
 
@@ -132,24 +237,106 @@ public:
 
 protected:
     static int64_t safeCastToNumber(const Value &);
+    static bool integralDouble(const Value &integer, const Value &d);
+    bool equals(const Value &other, bool exact) const;
+
+    /* Arrays of only bools, only integers or only doubles keep them as plain
+     * numbers. An empty array is packed by the first append of a number and
+     * unpacked by the first change that does not fit. */
+    bool isPacked() const;
+    bool appendPacked(const Value &value);
+    std::vector<Value> &unpack();
+    // the items of an array, built into buffer for a packed one
+    const std::vector<Value> &arrayItems(std::vector<Value> &buffer) const;
+    Value arraySetOperation(int operation, const Value &other) const;
 
     static bool convertHelper(const Value &v, Value::Type type, void *ptr);
+    static Value concatenate(const Value &lhs, const Value &rhs);
+    static void releaseRope(StringRope *rope);
+    // sink is given the text when out grows large
+    void writeJson(std::string &out, JsonSink *sink) const;
+
+    template<typename T>
+    static Value referenceValue(const T &object, boost::true_type /*user type*/);
+    template<typename T>
+    static Value referenceValue(const T &object, boost::false_type);
 
 private:
+    class Holder;
+
     struct UserTypeHolderBase {
         virtual ~UserTypeHolderBase() {};
         virtual const std::type_info &type() const = 0;
+        virtual const void *object() const = 0;
+
+        // what ValueTypeInfo tells about the object: fields and items
+        virtual bool member(const std::string &name, Value *result) const = 0;
+        virtual size_t size() const = 0;
+        virtual Value at(size_t index) const = 0;
+        virtual bool writeJson(std::string &out) const = 0;
+        virtual bool seek(size_t index) = 0;
+        virtual bool isReference() const = 0;
+        virtual bool writeMember(const std::string &name, std::string &out,
+                                 StringWriter write) const = 0;
+
+        // the value an item or a member referring into its object was taken
+        // from, kept alive as long as the reference is, see ownedPart()
+        boost::shared_ptr<Holder> owner;
     };
 
-    template<typename T>
+    // the object itself or a pointer to it, see reference()
+    template<typename T, typename Store = T>
     struct UserTypeHolder : public UserTypeHolderBase {
-        UserTypeHolder(const T &t) : t(t) {}
+        UserTypeHolder(const Store &t) : t(t) {}
 
         virtual const std::type_info &type() const {
             return typeid(T);
         }
 
-        T t;
+        virtual const void *object() const {
+            return &get(t);
+        }
+
+        virtual bool member(const std::string &name, Value *result) const {
+            return ValueTypeInfo<T>::member(get(t), name, result);
+        }
+
+        virtual size_t size() const {
+            return ValueTypeInfo<T>::size(get(t));
+        }
+
+        virtual Value at(size_t index) const {
+            return ValueTypeInfo<T>::at(get(t), index);
+        }
+
+        virtual bool writeJson(std::string &out) const {
+            return ValueTypeInfo<T>::writeJson(get(t), out);
+        }
+
+        virtual bool seek(size_t index) {
+            return seekObject(t, index);
+        }
+
+        virtual bool isReference() const {
+            return isPointer(t);
+        }
+
+        virtual bool writeMember(const std::string &name, std::string &out,
+                                 StringWriter write) const {
+            return ValueTypeInfo<T>::writeMember(get(t), name, out, write);
+        }
+
+        static const T &get(const T &object) { return object; }
+        static const T &get(const T *object) { return *object; }
+
+        // a referenced object is not changed
+        static bool seekObject(T &object, size_t index) { return ValueTypeInfo<T>::seek(object, index); }
+        static bool seekObject(const T *, size_t) { return false; }
+
+        static bool isPointer(const T &) { return false; }
+        static bool isPointer(const T *) { return true; }
+
+        Store t;
 
     private:
         UserTypeHolder();
@@ -157,25 +344,47 @@ private:
         UserTypeHolder & operator = (const Holder &);
     };
 
+    const UserTypeHolderBase *userType() const;
+    // an item or a member of the user type, made to keep this value alive
+    // if it refers into the object
+    Value ownedPart(const Value &part) const;
+
     class Holder {
     public:
         Holder();
         ~Holder();
 
+        bool isWritable() const;
+
         union {
             bool b;
             int64_t i;
             double d;
             std::string *string;
+            StringView *view;
+            StringRope *rope;
             std::vector<Value> *array;
+            PackedArray *packed;
+            LazyValue *lazy;
+            boost::function<Generate ()> *generator;
             std::map<std::string, Value> *members;
             void *ptr;
             UserTypeHolderBase *userType;
         } data;
 
         Value::Type type;
+        bool packed;            // an array in data.packed
+        bool view;              // a string in data.view
+        bool rope;              // a string in data.rope
+
+        size_t hash;            // valid if hashed, set by freeze()
+        bool hashed;
+        bool frozen;
+        Value *discarded;       // what operator[] changes once frozen
     };
 
+    Value &discarded() const;
+
     mutable boost::shared_ptr<Holder> holder;
 
     friend class ValueIterator;
@@ -191,6 +400,41 @@ private:
     friend bool operator < (const Value &lhs, const Value &rhs);
 };
 
+class Value::ValueIterator {
+public:
+    ValueIterator(const Value &value);
+    ~ValueIterator();
+
+    bool hasNext() const;
+    bool hasPrev() const;
+
+    const Value &next();
+    const Value &prev();
+
+    Value value() const;
+    // the name of the member value() is, empty for arrays
+    const std::string &key() const;
+
+private:
+    const Value &packedItem(size_t position);
+    const Value &userItem(size_t position);
+
+    // kept inline, so iterating does not allocate
+    const Value &container;
+    std::map<std::string, Value>::const_iterator mapIterator;
+    std::vector<Value>::const_iterator arrayIterator;
+    // packed arrays: the position and the current item, reused while
+    // nobody else holds it (the reference from next() is valid until the
+    // next call)
+    const PackedArray *packed;
+    size_t index;
+    Value item;
+    // generators: the next item is made ahead, so hasNext() knows the end
+    Generate generate;
+    Value ahead;
+    bool more;
+};
+
 Value operator + (const Value &lhs, const Value &rhs);
 Value operator - (const Value &lhs, const Value &rhs);
 Value operator * (const Value &lhs, const Value &rhs);
@@ -203,7 +447,7 @@ bool operator <= (const Value &lhs, const Value &rhs);
 bool operator < (const Value &lhs, const Value &rhs);
 
 template<typename T>
-struct ValueTypeInfo {
+struct ValueTypeInfoBase {
     enum {
         id = Value::UserType
     };
@@ -211,8 +455,68 @@ struct ValueTypeInfo {
     static Value::Type typeId() {
         return static_cast<Value::Type>(id);
     }
+
+    // the field of a described struct by name, result may be NULL
+    static bool member(const T &, const std::string &, Value *) { return false; }
+    // the items of a container
+    static size_t size(const T &) { return 0; }
+    static Value at(const T &, size_t) { return Value(); }
+    // the object as JSON, false to write it as the array of its items
+    static bool writeJson(const T &, std::string &) { return false; }
+    // an item got from at() of a container moved to another index of it,
+    // so iterating reuses one item; false if at() makes a new one
+    static bool seek(T &, size_t) { return false; }
+    // the field written as a template writes its value, strings through
+    // write; false if there is no field or it has to be read by member()
+    static bool writeMember(const T &, const std::string &, std::string &, Value::StringWriter) {
+        return false;
+    }
+};
+
+template<typename T>
+struct ValueTypeInfo : public ValueTypeInfoBase<T> {
+};
+
+template<typename T>
+struct ValueTypeInfo< std::vector<T> > : public ValueTypeInfoBase< std::vector<T> > {
+    static size_t size(const std::vector<T> &vector) {
+        return vector.size();
+    }
+
+    static Value at(const std::vector<T> &vector, size_t index) {
+        return Value::reference(vector[index]);
+    }
 };
 
+/* Describes the fields of a struct for templates, at the global scope:
+ *
+ *   VALUE_DECLARE_STRUCT(Order)
+ *       VALUE_STRUCT_FIELD(id)
+ *       VALUE_STRUCT_FIELD(total)
+ *   VALUE_DECLARE_STRUCT_END()
+ *
+ * A field may be a bool, an integer, a double, a string, a Value, another
+ * described struct or a vector of them. */
+#define VALUE_DECLARE_STRUCT(TYPE) \
+    namespace cpptl { \
+    template<> \
+    struct ValueTypeInfo<TYPE> : public ValueTypeInfoBase<TYPE> { \
+        static bool member(const TYPE &object, const std::string &name, Value *result) { \
+            (void)object;
+
+#define VALUE_STRUCT_FIELD(FIELD) \
+            if( name == #FIELD ) { \
+                if( result ) \
+                    *result = Value::reference(object.FIELD); \
+                return true; \
+            }
+
+#define VALUE_DECLARE_STRUCT_END() \
+            return false; \
+        } \
+    }; \
+    }
+
 #define VALUE_DECLARE_METATYPE(TYPE,STORE_TYPE,NAME) \
     template<> \
     struct ValueTypeInfo<TYPE> { \
@@ -245,10 +549,10 @@ T Value::toValue() const
         if( toType == UserType )
         {
             if( typeid(T) == holder->data.userType->type() ) {
-                return static_cast<UserTypeHolder<T>*>( holder->data.userType )->t;
+                return *static_cast<const T *>( holder->data.userType->object() );
             }
         }
-        else if( toType == type() )
+        else if( toType == type() && holder->view == false && holder->rope == false )
         {
             switch(type())
             {
@@ -261,7 +565,7 @@ T Value::toValue() const
                 return *reinterpret_cast<const typename ValueTypeInfo<T>::value_type *>( &holder->data );
             }
         }
-        else if( type() == Array || type() == Object )
+        else if( type() == Array || type() == Object || type() == UserType )
         {
             return T(); // Can`t convert
         }
@@ -330,13 +634,34 @@ template<typename T>
 inline Value Value::fromValue(const T &value) {
     Value result;
 
-    result.holder.reset( new Holder );
+    result.holder = boost::make_shared<Holder>();
     result.holder->type = UserType;
     result.holder->data.userType = new UserTypeHolder<T>(value);
 
     return result;
 }
 
+template<typename T>
+inline Value Value::reference(const T &object) {
+    return referenceValue(object, boost::integral_constant<bool,
+                          static_cast<int>(ValueTypeInfo<T>::id) == static_cast<int>(UserType)>());
+}
+
+template<typename T>
+inline Value Value::referenceValue(const T &object, boost::true_type) {
+    Value result;
+
+    result.holder->type = UserType;
+    result.holder->data.userType = new UserTypeHolder<T, const T *>(&object);
+
+    return result;
+}
+
+template<typename T>
+inline Value Value::referenceValue(const T &object, boost::false_type) {
+    return Value(static_cast<typename ValueTypeInfo<T>::value_type>(object));
+}
+
 } // namespace cpptl
 
 #endif // CPPTL_VALUE_H
@@ -8,8 +8,14 @@
 
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
+#include <boost/weak_ptr.hpp>
+#include <sstream>
 
 #include "value.h"
+#include "jsonparser.h"
+#include "msgpackcodec.h"
+#include "snapshot.h"
+#include "table.h"
 
 using namespace cpptl;
 
@@ -328,5 +334,662 @@ BOOST_AUTO_TEST_CASE(value_ctor)
     BOOST_VERIFY(obj8.type() == Value::UserType);
 }
 
+BOOST_AUTO_TEST_CASE(value_hash_equals)
+{
+    Value obj1(Value::Object);
+    Value obj2(Value::Object);
+    Value arr1(Value::Array);
+    Value arr2(Value::Array);
+
+    arr1.append(1);
+    arr1.append("a");
+    arr2.append(1.0);
+    arr2.append("a");
+
+    obj1["list"] = arr1;
+    obj1["big"] = int64_t(1) << 40;
+    obj2["list"] = arr2;
+    obj2["big"] = double(int64_t(1) << 40);
+
+    BOOST_VERIFY(Value(1).hash() == Value(1.0).hash());
+    BOOST_VERIFY(Value(1).equals(Value(1.0)));
+    BOOST_VERIFY(Value(1).equals(Value(1.5)) == false);
+    BOOST_VERIFY(Value("a").equals(Value("a", Value::UnsafeStringTag())) == false);
+
+    BOOST_VERIFY(arr1 == arr2);
+    BOOST_VERIFY(obj1 == obj2);
+    BOOST_VERIFY(obj1.equals(obj2));
+    BOOST_VERIFY(obj1.hash() == obj2.hash());
+    BOOST_VERIFY(obj1.identical(obj2) == false && obj1.identical(obj1.clone()));
+    BOOST_VERIFY(Value(1).identical(Value(1.0)) == false && Value(1.5).identical(Value(1.5)));
+    BOOST_VERIFY(Value(int64_t(1) << 40) != Value((int64_t(1) << 40) + 1));
+
+    arr2.append(Value());
+    BOOST_VERIFY(arr1 != arr2);
+    BOOST_VERIFY(obj1.equals(obj2) == false);
+
+    // the copy does not change with the original
+    Value copy = obj1.clone();
+    obj1["list"].append(2);
+    BOOST_VERIFY(copy["list"].size() == 2);
+    BOOST_VERIFY(copy.equals(obj1) == false);
+
+    // frozen values keep the hash and can not be changed
+    size_t hash = copy.hash();
+    copy.freeze();
+    const Value &frozen = copy;
+    BOOST_VERIFY(copy.isFrozen());
+    BOOST_VERIFY(frozen["list"].isFrozen());
+    BOOST_VERIFY(copy.hash() == hash);
+
+    // the changes go to a value of the holder, the items are not shared
+    copy["other"] = 1;
+    copy["list"] = 2;
+    Value list = frozen["list"];
+    list.append(3);
+    list[0] = 5;
+    BOOST_VERIFY(copy.size() == 2);
+    BOOST_VERIFY(frozen["list"].size() == 2);
+    BOOST_VERIFY(frozen["list"][0].toInt() == 1);
+    BOOST_VERIFY(copy.hash() == hash);
+    BOOST_VERIFY(copy.clone().isFrozen() == false);
+}
+
+BOOST_AUTO_TEST_CASE(value_array_sets)
+{
+    Value lhs(Value::Array);
+    Value rhs(Value::Array);
+
+    // 1 2 "a" 2 3.0
+    lhs.append(1);
+    lhs.append(2);
+    lhs.append("a");
+    lhs.append(2);
+    lhs.append(3.0);
+
+    // 3 "a" 4 4
+    rhs.append(3);
+    rhs.append(Value("a", Value::UnsafeStringTag()));
+    rhs.append(4);
+    rhs.append(4);
+
+    Value difference = lhs - rhs;
+    BOOST_VERIFY(difference.size() == 3);
+    BOOST_VERIFY(difference[0] == 1 && difference[1] == 2 && difference[2] == 2);
+    BOOST_VERIFY(lhs.difference(rhs) == difference);
+
+    Value united = lhs.unite(rhs);
+    BOOST_VERIFY(united.size() == 5);
+    BOOST_VERIFY(united[0] == 1 && united[1] == 2 && united[2] == "a");
+    BOOST_VERIFY(united[3].type() == Value::Double && united[4] == 4);
+
+    Value intersection = lhs.intersection(rhs);
+    BOOST_VERIFY(intersection.size() == 2);
+    BOOST_VERIFY(intersection[0] == "a" && intersection[1] == 3);
+
+    Value unique = rhs.unique();
+    BOOST_VERIFY(unique.size() == 3);
+    BOOST_VERIFY(unique[2] == 4);
+
+    Value sum = lhs + rhs;
+    BOOST_VERIFY(sum.size() == 9);
+    BOOST_VERIFY(sum[5] == 3);
+
+    BOOST_VERIFY(lhs.unite(Value(1)).isNull());
+    BOOST_VERIFY(Value(1).unique().isNull());
+
+    // items of different types do not match, though == of an array and
+    // a bool compares their truth
+    Value flags(Value::Array);
+    Value others(Value::Array);
+    Value list(Value::Array);
+
+    list.append(1);
+    flags.append(true);
+    flags.append(1);
+    others.append(list);
+    others.append(1.0);
+
+    BOOST_VERIFY(others[0] == Value(true));
+    BOOST_VERIFY(flags.difference(others).size() == 1 && flags.difference(others)[0] == true);
+    BOOST_VERIFY(flags.intersection(others).size() == 1 && flags.intersection(others)[0] == 1);
+    BOOST_VERIFY(flags.unite(others).size() == 3);
+}
+
+BOOST_AUTO_TEST_CASE(value_packed_array)
+{
+    Value ints(Value::Array);
+    Value values(Value::Array);
+
+    for(int i = 0; i < 5; ++i)
+    {
+        ints.append(i);
+        values.append(Value(Value::Null));
+        values[i] = i;
+    }
+
+    BOOST_VERIFY(ints.size() == 5);
+    BOOST_VERIFY(ints.at(3) == 3);
+    BOOST_VERIFY(ints[4].type() == Value::Int);
+
+    // the same contents as an array of Values
+    Value copy(Value::Array);
+    for(int i = 0; i < 5; ++i)
+        copy.append(i);
+
+    BOOST_VERIFY(copy == values);
+    BOOST_VERIFY(copy.equals(values));
+    BOOST_VERIFY(copy.hash() == values.hash());
+
+    int64_t sum = 0;
+    Value::ValueIterator it(copy);
+    while( it.hasNext() )
+    {
+        const Value &item = it.next();
+        Value kept = item;
+
+        sum += item.toInt64();
+        BOOST_VERIFY(kept == item);
+    }
+    BOOST_VERIFY(sum == 10);
+
+    // doubles and bools, a value of another type unpacks the array
+    Value doubles(Value::Array);
+    doubles.append(0.5);
+    doubles.append(1.5);
+    BOOST_VERIFY(doubles[1] == 1.5);
+    doubles.append(true);
+    BOOST_VERIFY(doubles.size() == 3);
+    BOOST_VERIFY(doubles[2].type() == Value::Bool && doubles[0] == 0.5);
+
+    Value bools(Value::Array);
+    bools.append(true);
+    bools.append(false);
+    BOOST_VERIFY(bools[0] == true && bools[1] == false);
+
+    // writes through a reference unpack it too
+    copy[1] = "one";
+    BOOST_VERIFY(copy.size() == 5 && copy[1] == "one" && copy[2] == 2);
+
+    Value sum2 = values + values;
+    BOOST_VERIFY(sum2.size() == 10 && sum2[7] == 2);
+    BOOST_VERIFY((values - ints).size() == 0);
+    BOOST_VERIFY(values.clone() == values);
+
+    // growing by index gives null items
+    BOOST_VERIFY(ints.at(7).isNull());
+    BOOST_VERIFY(ints.size() == 8 && ints[4] == 4);
+}
+
+BOOST_AUTO_TEST_CASE(value_string_view)
+{
+    boost::shared_ptr<std::string> buffer(new std::string("<b>article body</b>, tail"));
+    boost::weak_ptr<std::string> watch = buffer;
+    Value copy;
+
+    {
+        // the view is the first 19 bytes, the buffer is not copied
+        Value view(buffer->data(), 19, buffer);
+
+        BOOST_VERIFY(view.type() == Value::String);
+        BOOST_VERIFY(view.stringData() == buffer->data() && view.stringSize() == 19);
+        BOOST_VERIFY(view.toString() == "<b>article body</b>");
+        BOOST_VERIFY(view == Value("<b>article body</b>"));
+        BOOST_VERIFY(view != Value("<b>article body</b>, tail"));
+        BOOST_VERIFY(view < Value("<c>"));
+        BOOST_VERIFY(view.hash() == Value("<b>article body</b>").hash());
+        BOOST_VERIFY(view.equals(Value("<b>article body</b>")));
+
+        copy = view;
+    }
+
+    // the copy keeps the buffer alive after its owner let it go
+    buffer.reset();
+    BOOST_VERIFY(watch.expired() == false);
+    BOOST_VERIFY(copy.toString() == "<b>article body</b>");
+
+    // a changed value gets a string of its own
+    copy = copy + Value("!");
+    BOOST_VERIFY(watch.expired());
+    BOOST_VERIFY(copy.toString() == "<b>article body</b>!");
+
+    boost::shared_ptr<std::string> html(new std::string("<i>"));
+    Value unsafe(html->data(), html->size(), html, Value::UnsafeStringTag());
+
+    BOOST_VERIFY(unsafe.type() == Value::UnsafeString && unsafe.toString() == "<i>");
+    BOOST_VERIFY(unsafe.equals(Value("<i>")) == false && unsafe == Value("<i>"));
+}
+
+BOOST_AUTO_TEST_CASE(value_string_rope)
+{
+    const std::string piece(100, 'x');
+    Value text("");
+    std::string expected;
+
+    // pieces are linked, not copied into a new string every time
+    for(int i = 0; i < 10000; ++i)
+    {
+        text = text + Value(piece + "<");
+        expected += piece + "<";
+    }
+
+    BOOST_VERIFY(text.type() == Value::String);
+    BOOST_VERIFY(text.stringSize() == expected.size());
+
+    std::string out;
+    text.appendString(out);
+    BOOST_VERIFY(out == expected);
+
+    BOOST_VERIFY(text == Value(expected));
+    BOOST_VERIFY(text.hash() == Value(expected).hash());
+    BOOST_VERIFY(text.toString() == expected);
+    BOOST_VERIFY(std::string(text.stringData(), text.stringSize()) == expected);
+
+    // short strings are joined right away
+    Value small = Value("a") + Value("b", Value::UnsafeStringTag());
+    BOOST_VERIFY(small.toString() == "ab" && small.type() == Value::String);
+
+    // a very deep string is released without a deep recursion
+    Value deep("");
+    for(int i = 0; i < 200000; ++i)
+        deep = deep + Value(piece);
+    BOOST_VERIFY(deep.stringSize() == 200000 * piece.size());
+    deep = Value();
+}
+BOOST_AUTO_TEST_CASE(value_json_parser)
+{
+    const std::string json = "{\"id\": 12, \"price\": -1.5e2, \"name\": \"caf\\u00e9 \\\"A\\\"\","
+            " \"tags\": [\"a\", \"b\"], \"ok\": true, \"none\": null,"
+            " \"big\": 92233720368547758070, \"items\": [{\"n\": 1}, {\"n\": 2}], \"empty\": {}}";
+    std::string error;
+    Value value = parseJson(json, &error);
+
+    BOOST_VERIFY(error.empty() && value.type() == Value::Object);
+    BOOST_VERIFY(value["id"].type() == Value::Int && value["id"] == 12);
+    BOOST_VERIFY(value["price"] == -150.0);
+    BOOST_VERIFY(value["name"].toString() == "caf\xC3\xA9 \"A\"");
+    BOOST_VERIFY(value["tags"].size() == 2 && value["tags"][1] == "b");
+    BOOST_VERIFY(value["ok"] == true && value["none"].isNull());
+    BOOST_VERIFY(value["big"].type() == Value::Double);
+    BOOST_VERIFY(value["items"][1]["n"] == 2 && value["empty"].size() == 0);
+
+    // the same document given byte by byte
+    JsonValueBuilder builder;
+    JsonParser parser(builder);
+
+    for(size_t i = 0; i < json.size(); ++i)
+        BOOST_VERIFY(parser.feed(&json[i], 1));
+    BOOST_VERIFY(parser.finish());
+    BOOST_VERIFY(builder.result().equals(value));
+
+    // a number at the very end is complete at finish()
+    BOOST_VERIFY(parseJson("[1, 2.5]").size() == 2 && parseJson("-17") == -17);
+
+    // long strings without escapes refer to the shared text
+    boost::shared_ptr<const std::string> text(new std::string("[\"" + std::string(100, 'x') + "\"]"));
+    Value items = parseJson(text);
+    BOOST_VERIFY(items[0].stringData() == text->data() + 2 && items[0].stringSize() == 100);
+
+    const char *bad[] = { "", "[1,]", "{\"a\" 1}", "[01]", "\"\\x\"", "[1] 2", "[tru]", "{\"a\":1", "\"\\ud800\"" };
+
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+    {
+        error.clear();
+        BOOST_VERIFY(parseJson(bad[i], &error).isNull() && error.empty() == false);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(value_json_lazy)
+{
+    boost::shared_ptr<const std::string> json(new std::string(
+            "{\"id\": 12, \"price\": -1.5e2, \"n\\u0061me\": \"caf\\u00e9\", \"ok\": true,"
+            " \"none\": null, \"items\": [{\"n\": 1}, {\"n\": 2}, []],"
+            " \"text\": \"" + std::string(100, 'x') + "\"}"));
+    std::string error;
+    Value value = parseJsonLazy(json, &error);
+
+    BOOST_VERIFY(error.empty() && value.type() == Value::UserType && value.size() == 7);
+    BOOST_VERIFY(value.member("id").type() == Value::Int && value.member("id") == 12);
+    BOOST_VERIFY(value.member("price") == -150.0);
+    BOOST_VERIFY(value.hasMember("name") && value.member("name").toString() == "caf\xC3\xA9");
+    BOOST_VERIFY(value.member("ok") == true && value.hasMember("none") && value.member("none").isNull());
+    BOOST_VERIFY(value.hasMember("missing") == false && value.member("missing").isNull());
+
+    // containers stay lazy, their items are decoded one by one
+    Value items = value.member("items");
+    BOOST_VERIFY(items.type() == Value::UserType && items.size() == 3 && items.at(2).size() == 0);
+    BOOST_VERIFY(items.at(1).member("n") == 2 && items.at(3).isNull());
+
+    Value::ValueIterator it(items);
+    int sum = 0;
+
+    while( it.hasNext() )
+    {
+        const Value &item = it.next();
+
+        if( item.hasMember("n") )
+            sum += item.member("n").toValue<int>();
+    }
+    BOOST_VERIFY(sum == 3);
+
+    // long strings without escapes refer to the text
+    BOOST_VERIFY(value.member("text").stringData() == json->data() + json->size() - 102);
+
+    // large objects are looked up by a key index, the first of equal keys wins
+    std::string large = "{\"k\\u0030\": 0";
+
+    for(int i = 1; i < 40; ++i)
+        large += ", \"k" + std::to_string(i) + "\": " + std::to_string(i);
+
+    Value big = parseJsonLazy(boost::make_shared<const std::string>(large + ", \"k7\": 70}"));
+    Value found;
+
+    BOOST_VERIFY(big.size() == 41 && big.member("k0") == 0 && big.member("k39") == 39);
+    BOOST_VERIFY(big.member("k7") == 7 && big.hasMember("k40") == false);
+    BOOST_VERIFY(big.findMember("k12", found) && found == 12 && !big.findMember("k", found) && found == 12);
+    BOOST_VERIFY(value.findMember("name", found) && found.toString() == "caf\xC3\xA9");
+
+    // scalars are decoded right away
+    BOOST_VERIFY(parseJsonLazy(boost::make_shared<const std::string>("\"a\"")) == "a");
+
+    const char *bad[] = { "", "[1,]", "{\"a\" 1}", "[01]", "\"\\x\"", "[1] 2", "[tru]", "{\"a\":1", "[\"a\tb\"]" };
+
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+    {
+        error.clear();
+        BOOST_VERIFY(parseJsonLazy(boost::make_shared<const std::string>(bad[i]), &error).isNull()
+                     && error.empty() == false);
+    }
+}
+
+struct StringSink : public JsonSink {
+    StringSink() : writes(0) {}
+
+    virtual void write(const char *data, size_t size) {
+        text.append(data, size);
+        ++writes;
+    }
+
+    std::string text;
+    size_t writes;
+};
+
+BOOST_AUTO_TEST_CASE(value_write_json)
+{
+    Value value(Value::Object);
+    Value items(Value::Array);
+
+    for(int i = 0; i < 10000; ++i)
+        items.append(i % 3 ? Value(i * 0.5) : Value("item <" + std::to_string(i) + ">"));
+
+    value["items"] = items;
+    value["count"] = 10000;
+    value["empty"] = Value(Value::Array);
+
+    // the sink gets the text in parts, the same as a string gets it
+    StringSink sink;
+    std::string json;
+
+    value.writeJson(sink);
+    value.writeJson(json);
+    BOOST_VERIFY(sink.writes > 1 && sink.text == json);
+    BOOST_VERIFY(json.find('<') == std::string::npos && json.find("\\u003c") != std::string::npos);
+    BOOST_VERIFY(parseJson(json).equals(value));
+
+    // an indexed document is written as its text, escaped the same way
+    Value lazy = parseJsonLazy(boost::make_shared<const std::string>("{\"a\": [1, \"</b>\"]}"));
+    std::string text;
+
+    lazy.writeJson(text);
+    BOOST_VERIFY(text == "{\"a\": [1, \"\\u003c/b\\u003e\"]}");
+
+    text.clear();
+    lazy.member("a").writeJson(text);
+    BOOST_VERIFY(text == "[1, \"\\u003c/b\\u003e\"]");
+}
+
+BOOST_AUTO_TEST_CASE(value_msgpack)
+{
+    Value value(Value::Object);
+    Value numbers(Value::Array);
+    Value mixed(Value::Array);
+    const int64_t integers[] = { 0, 127, 128, 255, 256, 65536, -1, -32, -33, -129, -32769,
+                                 INT64_MAX, INT64_MIN, 4294967296LL };
+
+    for(size_t i = 0; i < sizeof(integers) / sizeof(integers[0]); ++i)
+        numbers.append(integers[i]);
+
+    mixed.append(Value());
+    mixed.append(true);
+    mixed.append(-2.5);
+    mixed.append(Value("<b>safe</b>", Value::UnsafeStringTag()));
+    mixed.append(std::string(70000, 'x'));
+
+    value["numbers"] = numbers;
+    value["mixed"] = mixed;
+    value["doubles"] = Value(Value::Array);
+    value["doubles"].append(0.1);
+    value["doubles"].append(1e300);
+    value["name"] = "caf\xC3\xA9";
+    value["long"] = Value("a") + Value(std::string(300, 'b'));
+    value["empty"] = Value(Value::Object);
+
+    std::string data;
+    std::string error;
+
+    encodeMsgPack(value, data);
+    BOOST_VERIFY(data.size() < 72000);
+
+    Value decoded = decodeMsgPack(data, &error);
+    BOOST_VERIFY(error.empty() && decoded.equals(value));
+    BOOST_VERIFY(decoded["mixed"][3].type() == Value::UnsafeString);
+    BOOST_VERIFY(decoded["numbers"][11] == INT64_MAX && decoded["numbers"][12] == INT64_MIN);
+
+    // streams, one value after another
+    std::stringstream stream;
+
+    encodeMsgPack(value, stream);
+    encodeMsgPack(Value(7), stream);
+    BOOST_VERIFY(stream.str().compare(0, data.size(), data) == 0);
+    BOOST_VERIFY(decodeMsgPack(stream).equals(value) && decodeMsgPack(stream) == 7);
+    BOOST_VERIFY(decodeMsgPack(stream, &error).isNull() && stream.fail() && error.empty() == false);
+
+    // long strings of a shared buffer refer to it
+    boost::shared_ptr<const std::string> buffer = boost::make_shared<const std::string>(data);
+    Value view = decodeMsgPack(buffer);
+    const char *text = view["mixed"][4].stringData();
+
+    BOOST_VERIFY(view.equals(value) && text > buffer->data() && text < buffer->data() + buffer->size());
+
+    // every cut of the data is an error, not a crash
+    for(size_t size = 0; size < data.size(); size += 1 + size / 8)
+    {
+        error.clear();
+        BOOST_VERIFY(decodeMsgPack(data.data(), size, &error).isNull() && error.empty() == false);
+    }
+
+    BOOST_VERIFY(decodeMsgPack("\xC1", 1, &error).isNull() && error.empty() == false);
+    BOOST_VERIFY(decodeMsgPack("\x81\x01\x02", 3, &error).isNull() && error.empty() == false);
+}
+
+BOOST_AUTO_TEST_CASE(value_snapshot)
+{
+    Value value(Value::Object);
+    Value users(Value::Array);
+
+    for(int i = 0; i < 100; ++i)
+    {
+        Value user(Value::Object);
+
+        user["id"] = i;
+        user["name"] = "user" + Value(i).toString();
+        user["score"] = i / 4.0;
+        user["active"] = i % 2 == 0;
+        users.append(user);
+    }
+
+    value["users"] = users;
+    value["title"] = Value("<b>top</b>", Value::UnsafeStringTag());
+    value["empty"] = Value(Value::Array);
+    value["none"] = Value();
+
+    std::stringstream stream;
+    BOOST_VERIFY(writeSnapshot(value, stream));
+
+    boost::shared_ptr<const std::string> buffer = boost::make_shared<const std::string>(stream.str());
+    std::string error;
+    const Value snapshot = openSnapshot(buffer->data(), buffer->size(), buffer, &error);
+
+    BOOST_VERIFY(error.empty() && snapshot.type() == Value::UserType);
+    BOOST_VERIFY(snapshot.size() == 4 && snapshot.hasMember("users") && !snapshot.hasMember("user"));
+    BOOST_VERIFY(snapshot["users"].size() == 100 && snapshot["empty"].size() == 0);
+    BOOST_VERIFY(snapshot["none"].isNull() && snapshot["title"].type() == Value::UnsafeString);
+    BOOST_VERIFY(snapshot["users"][42]["name"] == "user42" && snapshot["users"][42]["id"] == 42);
+    BOOST_VERIFY(snapshot["users"][42]["score"] == 10.5 && snapshot["users"][41]["active"] == false);
+    BOOST_VERIFY(snapshot["users"][100].isNull());
+
+    // strings are the bytes of the snapshot
+    const char *text = snapshot["users"][7]["name"].stringData();
+    BOOST_VERIFY(text > buffer->data() && text < buffer->data() + buffer->size());
+
+    int count = 0;
+    const Value list = snapshot["users"];
+    Value::ValueIterator it(list);
+
+    while( it.hasNext() )
+        count += it.next()["id"].toInt();
+
+    BOOST_VERIFY(count == 99 * 100 / 2);
+
+    std::string json;
+    std::string expected;
+
+    snapshot.writeJson(json);
+    value.writeJson(expected);
+    BOOST_VERIFY(json == expected);
+
+    // a file mapped by several readers
+    const std::string fileName = "value_test.snapshot";
+
+    BOOST_VERIFY(writeSnapshot(value, fileName, &error));
+
+    const Value first = openSnapshot(fileName, &error);
+    Value second = openSnapshot(fileName, &error);
+
+    json.clear();
+    second.writeJson(json);
+    BOOST_VERIFY(error.empty() && first["users"][99]["name"] == "user99" && json == expected);
+    remove(fileName.c_str());
+
+    BOOST_VERIFY(openSnapshot(fileName, &error).isNull() && error.empty() == false);
+
+    // a damaged snapshot reads as null, not a crash
+    for(size_t size = 0; size < buffer->size(); size += 1 + size / 4)
+    {
+        error.clear();
+        BOOST_VERIFY(openSnapshot(buffer->data(), size, buffer, &error).isNull() && error.empty() == false);
+    }
+
+    std::string damaged = *buffer;
+
+    for(size_t i = 16; i + 24 < damaged.size(); i += 7)
+        damaged[i] = static_cast<char>(0xFF);
+
+    const Value broken = openSnapshot(damaged.data(), damaged.size(), buffer);
+    json.clear();
+    broken.writeJson(json);
+    broken["users"][5]["name"].toString();
+
+    // a string over 4 GiB is refused before its bytes are read, the view
+    // is never read
+    Value huge(Value::Object);
+    std::stringstream refused;
+
+    huge["text"] = Value(buffer->data(), (uint64_t(1) << 32) + 5, buffer);
+    error.clear();
+    BOOST_VERIFY(writeSnapshot(huge, refused, &error) == false && error.find("a string") == 0);
+    const std::string partial = refused.str();
+    BOOST_VERIFY(openSnapshot(partial.data(), partial.size(), buffer).isNull());
+
+    error.clear();
+    BOOST_VERIFY(writeSnapshot(huge, fileName, &error) == false && error.find("too large") != std::string::npos);
+    BOOST_VERIFY(openSnapshot(fileName).isNull() && openSnapshot(fileName + ".tmp").isNull());
+}
+
+BOOST_AUTO_TEST_CASE(value_table)
+{
+    Table table;
+
+    BOOST_VERIFY(table.addColumn("id", Value::Int) == 0);
+    table.addColumn("name", Value::String);
+    table.addColumn("ok", Value::Bool);
+    table.addColumn("extra", Value::Null);
+    table.reserve(3);
+
+    Value first(Value::Object);
+    first["id"] = 7;
+    first["name"] = "seven";
+    first["ok"] = true;
+    first["unknown"] = 1;
+    table.appendRow(first);
+
+    Value second(Value::Array);
+    second.append("8");
+    second.append(8);
+    second.append(false);
+    second.append(Value(Value::Array));
+    table.appendRow(second);
+
+    table.appendRow();
+    table.set(1, "long text of the last row");
+    table.set(1, "nine");
+    table.set(0, 9);
+
+    BOOST_VERIFY(table.rowCount() == 3 && table.columnCount() == 4 && table.column("ok") == 2);
+    BOOST_VERIFY(table.column("unknown") == -1 && table.columnName(1) == "name");
+    BOOST_VERIFY(table.cell(1, 0) == 8 && table.cell(1, 1) == "8" && table.cell(2, 1) == "nine");
+    BOOST_VERIFY(table.cell(0, 3).isNull() && table.cell(1, 3).type() == Value::Array);
+    BOOST_VERIFY(table.cell(3, 0).isNull() && table.cell(0, 4).isNull());
+
+    const Value value = Value::fromValue(table);
+    BOOST_VERIFY(value.size() == 3 && value[0]["name"] == "seven" && value[2]["id"] == 9);
+    BOOST_VERIFY(value[1].hasMember("ok") && value[1]["ok"] == false && !value[1].hasMember("unknown"));
+
+    // the row is moved along the table, not made for every item
+    Value::ValueIterator it(value);
+    const Value *row = &it.next();
+
+    it.next();
+    BOOST_VERIFY(&it.next() == row && row->toValue<TableRow>().row == 2 && (*row)["name"] == "nine");
+
+    std::string json;
+    value.writeJson(json);
+    BOOST_VERIFY(json == "[{\"id\":7,\"name\":\"seven\",\"ok\":true,\"extra\":null},"
+                         "{\"id\":8,\"name\":\"8\",\"ok\":false,\"extra\":[]},"
+                         "{\"id\":9,\"name\":\"nine\",\"ok\":false,\"extra\":null}]");
+
+    // a copy of the row is kept, the next item is a new one
+    Value::ValueIterator copies(value);
+    const Value kept = copies.next();
+
+    BOOST_VERIFY(copies.next()["id"] == 8 && kept["id"] == 7);
+
+    // string cells are read in place and keep the columns alive
+    const Value name = value[2]["name"];
+    BOOST_VERIFY(name.stringData() == value[2]["name"].stringData() && name == "nine");
+
+    // cells written by a template do not become Values
+    std::string out;
+    BOOST_VERIFY(value[0].writeMember("id", out, NULL) && value[0].writeMember("name", out, NULL));
+    BOOST_VERIFY(value[0].writeMember("ok", out, NULL) && !value[0].writeMember("extra", out, NULL));
+    BOOST_VERIFY(out == "7seventrue" && !value[0].writeMember("unknown", out, NULL));
+
+    // the value keeps the rows it was made with, the table is copied to change
+    table.set(1, "changed");
+    table.appendRow();
+    BOOST_VERIFY(table.rowCount() == 4 && table.cell(2, 1) == "changed");
+    BOOST_VERIFY(value.size() == 3 && value[2]["name"] == "nine" && name == "nine");
+    BOOST_VERIFY(Value::fromValue(table).size() == 4);
+}
 
 BOOST_AUTO_TEST_SUITE_END()